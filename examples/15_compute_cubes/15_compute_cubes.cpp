@@ -1,7 +1,9 @@
 #include "imr/imr.h"
 #include "imr/util.h"
 
+#include <algorithm>
 #include <cmath>
+#include <thread>
 #include "nasl/nasl.h"
 #include "nasl/nasl_mat.h"
 
@@ -126,13 +128,16 @@ void camera_update(GLFWwindow*, CameraInput* input);
 
 bool reload_shaders = false;
 
-#define INSTANCES_COUNT 16
+/// Can be changed with --instances, the binned mode is meant for hundreds of thousands of triangles
+uint32_t instances_count = 16;
 
 enum TriDrawMode {
     SINGLE,
     BATCHED,
     INSTANCED,
     PIPELINED,
+    /// Same triangle transform as PIPELINED, rasterized by imr::ComputeRasterizer
+    BINNED,
 };
 
 struct PreprocessedTri {
@@ -146,73 +151,52 @@ struct PreprocessedTri {
 };
 
 TriDrawMode mode = SINGLE;
+const char* mode_names[] = { "single", "batched", "instanced", "pipelined", "binned" };
 
 struct Shaders {
-    imr::ComputePipeline single;
-    imr::ComputePipeline batched;
-    imr::ComputePipeline instanced;
-    imr::ComputePipeline pipelined_triangles;
-    imr::ComputePipeline pipelined_raster;
-
-    Shaders(imr::Device& d) :
-        single(d, "15_compute_cubes.spv"),
-        batched(d, "15_compute_cubes_batched.spv"),
-        instanced(d, "15_compute_cubes_instanced.spv"),
-        pipelined_triangles(d, "15_compute_cubes_pipelined_triangles.spv"),
-        pipelined_raster(d, "15_compute_cubes_pipelined_raster.spv")
-        {}
-};
-
-int main(int argc, char** argv) {
-    for (int i = 1; i < argc; i++) {
-        if (strcmp(argv[i], "--batched") == 0) {
-            mode = BATCHED;
-        }
-        if (strcmp(argv[i], "--instanced") == 0) {
-            mode = INSTANCED;
-        }
-        if (strcmp(argv[i], "--pipelined") == 0) {
-            mode = PIPELINED;
-        }
+    std::unique_ptr<imr::ComputePipeline> single;
+    std::unique_ptr<imr::ComputePipeline> batched;
+    std::unique_ptr<imr::ComputePipeline> instanced;
+    std::unique_ptr<imr::ComputePipeline> pipelined_triangles;
+    std::unique_ptr<imr::ComputePipeline> pipelined_raster;
+
+    Shaders(imr::Device& d) {
+        // all five get compiled at the same time
+        imr::PipelineBuilder builder(d);
+        auto single_f = builder.compute("15_compute_cubes.spv");
+        auto batched_f = builder.compute("15_compute_cubes_batched.spv");
+        auto instanced_f = builder.compute("15_compute_cubes_instanced.spv");
+        auto pipelined_triangles_f = builder.compute("15_compute_cubes_pipelined_triangles.spv");
+        auto pipelined_raster_f = builder.compute("15_compute_cubes_pipelined_raster.spv");
+        single = single_f.get();
+        batched = batched_f.get();
+        instanced = instanced_f.get();
+        pipelined_triangles = pipelined_triangles_f.get();
+        pipelined_raster = pipelined_raster_f.get();
     }
+};
 
-    glfwInit();
-    glfwWindowHint(GLFW_CLIENT_API, GLFW_NO_API);
-    auto window = glfwCreateWindow(1024, 1024, "Example", nullptr, nullptr);
-
-    glfwSetKeyCallback(window, [](GLFWwindow* window, int key, int scancode, int action, int mods) {
-        if (key == GLFW_KEY_R && (mods & GLFW_MOD_CONTROL))
-            reload_shaders = true;
-    });
-
-    imr::Context context;
-    imr::Device device(context);
-    imr::Swapchain swapchain(device, window);
-    imr::FpsCounter fps_counter;
-    auto shaders = std::make_unique<Shaders>(device);
-
+/// Renders with the current mode and instance count until the window is closed, or for the given number of frames without one.
+/// The GPU work of each frame is profiled as "frame", and its CPU time (recording and submitting it, in nanoseconds) appended to cpu_times if given.
+void render_loop(imr::Device& device, imr::Swapchain& swapchain, std::unique_ptr<Shaders>& shaders, imr::GpuProfiler& profiler, imr::FpsCounter& fps_counter, GLFWwindow* window, size_t frames, std::vector<uint64_t>* cpu_times = nullptr) {
     auto cube = make_cube();
 
     std::unique_ptr<imr::Buffer> triangles_buffer;
-    if (mode == BATCHED || mode == INSTANCED || mode == PIPELINED) {
+    if (mode == BATCHED || mode == INSTANCED || mode == PIPELINED || mode == BINNED) {
         triangles_buffer = std::make_unique<imr::Buffer>(device, sizeof(cube.triangles), VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT);
         triangles_buffer->uploadDataSync(0, sizeof(cube.triangles), cube.triangles);
     }
 
     std::unique_ptr<imr::Buffer> matrices_buffer;
-    if (mode == INSTANCED || mode == PIPELINED) {
-        matrices_buffer = std::make_unique<imr::Buffer>(device, sizeof(nasl::mat4) * INSTANCES_COUNT, VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT);
-    }
-
-    std::unique_ptr<imr::Buffer> tmp_buffer;
-    if (mode == PIPELINED) {
-        // we're never writing to this from the host
-        tmp_buffer = std::make_unique<imr::Buffer>(device, sizeof(PreprocessedTri) * INSTANCES_COUNT * 12, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT);
+    if (mode == INSTANCED || mode == PIPELINED || mode == BINNED) {
+        matrices_buffer = std::make_unique<imr::Buffer>(device, sizeof(nasl::mat4) * instances_count, VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT);
     }
 
     std::vector<vec3> positions;
 
-    for (size_t i = 0; i < INSTANCES_COUNT; i++) {
+    // Same scene for every run
+    srand(1);
+    for (size_t i = 0; i < instances_count; i++) {
         vec3 p;
         p.x = ((float)rand() / RAND_MAX) * 20 - 10;
         p.y = ((float)rand() / RAND_MAX) * 20 - 10;
@@ -226,15 +210,31 @@ int main(int argc, char** argv) {
     camera = {{0, 0, 3}, {0, 0}, 60};
 
     std::unique_ptr<imr::Image> depthBuffer;
+    std::unique_ptr<imr::ComputeRasterizer> rasterizer;
+    VkExtent2D rasterizer_size = {};
+    uint64_t last_report = 0;
 
     auto& vk = device.dispatch;
-    while (!glfwWindowShouldClose(window)) {
+    for (size_t frame = 0; window ? !glfwWindowShouldClose(window) : frame < frames; frame++) {
         fps_counter.tick();
-        fps_counter.updateGlfwWindowTitle(window);
+        if (window)
+            fps_counter.updateGlfwWindowTitle(window, &profiler);
+
+        // Compare the modes on the same scene, e.g. with --instances 20000 for 240k triangles
+        if (uint64_t now = imr_get_time_nano(); window && now - last_report > 1000000000) {
+            auto timings = swapchain.frameTimings();
+            auto frametimes = fps_counter.stats();
+            printf("%s, %u triangles: %.3f ms GPU, %.3f ms CPU, %d fps, p99 %.3f ms, %zu stutters\n", mode_names[mode], instances_count * 12, timings.gpu_time / 1e6, timings.cpu_time / 1e6, fps_counter.average_fps(), frametimes.p99, frametimes.stutters);
+            last_report = now;
+        }
 
+        uint64_t frame_start = 0;
         swapchain.renderFrameSimplified([&](imr::Swapchain::SimplifiedRenderContext& context) {
-            camera_update(window, &camera_input);
-            camera_move_freelook(&camera, &camera_input, &camera_state, delta);
+            frame_start = imr_get_time_nano();
+            if (window) {
+                camera_update(window, &camera_input);
+                camera_move_freelook(&camera, &camera_input, &camera_state, delta);
+            }
 
             if (reload_shaders) {
                 swapchain.drain();
@@ -244,54 +244,59 @@ int main(int argc, char** argv) {
 
             auto& image = context.image();
             auto cmdbuf = context.cmdbuf();
+            uint32_t frame_scope = profiler.begin(context.frame(), cmdbuf, "frame");
 
-            if (!depthBuffer || depthBuffer->size().width != context.image().size().width || depthBuffer->size().height != context.image().size().height) {
+            // the pipelined and binned modes get a transient one from their render graph
+            bool uses_graph = mode == PIPELINED || mode == BINNED;
+            if (!uses_graph && (!depthBuffer || depthBuffer->size().width != context.image().size().width || depthBuffer->size().height != context.image().size().height)) {
                 VkImageUsageFlagBits depthBufferFlags = static_cast<VkImageUsageFlagBits>(VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_STORAGE_BIT);
                 depthBuffer = std::make_unique<imr::Image>(device, VK_IMAGE_TYPE_2D, context.image().size(), VK_FORMAT_R32_SFLOAT, depthBufferFlags);
+                depthBuffer->transition(cmdbuf, VK_IMAGE_LAYOUT_GENERAL, VK_PIPELINE_STAGE_2_TRANSFER_BIT, VK_ACCESS_2_TRANSFER_WRITE_BIT);
+            }
+
+            // The bins are sized for the image and grown when they overflowed, the old ones might still be used by the frames in flight
+            bool bins_overflowed = rasterizer && rasterizer->binEntriesNeeded() > rasterizer->binsCapacity();
+            if (mode == BINNED && (!rasterizer || bins_overflowed || image.size().width > rasterizer_size.width || image.size().height > rasterizer_size.height)) {
+                swapchain.drain();
+                uint32_t bin_entries = rasterizer ? std::max(rasterizer->binEntriesNeeded() + rasterizer->binEntriesNeeded() / 4, rasterizer->binsCapacity()) : 0;
+                rasterizer_size = { image.size().width, image.size().height };
+                rasterizer = std::make_unique<imr::ComputeRasterizer>(device, rasterizer_size, instances_count * 12, bin_entries);
+            }
+
+            auto clear_color = [&](VkCommandBuffer cmdbuf) {
+                vk.cmdClearColorImage(cmdbuf, image.handle(), VK_IMAGE_LAYOUT_GENERAL, tmpPtr((VkClearColorValue) {
+                    .float32 = { 0.0f, 0.0f, 0.0f, 1.0f },
+                }), 1, tmpPtr(image.whole_image_subresource_range()));
+            };
+            auto clear_depth = [&](VkCommandBuffer cmdbuf, imr::Image& depth) {
+                vk.cmdClearColorImage(cmdbuf, depth.handle(), VK_IMAGE_LAYOUT_GENERAL, tmpPtr((VkClearColorValue) {
+                    .float32 = { 1.0f, 0.0f, 0.0f, 0.0f },
+                }), 1, tmpPtr(depth.whole_image_subresource_range()));
+            };
 
+            // The pipelined and binned modes use a render graph, which takes care of the clears and barriers itself
+            if (!uses_graph) {
+                clear_color(cmdbuf);
+                clear_depth(cmdbuf, *depthBuffer);
+
+                // This barrier ensures that the clear is finished before we run the dispatch.
+                // before: all writes from the "transfer" stage (to which the clear command belongs)
+                // after: all writes from the "compute" stage
                 vk.cmdPipelineBarrier2KHR(cmdbuf, tmpPtr((VkDependencyInfo) {
                     .sType = VK_STRUCTURE_TYPE_DEPENDENCY_INFO,
                     .dependencyFlags = 0,
-                    .imageMemoryBarrierCount = 1,
-                    .pImageMemoryBarriers = tmpPtr((VkImageMemoryBarrier2) {
-                        .sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER_2,
+                    .memoryBarrierCount = 1,
+                    .pMemoryBarriers = tmpPtr((VkMemoryBarrier2) {
+                        .sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER_2,
                         .srcStageMask = VK_PIPELINE_STAGE_2_TRANSFER_BIT,
                         .srcAccessMask = VK_ACCESS_2_TRANSFER_WRITE_BIT,
                         .dstStageMask = VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT,
                         .dstAccessMask = VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT,
-                        .oldLayout = VK_IMAGE_LAYOUT_UNDEFINED,
-                        .newLayout = VK_IMAGE_LAYOUT_GENERAL,
-                        .image = depthBuffer->handle(),
-                        .subresourceRange = depthBuffer->whole_image_subresource_range()
                     })
                 }));
             }
 
-            vk.cmdClearColorImage(cmdbuf, image.handle(), VK_IMAGE_LAYOUT_GENERAL, tmpPtr((VkClearColorValue) {
-                .float32 = { 0.0f, 0.0f, 0.0f, 1.0f },
-            }), 1, tmpPtr(image.whole_image_subresource_range()));
-
-            vk.cmdClearColorImage(cmdbuf, depthBuffer->handle(), VK_IMAGE_LAYOUT_GENERAL, tmpPtr((VkClearColorValue) {
-                .float32 = { 1.0f, 0.0f, 0.0f, 0.0f },
-            }), 1, tmpPtr(depthBuffer->whole_image_subresource_range()));
-
-            // This barrier ensures that the clear is finished before we run the dispatch.
-            // before: all writes from the "transfer" stage (to which the clear command belongs)
-            // after: all writes from the "compute" stage
-            vk.cmdPipelineBarrier2KHR(cmdbuf, tmpPtr((VkDependencyInfo) {
-                .sType = VK_STRUCTURE_TYPE_DEPENDENCY_INFO,
-                .dependencyFlags = 0,
-                .memoryBarrierCount = 1,
-                .pMemoryBarriers = tmpPtr((VkMemoryBarrier2) {
-                    .sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER_2,
-                    .srcStageMask = VK_PIPELINE_STAGE_2_TRANSFER_BIT,
-                    .srcAccessMask = VK_ACCESS_2_TRANSFER_WRITE_BIT,
-                    .dstStageMask = VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT,
-                    .dstAccessMask = VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT,
-                })
-            }));
-
-            auto add_render_barrier = [&]() {
+            auto add_render_barrier = [&](VkCommandBuffer cmdbuf) {
                 vk.cmdPipelineBarrier2KHR(cmdbuf, tmpPtr((VkDependencyInfo) {
                    .sType = VK_STRUCTURE_TYPE_DEPENDENCY_INFO,
                    .dependencyFlags = 0,
@@ -317,46 +322,52 @@ int main(int argc, char** argv) {
 
             switch (mode) {
                 case SINGLE: {
-                    auto& shader = shaders->single;
-                    vkCmdBindPipeline(cmdbuf, VK_PIPELINE_BIND_POINT_COMPUTE, shader.pipeline());
-                    auto shader_bind_helper = shader.create_bind_helper();
-                    shader_bind_helper->set_storage_image(0, 0, image.whole_image_view());
-                    shader_bind_helper->set_storage_image(0, 1, depthBuffer->whole_image_view());
-                    shader_bind_helper->commit(cmdbuf);
-
+                    auto& shader = *shaders->single;
                     push_constants_single.time = ((imr_get_time_nano() / 1000) % 10000000000) / 1000000.0f;
 
-                    for (auto pos : positions) {
-                        mat4 cube_matrix = m;
-                        cube_matrix = cube_matrix * translate_mat4(pos);
+                    // That's a lot of tiny dispatches, so we spread the recording across threads.
+                    // Each chunk is recorded in its own secondary command buffer, which doesn't inherit any state: bind everything again.
+                    size_t chunks = std::min<size_t>(std::max(1u, std::thread::hardware_concurrency()), positions.size());
+                    size_t chunk_size = (positions.size() + chunks - 1) / chunks;
+                    context.frame().recordParallel(cmdbuf, chunks, [&](size_t chunk, VkCommandBuffer cmdbuf) {
+                        vkCmdBindPipeline(cmdbuf, VK_PIPELINE_BIND_POINT_COMPUTE, shader.pipeline());
+                        auto shader_bind_helper = shader.create_bind_helper();
+                        shader_bind_helper->set_storage_image(0, 0, image.whole_image_view());
+                        shader_bind_helper->set_storage_image(0, 1, depthBuffer->whole_image_view());
+                        shader_bind_helper->commit(cmdbuf);
+                        delete shader_bind_helper;
 
-                        for (int i = 0; i < 12; i++) {
-                            add_render_barrier();
+                        auto push_constants = push_constants_single;
+                        for (size_t p = chunk * chunk_size; p < std::min(positions.size(), (chunk + 1) * chunk_size); p++) {
+                            mat4 cube_matrix = m;
+                            cube_matrix = cube_matrix * translate_mat4(positions[p]);
 
-                            auto tri = cube.triangles[i];
+                            for (int i = 0; i < 12; i++) {
+                                add_render_barrier(cmdbuf);
 
-                            push_constants_single.tri = tri;
-                            push_constants_single.matrix = cube_matrix;
-                            // copy it to the command buffer!
-                            vkCmdPushConstants(cmdbuf, shader.layout(), VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(push_constants_single), &push_constants_single);
+                                auto tri = cube.triangles[i];
 
-                            // dispatch like before
-                            vkCmdDispatch(cmdbuf, (image.size().width + 31) / 32, (image.size().height + 31) / 32, 1);
-                        }
-                    }
+                                push_constants.tri = tri;
+                                push_constants.matrix = cube_matrix;
+                                // copy it to the command buffer!
+                                vkCmdPushConstants(cmdbuf, shader.layout(), VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(push_constants), &push_constants);
 
-                    context.addCleanupAction([=, &device]() {
-                        delete shader_bind_helper;
+                                // dispatch like before
+                                vkCmdDispatch(cmdbuf, (image.size().width + 31) / 32, (image.size().height + 31) / 32, 1);
+                            }
+                        }
                     });
+
                     break;
                 }
                 case BATCHED: {
-                    auto& shader = shaders->batched;
+                    auto& shader = *shaders->batched;
                     vkCmdBindPipeline(cmdbuf, VK_PIPELINE_BIND_POINT_COMPUTE, shader.pipeline());
                     auto shader_bind_helper = shader.create_bind_helper();
                     shader_bind_helper->set_storage_image(0, 0, image.whole_image_view());
                     shader_bind_helper->set_storage_image(0, 1, depthBuffer->whole_image_view());
                     shader_bind_helper->commit(cmdbuf);
+                    delete shader_bind_helper;
 
                     push_constants_batched.time = ((imr_get_time_nano() / 1000) % 10000000000) / 1000000.0f;
                     // the cube data is the same for all
@@ -364,7 +375,7 @@ int main(int argc, char** argv) {
                     push_constants_batched.tri_count = 12;
 
                     for (auto pos : positions) {
-                        add_render_barrier();
+                        add_render_barrier(cmdbuf);
 
                         mat4 cube_matrix = m;
                         cube_matrix = cube_matrix * translate_mat4(pos);
@@ -378,12 +389,13 @@ int main(int argc, char** argv) {
                     break;
                 }
                 case INSTANCED: {
-                    auto& shader = shaders->instanced;
+                    auto& shader = *shaders->instanced;
                     vkCmdBindPipeline(cmdbuf, VK_PIPELINE_BIND_POINT_COMPUTE, shader.pipeline());
                     auto shader_bind_helper = shader.create_bind_helper();
                     shader_bind_helper->set_storage_image(0, 0, image.whole_image_view());
                     shader_bind_helper->set_storage_image(0, 1, depthBuffer->whole_image_view());
                     shader_bind_helper->commit(cmdbuf);
+                    delete shader_bind_helper;
 
                     push_constants_instanced.time = ((imr_get_time_nano() / 1000) % 10000000000) / 1000000.0f;
                     // the cube data is the same for all
@@ -396,20 +408,24 @@ int main(int argc, char** argv) {
                         cube_matrix = cube_matrix * translate_mat4(pos);
                         matrices.push_back(cube_matrix);
                     }
-                    matrices_buffer->uploadDataSync(0, sizeof(mat4) * matrices.size(), matrices.data());
+                    // goes through the staging ring, renderFrameSimplified makes the frame wait on it
+                    // and the next upload waits for this frame, since it reads the matrices
+                    matrices_buffer->uploadDataAsync(0, sizeof(mat4) * matrices.size(), matrices.data());
+                    context.frame().markUsed(*matrices_buffer);
 
                     push_constants_instanced.matrices_buffer = matrices_buffer->device_address();
                     push_constants_instanced.instances_count = matrices.size();
 
-                    add_render_barrier();
+                    add_render_barrier(cmdbuf);
 
                     vkCmdPushConstants(cmdbuf, shader.layout(), VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(push_constants_instanced), &push_constants_instanced);
                     vkCmdDispatch(cmdbuf, (image.size().width + 31) / 32, (image.size().height + 31) / 32, 1);
                     break;
                 }
-                case PIPELINED: {
-                    auto& triangle_transform_shader = shaders->pipelined_triangles;
-                    vkCmdBindPipeline(cmdbuf, VK_PIPELINE_BIND_POINT_COMPUTE, triangle_transform_shader.pipeline());
+                case PIPELINED:
+                case BINNED: {
+                    auto& triangle_transform_shader = *shaders->pipelined_triangles;
+                    auto& rasterizer_shader = *shaders->pipelined_raster;
 
                     push_constants_pipelined_vert.time = ((imr_get_time_nano() / 1000) % 10000000000) / 1000000.0f;
                     // the cube data is the same for all
@@ -422,44 +438,232 @@ int main(int argc, char** argv) {
                         cube_matrix = cube_matrix * translate_mat4(pos);
                         matrices.push_back(cube_matrix);
                     }
-                    matrices_buffer->uploadDataSync(0, sizeof(mat4) * matrices.size(), matrices.data());
+                    // goes through the staging ring, renderFrameSimplified makes the frame wait on it
+                    // and the next upload waits for this frame, since it reads the matrices
+                    matrices_buffer->uploadDataAsync(0, sizeof(mat4) * matrices.size(), matrices.data());
+                    context.frame().markUsed(*matrices_buffer);
 
                     push_constants_pipelined_vert.matrices_buffer = matrices_buffer->device_address();
                     push_constants_pipelined_vert.instances_count = matrices.size();
-                    push_constants_pipelined_vert.preprocessed_tri_buffer = tmp_buffer->device_address();
-
-                    add_render_barrier();
-
-                    vkCmdPushConstants(cmdbuf, triangle_transform_shader.layout(), VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(push_constants_pipelined_vert), &push_constants_pipelined_vert);
-                    vkCmdDispatch(cmdbuf, (12 + 31) / 32, (INSTANCES_COUNT + 31) / 32, 1);
-
-                    add_render_barrier();
 
-                    auto& rasterizer_shader = shaders->pipelined_raster;
-                    vkCmdBindPipeline(cmdbuf, VK_PIPELINE_BIND_POINT_COMPUTE, rasterizer_shader.pipeline());
-                    auto shader_bind_helper = rasterizer_shader.create_bind_helper();
-                    shader_bind_helper->set_storage_image(0, 0, image.whole_image_view());
-                    shader_bind_helper->set_storage_image(0, 1, depthBuffer->whole_image_view());
-                    shader_bind_helper->commit(cmdbuf);
-
-                    push_constants_pipelined_frag.preprocessed_tri_buffer = tmp_buffer->device_address();
-                    push_constants_pipelined_frag.tri_count = INSTANCES_COUNT * 12;
-
-                    vkCmdPushConstants(cmdbuf, rasterizer_shader.layout(), VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(push_constants_pipelined_frag), &push_constants_pipelined_frag);
+                    push_constants_pipelined_frag.tri_count = instances_count * 12;
+
+                    // The graph works out that the clears and the triangle transform are independent and can overlap,
+                    // and only puts one barrier between them and the rasterizer.
+                    imr::RenderGraph graph(context.frame());
+                    graph.profile(profiler);
+                    // renderFrameSimplified already transitioned the swapchain image, and transitions it again afterwards
+                    graph.importImage(image, VK_IMAGE_LAYOUT_GENERAL);
+                    graph.exportImage(image, VK_IMAGE_LAYOUT_GENERAL);
+
+                    // Only needed while the frame is being rendered, so their memory gets recycled by later frames
+                    auto& tmp_buffer = graph.createTransientBuffer(sizeof(PreprocessedTri) * instances_count * 12, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT);
+                    auto& depth = graph.createTransientImage(VK_IMAGE_TYPE_2D, image.size(), VK_FORMAT_R32_SFLOAT, VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_STORAGE_BIT);
+
+                    graph.addPass("clear color", clear_color)
+                        .write(image, VK_PIPELINE_STAGE_2_TRANSFER_BIT, VK_ACCESS_2_TRANSFER_WRITE_BIT);
+                    graph.addPass("clear depth", [&](VkCommandBuffer cmdbuf) { clear_depth(cmdbuf, depth); })
+                        .write(depth, VK_PIPELINE_STAGE_2_TRANSFER_BIT, VK_ACCESS_2_TRANSFER_WRITE_BIT);
+
+                    graph.addPass("transform triangles", [&](VkCommandBuffer cmdbuf) {
+                        // transient memory is only bound once the graph executes
+                        push_constants_pipelined_vert.preprocessed_tri_buffer = tmp_buffer.device_address();
+                        vkCmdBindPipeline(cmdbuf, VK_PIPELINE_BIND_POINT_COMPUTE, triangle_transform_shader.pipeline());
+                        vkCmdPushConstants(cmdbuf, triangle_transform_shader.layout(), VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(push_constants_pipelined_vert), &push_constants_pipelined_vert);
+                        vkCmdDispatch(cmdbuf, (12 + 31) / 32, (instances_count + 31) / 32, 1);
+                    })
+                        .read(*triangles_buffer, VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT)
+                        .read(*matrices_buffer, VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT)
+                        .write(tmp_buffer, VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT);
+
+                    if (mode == BINNED) {
+                        graph.addPass("rasterize", [&](VkCommandBuffer cmdbuf) {
+                            rasterizer->draw(cmdbuf, tmp_buffer.device_address(), instances_count * 12, image, depth);
+                        })
+                            .read(tmp_buffer, VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT)
+                            .write(image, VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT, VK_ACCESS_2_SHADER_STORAGE_READ_BIT | VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT)
+                            .write(depth, VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT, VK_ACCESS_2_SHADER_STORAGE_READ_BIT | VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT);
+                    } else {
+                        graph.addPass("rasterize", [&](VkCommandBuffer cmdbuf) {
+                            vkCmdBindPipeline(cmdbuf, VK_PIPELINE_BIND_POINT_COMPUTE, rasterizer_shader.pipeline());
+                            auto shader_bind_helper = rasterizer_shader.create_bind_helper();
+                            shader_bind_helper->set_storage_image(0, 0, image.whole_image_view());
+                            shader_bind_helper->set_storage_image(0, 1, depth.whole_image_view());
+                            shader_bind_helper->commit(cmdbuf);
+                            delete shader_bind_helper;
+
+                            push_constants_pipelined_frag.preprocessed_tri_buffer = tmp_buffer.device_address();
+                            vkCmdPushConstants(cmdbuf, rasterizer_shader.layout(), VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(push_constants_pipelined_frag), &push_constants_pipelined_frag);
+                            vkCmdDispatch(cmdbuf, (image.size().width + 31) / 32, (image.size().height + 31) / 32, 1);
+                        })
+                            .read(tmp_buffer, VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT)
+                            .write(image, VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT, VK_ACCESS_2_SHADER_STORAGE_READ_BIT | VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT)
+                            .write(depth, VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT, VK_ACCESS_2_SHADER_STORAGE_READ_BIT | VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT);
+                    }
 
-                    vkCmdDispatch(cmdbuf, (image.size().width + 31) / 32, (image.size().height + 31) / 32, 1);
+                    graph.execute(cmdbuf);
                     break;
                 }
             }
 
+            profiler.end(context.frame(), cmdbuf, frame_scope);
+
             auto now = imr_get_time_nano();
             delta = ((float) ((now - prev_frame) / 1000L)) / 1000000.0f;
             prev_frame = now;
 
-            glfwPollEvents();
+            if (window)
+                glfwPollEvents();
         });
+        if (cpu_times)
+            cpu_times->push_back(imr_get_time_nano() - frame_start);
     }
 
+    // The frames in flight still use the buffers, images and rasterizer declared above
     swapchain.drain();
+}
+
+/// Renders every mode offscreen for a fixed number of frames over a sweep of instance counts and resolutions, and prints one JSON object per run.
+/// Needs no display or window system, so it also runs on software implementations like lavapipe (e.g. in CI).
+int run_benchmark(size_t frames, std::vector<uint32_t> instance_counts, std::vector<VkExtent2D> resolutions) {
+    imr::Context context([](auto&) {}, true);
+    imr::Device device(context);
+    auto shaders = std::make_unique<Shaders>(device);
+
+    for (auto resolution : resolutions) {
+        for (auto instances : instance_counts) {
+            for (auto run_mode : { SINGLE, BATCHED, INSTANCED, PIPELINED, BINNED }) {
+                mode = run_mode;
+                instances_count = instances;
+
+                // Keeps a sample of every frame, the stats are over the whole run
+                imr::GpuProfiler profiler(device, 64, frames);
+                imr::Swapchain swapchain(device, resolution);
+                imr::FpsCounter fps_counter;
+                std::vector<uint64_t> cpu_times;
+                render_loop(device, swapchain, shaders, profiler, fps_counter, nullptr, frames, &cpu_times);
+
+                // render_loop() drained the swapchain, so every frame's timestamps were read back
+                imr::GpuProfiler::Stats gpu = {};
+                for (auto& scope : profiler.stats()) {
+                    if (scope.label == "frame")
+                        gpu = scope;
+                }
+                std::sort(cpu_times.begin(), cpu_times.end());
+                uint64_t cpu_total = 0;
+                for (auto time : cpu_times)
+                    cpu_total += time;
+                float cpu_average = cpu_times.empty() ? 0.0f : cpu_total / 1e6f / cpu_times.size();
+                float cpu_p99 = cpu_times.empty() ? 0.0f : cpu_times[std::min(cpu_times.size() - 1, size_t(0.99 * cpu_times.size()))] / 1e6f;
+
+                auto frametimes = fps_counter.stats();
+                printf("{ \"mode\": \"%s\", \"instances\": %u, \"triangles\": %u, \"width\": %u, \"height\": %u, \"frames\": %zu, "
+                       "\"cpu_ms\": %f, \"cpu_p99_ms\": %f, \"gpu_ms\": %f, \"gpu_p99_ms\": %f, \"fps\": %f, \"p99_ms\": %f }\n",
+                       mode_names[mode], instances, instances * 12, resolution.width, resolution.height, frames,
+                       cpu_average, cpu_p99, gpu.average, gpu.p99, frametimes.average > 0 ? 1000.0f / frametimes.average : 0.0f, frametimes.p99);
+                fflush(stdout);
+            }
+        }
+    }
+    return 0;
+}
+
+/// Comma separated list of positive numbers, e.g. "16,256". Empty if anything else is in there.
+std::vector<uint32_t> parse_list(const char* str) {
+    std::vector<uint32_t> list;
+    const char* s = str;
+    while (true) {
+        char* end;
+        unsigned long value = strtoul(s, &end, 10);
+        if (end == s || value == 0 || value > UINT32_MAX || (*end != ',' && *end != '\0'))
+            return {};
+        list.push_back(value);
+        if (*end == '\0')
+            return list;
+        s = end + 1;
+    }
+}
+
+int main(int argc, char** argv) {
+    const char* gpu_profile_file = nullptr;
+    const char* frametimes_file = nullptr;
+    bool benchmark = false;
+    size_t benchmark_frames = 100;
+    std::vector<uint32_t> benchmark_instances = { 16, 64 };
+    std::vector<VkExtent2D> benchmark_resolutions = { { 256, 256 }, { 512, 512 } };
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--batched") == 0) {
+            mode = BATCHED;
+        }
+        if (strcmp(argv[i], "--instanced") == 0) {
+            mode = INSTANCED;
+        }
+        if (strcmp(argv[i], "--pipelined") == 0) {
+            mode = PIPELINED;
+        }
+        if (strcmp(argv[i], "--binned") == 0) {
+            mode = BINNED;
+        }
+        if (strcmp(argv[i], "--gpu-profile") == 0 && i + 1 < argc) {
+            gpu_profile_file = argv[++i];
+        }
+        if (strcmp(argv[i], "--frametimes") == 0 && i + 1 < argc) {
+            frametimes_file = argv[++i];
+        }
+        if (strcmp(argv[i], "--benchmark") == 0) {
+            benchmark = true;
+        }
+        if (strcmp(argv[i], "--benchmark-frames") == 0 && i + 1 < argc) {
+            benchmark_frames = std::max(1, atoi(argv[++i]));
+        }
+        if (strcmp(argv[i], "--benchmark-instances") == 0 && i + 1 < argc) {
+            benchmark_instances = parse_list(argv[++i]);
+            if (benchmark_instances.empty()) {
+                fprintf(stderr, "--benchmark-instances expects a comma separated list of positive numbers, got '%s'\n", argv[i]);
+                return 1;
+            }
+        }
+        if (strcmp(argv[i], "--benchmark-resolutions") == 0 && i + 1 < argc) {
+            // Square ones, e.g. "256,1024"
+            auto sizes = parse_list(argv[++i]);
+            if (sizes.empty()) {
+                fprintf(stderr, "--benchmark-resolutions expects a comma separated list of positive numbers, got '%s'\n", argv[i]);
+                return 1;
+            }
+            benchmark_resolutions.clear();
+            for (auto size : sizes)
+                benchmark_resolutions.push_back({ size, size });
+        }
+        if (strcmp(argv[i], "--instances") == 0 && i + 1 < argc) {
+            instances_count = std::max(1, atoi(argv[++i]));
+        }
+    }
+
+    if (benchmark)
+        return run_benchmark(benchmark_frames, benchmark_instances, benchmark_resolutions);
+
+    glfwInit();
+    glfwWindowHint(GLFW_CLIENT_API, GLFW_NO_API);
+    auto window = glfwCreateWindow(1024, 1024, "Example", nullptr, nullptr);
+
+    glfwSetKeyCallback(window, [](GLFWwindow* window, int key, int scancode, int action, int mods) {
+        if (key == GLFW_KEY_R && (mods & GLFW_MOD_CONTROL))
+            reload_shaders = true;
+    });
+
+    imr::Context context;
+    imr::Device device(context);
+    // Outlives the swapchain, whose frames read back the timestamps when they're recycled
+    imr::GpuProfiler profiler(device);
+    imr::Swapchain swapchain(device, window);
+    imr::FpsCounter fps_counter;
+    auto shaders = std::make_unique<Shaders>(device);
+
+    render_loop(device, swapchain, shaders, profiler, fps_counter, window, 0);
+
+    if (gpu_profile_file)
+        profiler.dump(gpu_profile_file);
+    if (frametimes_file)
+        fps_counter.export_json(frametimes_file);
     return 0;
 }
@@ -22,7 +22,7 @@ layout(scalar, buffer_reference) buffer TrianglesBuffer {
 };
 
 layout(scalar, buffer_reference) buffer MatricesBuffer {
-    mat4 matrices[16];
+    mat4 matrices[];
 };
 
 layout(scalar, push_constant) uniform T {
@@ -24,7 +24,7 @@ struct PreprocessedTri {
 };
 
 layout(scalar, buffer_reference) buffer PreprocessedTrianglesBuffer {
-    PreprocessedTri triangles[192];
+    PreprocessedTri triangles[];
 };
 
 layout(scalar, push_constant) uniform T {
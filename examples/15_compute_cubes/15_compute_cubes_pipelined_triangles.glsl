@@ -12,7 +12,7 @@ layout(scalar, buffer_reference) buffer TrianglesBuffer {
 };
 
 layout(scalar, buffer_reference) buffer MatricesBuffer {
-    mat4 matrices[16];
+    mat4 matrices[];
 };
 
 struct PreprocessedTri {
@@ -26,7 +26,7 @@ struct PreprocessedTri {
 };
 
 layout(scalar, buffer_reference) buffer PreprocessedTrianglesBuffer {
-    PreprocessedTri triangles[192];
+    PreprocessedTri triangles[];
 };
 
 layout(scalar, push_constant) uniform T {
@@ -15,9 +15,7 @@ int main() {
     // CPU-side staging buffer
     uint8_t* framebuffer = reinterpret_cast<uint8_t*>(malloc(width * height * 4));
 
-    std::unique_ptr<imr::Buffer> buffer = std::make_unique<imr::Buffer>(device, width * height * 4, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT);
-    uint8_t* mapped_buffer;
-    CHECK_VK(vkMapMemory(device.device, buffer->memory, buffer->memory_offset, buffer->size, 0, (void**) &mapped_buffer), abort());
+    std::unique_ptr<imr::Buffer> buffer = std::make_unique<imr::Buffer>(device, width * height * 4, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT, true);
 
     VkFence fence;
     vkCreateFence(device.device, tmpPtr<VkFenceCreateInfo>({
@@ -37,10 +35,8 @@ int main() {
                 free(framebuffer);
                 framebuffer = reinterpret_cast<uint8_t*>(malloc(width * height * 4));
 
-                // unmap the old gpu buffer and reallocate it
-                vkUnmapMemory(device.device, buffer->memory);
-                buffer = std::make_unique<imr::Buffer>(device, width * height * 4, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT);
-                CHECK_VK(vkMapMemory(device.device, buffer->memory, buffer->memory_offset, buffer->size, 0, (void**) &mapped_buffer), abort());
+                // reallocate the gpu buffer, it stays mapped for as long as it lives
+                buffer = std::make_unique<imr::Buffer>(device, width * height * 4, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT, true);
             }
 
             vkWaitForFences(device.device, 1, &fence, VK_TRUE, UINT64_MAX);
@@ -53,7 +49,8 @@ int main() {
                     framebuffer[((j * width) + i) * 4 + 2] = rand() % 255;
                 }
             }
-            memcpy(mapped_buffer, framebuffer, width * height * 4);
+            memcpy(buffer->host_ptr<uint8_t>(), framebuffer, width * height * 4);
+            buffer->flush();
             frame.presentFromBuffer(buffer->handle, fence, std::nullopt);
         });
 
@@ -86,13 +86,7 @@ int main() {
             vkWaitForFences(device.device, 1, &fence, VK_TRUE, UINT64_MAX);
             vkResetFences(device.device, 1, &fence);
 
-            VkCommandBuffer cmdbuf;
-            vkAllocateCommandBuffers(device.device, tmpPtr((VkCommandBufferAllocateInfo) {
-                .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
-                .commandPool = device.pool,
-                .level = VK_COMMAND_BUFFER_LEVEL_PRIMARY,
-                .commandBufferCount = 1,
-            }), &cmdbuf);
+            VkCommandBuffer cmdbuf = frame.allocateCommandBuffer();
 
             vkBeginCommandBuffer(cmdbuf, tmpPtr((VkCommandBufferBeginInfo) {
                 .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
@@ -175,7 +169,6 @@ int main() {
 
             frame.addCleanupAction([=, &device]() {
                 vkDestroySemaphore(device.device, sem, nullptr);
-                vkFreeCommandBuffers(device.device, device.pool, 1, &cmdbuf);
             });
             frame.presentFromImage(image->handle(), fence, { sem }, VK_IMAGE_LAYOUT_GENERAL, std::make_optional<VkExtent2D>(image->size().width, image->size().height));
         });
@@ -6,6 +6,7 @@
 #include "VkBootstrap.h"
 
 #include <functional>
+#include <future>
 #include <memory>
 #include <optional>
 
@@ -21,10 +22,12 @@ inline T* tmpPtr(T&& t) { return &t; }
 namespace imr {
 
 struct Context {
-    Context(std::function<void(vkb::InstanceBuilder&)>&& instance_custom = [](auto&) {});
+    /// Headless contexts don't enable any surface extension, for machines without a display: they only work with offscreen swapchains
+    Context(std::function<void(vkb::InstanceBuilder&)>&& instance_custom = [](auto&) {}, bool headless = false);
     Context(Context&) = delete;
     ~Context();
 
+    bool const headless;
     vkb::Instance instance;
     vkb::InstanceDispatchTable dispatch;
 
@@ -45,18 +48,67 @@ struct Device {
     VkQueue main_queue;
     uint32_t main_queue_idx;
 
-    VkCommandPool pool;
+    /// Dedicated queues from their own families, when the device has them. Otherwise these are the same as the main queue.
+    /// Buffers are shared between all of these families, images have to be transferred with releaseOwnership()/acquireOwnership()
+    VkQueue transfer_queue;
+    uint32_t transfer_queue_idx;
+    VkQueue compute_queue;
+    uint32_t compute_queue_idx;
+
+    enum class Queue {
+        Main,
+        Transfer,
+        Compute,
+    };
+    static constexpr size_t QUEUES_COUNT = 3;
 
     vkb::DispatchTable dispatch;
 
+    /// Identifies a batch of work submitted with executeCommandsAsync, backed by a timeline semaphore owned by the device (one per queue)
+    struct Token {
+        Device* device = nullptr;
+        uint64_t value = 0;
+        Queue queue = Queue::Main;
+
+        /// Non-blocking, true once the GPU is done with the work
+        bool done() const;
+        /// Blocks until the work is done, submitting it first if it is still pending
+        void wait() const;
+        /// Runs fn on the host once the work is done (from within wait(), collect() or a later submission)
+        void then(std::function<void(void)>&& fn) const;
+    };
+
+    /// Blocking version of executeCommandsAsync, does not return until the GPU is done with the commands
     void executeCommandsSync(std::function<void(VkCommandBuffer)>);
 
+    /// Records commands in their own command buffer, but does not submit them right away.
+    /// Consecutive calls are batched together into one vkQueueSubmit, which happens on flush() or when a token is waited on.
+    /// Recordings in the same batch are not ordered against each other: use wait_for to depend on previous work.
+    /// Safe to call from any thread, the recording itself happens without holding any lock.
+    /// Tokens from other queues are waited on with their timeline semaphore, but resources still need to be shared or transferred between queue families.
+    Token executeCommandsAsync(std::function<void(VkCommandBuffer)>, std::vector<Token> wait_for = {}, Queue queue = Queue::Main);
+    /// Submits the pending batches, if any
+    void flush();
+    /// Recycles the command buffers of finished batches and runs their continuations
+    void collect();
+
+    /// Drops the cached descriptor sets that use this handle (a VkSampler, VkImageView, ... cast to uint64_t).
+    /// imr does it for the buffers, images and views it owns, anything else bound through a DescriptorBindHelper needs this before it's destroyed:
+    /// the driver can hand out the same handle value again, and the cache would then return a set pointing at the old, destroyed object.
+    void forgetHandle(uint64_t handle);
+
+    /// VK_KHR_push_descriptor is enabled whenever the device has it
+    bool supports_push_descriptors() const;
+    /// VK_KHR_present_id and VK_KHR_present_wait are enabled whenever the device has both, frame pacing uses them
+    bool supports_present_wait() const;
+
     class Impl;
     std::unique_ptr<Impl> _impl;
 };
 
 struct Buffer {
-    Buffer(Device&, size_t size, VkBufferUsageFlags usage, VkMemoryPropertyFlags memory_property = VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+    /// persistently_mapped requires host-visible memory, and keeps it mapped for the whole lifetime of the buffer
+    Buffer(Device&, size_t size, VkBufferUsageFlags usage, VkMemoryPropertyFlags memory_property = VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, bool persistently_mapped = false);
     Buffer(Buffer&) = delete;
     ~Buffer();
 
@@ -64,37 +116,122 @@ struct Buffer {
     VkBuffer handle;
     /// query 64-bit virtual address of the buffer on the GPU
     VkDeviceAddress device_address();
-    /// Managed by the allocator, required for mapping the buffer
+    /// Managed by the allocator and possibly shared with other buffers, prefer persistent mapping over mapping it yourself
     VkDeviceMemory memory;
     size_t memory_offset;
 
+    /// Host address of the buffer contents if it was created persistently mapped, nullptr otherwise
+    void* mapped_ptr() const;
+    template<typename T>
+    T* host_ptr() const { return static_cast<T*>(mapped_ptr()); }
+    /// Makes host writes visible to the device, only required for memory without VK_MEMORY_PROPERTY_HOST_COHERENT_BIT
+    void flush(uint64_t offset = 0, uint64_t size = VK_WHOLE_SIZE);
+    /// Makes device writes visible to the host, only required for memory without VK_MEMORY_PROPERTY_HOST_COHERENT_BIT
+    void invalidate(uint64_t offset = 0, uint64_t size = VK_WHOLE_SIZE);
+
     void uploadDataSync(uint64_t offset, uint64_t size, void* data);
+    /// Tells uploads and downloads that work submitted on token's queue reads or writes the buffer: they wait for the latest such work, and for nothing else
+    /// Frame::markUsed() takes care of it for frames
+    void markUsed(Device::Token);
+
+    /// The data is copied into the device's staging ring before this returns, the copy itself happens later on the transfer queue
+    /// It waits for the uses of the buffer marked so far (see markUsed), frames submitted later wait for it
+    /// Device-local buffers need VK_BUFFER_USAGE_TRANSFER_DST_BIT, host-visible buffers are written to directly (blocking until the marked uses are done)
+    /// Safe to call from any thread (the staging ring is shared and locked), but not concurrently on the same buffer
+    Device::Token uploadDataAsync(uint64_t offset, uint64_t size, void* data, std::vector<Device::Token> wait_for = {});
+    void downloadDataSync(uint64_t offset, uint64_t size, void* data);
+    /// The copy happens on the transfer queue after the uses of the buffer marked so far, through the device's readback ring.
+    /// data is filled in by a continuation of the returned token: it's only valid once wait() returned, or collect() ran it.
+    /// Device-local buffers need VK_BUFFER_USAGE_TRANSFER_SRC_BIT, host-visible buffers are read from directly (blocking until the marked uses are done)
+    Device::Token downloadDataAsync(uint64_t offset, uint64_t size, void* data, std::vector<Device::Token> wait_for = {});
 
     struct Impl;
+    Buffer(std::unique_ptr<Impl>&&, size_t size, VkBuffer handle);
     std::unique_ptr<Impl> _impl;
 };
 
+/// Part of an image copied from or to host memory, all of the first mip level by default.
+/// On the host side it's made of rows of texel blocks, row_pitch bytes apart, then depth slices and layers, each following the previous one.
+struct ImageRegion {
+    uint32_t mip_level = 0;
+    uint32_t base_layer = 0;
+    /// All the layers from base_layer on when 0
+    uint32_t layer_count = 0;
+    VkOffset3D offset = {};
+    /// Up to the end of the mip level when unset
+    std::optional<VkExtent3D> extent;
+    /// Tightly packed when 0
+    size_t row_pitch = 0;
+};
+
 /// Deals with the common use-cases for images, allocating memory for you and tracking properties.
-/// Does not track image layouts for you, much of the framework assumes VK_IMAGE_LAYOUT_GENERAL
+/// Also tracks the layout and last access of each subresource, see transition()
 struct Image {
     VkImage handle() const;
 
     VkImageType type() const;
     VkExtent3D size() const;
     VkFormat format() const;
-
-    Image(Device&, VkImageType dim, VkExtent3D size, VkFormat format, VkImageUsageFlagBits usage);
+    uint32_t mip_levels() const;
+    uint32_t array_layers() const;
+    VkSampleCountFlagBits samples() const;
+    /// Size of the given mip level
+    VkExtent3D size(uint32_t mip_level) const;
+
+    /// Cube maps need VK_IMAGE_CREATE_CUBE_COMPATIBLE_BIT in flags and a multiple of 6 layers
+    Image(Device&, VkImageType dim, VkExtent3D size, VkFormat format, VkImageUsageFlagBits usage, uint32_t mip_levels = 1, uint32_t array_layers = 1, VkSampleCountFlagBits samples = VK_SAMPLE_COUNT_1_BIT, VkImageCreateFlags flags = 0);
     Image(Image&) = delete;
     Image(Image&&);
     ~Image();
 
+    /// Number of levels in a full mip chain for an image of that size, down to 1x1
+    static uint32_t full_mip_chain(VkExtent3D size);
+
+    /// Views are created on first use and live as long as the image, so descriptor sets using them can be cached.
+    /// Arrayed images get array views, and cube maps get a cube view here, for sampling them.
     VkImageView whole_image_view();
+    /// All the layers of one mip level, e.g. for rendering to it. Always a 2D array view for cube maps, since cube views can't be attachments.
+    VkImageView mip_view(uint32_t mip_level);
+    /// A single subresource
+    VkImageView layer_view(uint32_t mip_level, uint32_t array_layer);
+    VkImageView view(VkImageViewType, VkImageSubresourceRange);
     VkImageSubresourceRange whole_image_subresource_range() const;
-    VkImageSubresourceLayers whole_image_subresource_layers() const;
+    VkImageSubresourceLayers whole_image_subresource_layers(uint32_t mip_level = 0) const;
+
+    /// Fills mip levels 1 and up by successively downsampling level 0 with blits, and leaves the whole image in final_layout.
+    /// The format has to support blits, and linear filtering for the result to look any good.
+    void generate_mips(VkCommandBuffer, VkImageLayout final_layout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL, VkPipelineStageFlags2 stage = VK_PIPELINE_STAGE_2_FRAGMENT_SHADER_BIT | VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT, VkAccessFlags2 access = VK_ACCESS_2_SHADER_SAMPLED_READ_BIT);
+
+    /// Bytes of host memory the region takes up
+    size_t host_size(const ImageRegion& = {}) const;
+    /// Copies through the device's staging rings, on the main queue since images aren't shared between queue families.
+    /// The image is transitioned to VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL (resp. TRANSFER_SRC_OPTIMAL) for the copy, and left there.
+    /// Multisampled images can't be copied, and depth/stencil formats need to be depth-only or stencil-only.
+    void uploadDataSync(const void* data, const ImageRegion& = {});
+    Device::Token uploadDataAsync(const void* data, const ImageRegion& = {}, std::vector<Device::Token> wait_for = {});
+    void downloadDataSync(void* data, const ImageRegion& = {});
+    /// data is filled in by a continuation of the returned token, same as Buffer::downloadDataAsync
+    Device::Token downloadDataAsync(void* data, const ImageRegion& = {}, std::vector<Device::Token> wait_for = {});
+
+    /// Layout the subresource will be in once the commands recorded so far have executed.
+    /// Tracking happens when recording, so it assumes command buffers are submitted in the order they were recorded in.
+    VkImageLayout layout(uint32_t mip_level = 0, uint32_t array_layer = 0) const;
+    /// Makes the image ready to be accessed in new_layout with the given stage and access, the barrier is only recorded if a transition or a hazard requires one
+    void transition(VkCommandBuffer, VkImageLayout new_layout, VkPipelineStageFlags2 stage, VkAccessFlags2 access);
+    void transition(VkCommandBuffer, VkImageSubresourceRange, VkImageLayout new_layout, VkPipelineStageFlags2 stage, VkAccessFlags2 access);
+    /// Tells the tracker about a layout change or access it didn't see, e.g. from your own barriers
+    void assumeState(VkImageLayout layout, VkPipelineStageFlags2 stage = VK_PIPELINE_STAGE_2_NONE, VkAccessFlags2 access = VK_ACCESS_2_NONE);
+
+    /// Images are exclusive to one queue family at a time. To hand one over, record the release on the source queue and the acquire on the destination queue.
+    /// Both halves must use the same families and layouts, and the acquiring submission must wait on the releasing one (see Device::executeCommandsAsync).
+    void releaseOwnership(VkCommandBuffer, uint32_t src_family, uint32_t dst_family, VkImageLayout old_layout, VkImageLayout new_layout, VkPipelineStageFlags2 src_stage, VkAccessFlags2 src_access);
+    void acquireOwnership(VkCommandBuffer, uint32_t src_family, uint32_t dst_family, VkImageLayout old_layout, VkImageLayout new_layout, VkPipelineStageFlags2 dst_stage, VkAccessFlags2 dst_access);
 
     struct Impl;
-    Image(Impl&&);
+    explicit Image(std::unique_ptr<Impl>&&);
 private:
+    /// The render graph reads and updates the tracked layouts directly
+    friend struct RenderGraph;
     std::unique_ptr<Impl> _impl;
 };
 
@@ -105,9 +242,15 @@ struct ShaderModule {
 
     VkShaderModule vk_shader_module() const;
 
+    /// Reflection results are always cached in memory, this additionally persists them to filename (or stops doing so with nullopt)
+    static void set_reflection_cache_file(std::optional<std::string> filename);
+    /// Relative filenames are looked up next to the executable first, then in these directories in the order they were added
+    static void add_search_path(std::string directory);
+
     ~ShaderModule();
 
     struct Impl;
+    explicit ShaderModule(std::unique_ptr<Impl>&&);
     std::unique_ptr<Impl> _impl;
 };
 
@@ -124,8 +267,10 @@ struct ShaderEntryPoint {
 };
 
 /// Helper class that allocates, populates and binds descriptor sets for us
-/// Since it owns the descriptor sets internally, it must live as they are in use
-/// Therefore, it should not be stack-allocated inside e.g. the beginFrame lambda !
+/// The descriptor sets are cached by the Device, keyed by set layout and bound resources, so binding the same things again is cheap
+/// The cache does not outlive what it points to: sets using an imr::Image or imr::Buffer are dropped when it is destroyed,
+/// samplers and views you create yourself must be passed to Device::forgetHandle() before destroying them
+/// The helper itself can be deleted right after commit()
 struct DescriptorBindHelper {
     class Impl;
 
@@ -135,14 +280,21 @@ struct DescriptorBindHelper {
 
     void set_storage_image(uint32_t set, uint32_t binding, VkImageView, uint32_t array_element = 0);
     void set_sampler(uint32_t set, uint32_t binding, VkSampler, uint32_t array_element = 0);
-    void set_texture_image(uint32_t set, uint32_t binding, VkImageView, uint32_t array_element = 0);
+    /// The image has to be in the given layout when the commands execute, see Image::transition()
+    void set_texture_image(uint32_t set, uint32_t binding, VkImageView, uint32_t array_element = 0, VkImageLayout layout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL);
+    void set_storage_buffer(uint32_t set, uint32_t binding, VkBuffer, VkDeviceSize offset = 0, VkDeviceSize range = VK_WHOLE_SIZE, uint32_t array_element = 0);
+    void set_uniform_buffer(uint32_t set, uint32_t binding, VkBuffer, VkDeviceSize offset = 0, VkDeviceSize range = VK_WHOLE_SIZE, uint32_t array_element = 0);
+    /// Writes all the bindings at once and binds the sets. For pipelines created with push_descriptors, set 0 is pushed into the command buffer instead,
+    /// the other sets still come from the device's descriptor set cache
     void commit(VkCommandBuffer);
 
     std::unique_ptr<Impl> _impl;
 };
 
 struct ComputePipeline {
-    ComputePipeline(Device&, std::string&& spirv_filename, std::string&& entrypoint_name = "main");
+    /// push_descriptors makes set 0 (and only set 0) a push descriptor set, this requires VK_KHR_push_descriptor (see Device::supports_push_descriptors()).
+    /// Resources that change every dispatch belong in set 0 then, the other sets are cached and should be mostly stable.
+    ComputePipeline(Device&, std::string&& spirv_filename, std::string&& entrypoint_name = "main", bool push_descriptors = false);
     ComputePipeline(ComputePipeline&) = delete;
     ~ComputePipeline();
 
@@ -153,6 +305,7 @@ struct ComputePipeline {
     DescriptorBindHelper* create_bind_helper();
 
     struct Impl;
+    explicit ComputePipeline(std::unique_ptr<Impl>&&);
     std::unique_ptr<Impl> _impl;
 };
 
@@ -186,7 +339,8 @@ struct GraphicsPipeline {
     static VkPipelineRasterizationStateCreateInfo solid_filled_polygons();
     static VkPipelineDepthStencilStateCreateInfo simple_depth_testing();
 
-    GraphicsPipeline(Device&, std::vector<ShaderEntryPoint*>&& stages, RenderTargetsState, StateBuilder);
+    /// See ComputePipeline for push_descriptors
+    GraphicsPipeline(Device&, std::vector<ShaderEntryPoint*>&& stages, RenderTargetsState, StateBuilder, bool push_descriptors = false);
     GraphicsPipeline(const GraphicsPipeline&) = delete;
     ~GraphicsPipeline();
 
@@ -200,28 +354,80 @@ struct GraphicsPipeline {
     std::unique_ptr<Impl> _impl;
 };
 
+/// Compiles many pipelines concurrently on a pool of worker threads.
+/// Each call returns immediately, the pipeline is safe to use once its future is ready. Errors are rethrown by get().
+/// The destructor waits for every pipeline that was requested.
+struct PipelineBuilder {
+    /// threads = 0 shares the device's compile workers (one per hardware thread, started once), otherwise the builder gets its own
+    explicit PipelineBuilder(Device&, unsigned threads = 0);
+    PipelineBuilder(PipelineBuilder&) = delete;
+    ~PipelineBuilder();
+
+    std::future<std::unique_ptr<ComputePipeline>> compute(std::string spirv_filename, std::string entrypoint_name = "main", bool push_descriptors = false);
+    /// The entry points must stay alive until the future is ready
+    std::future<std::unique_ptr<GraphicsPipeline>> graphics(std::vector<ShaderEntryPoint*> stages, GraphicsPipeline::RenderTargetsState, GraphicsPipeline::StateBuilder, bool push_descriptors = false);
+
+    struct Impl;
+    std::unique_ptr<Impl> _impl;
+};
+
 struct Swapchain {
     Swapchain(Device&, GLFWwindow* window);
+    /// Offscreen swapchain: the same frame API, over a ring of images it owns instead of a window surface.
+    /// Presenting doesn't wait on anything or pace frames, the frame goes to the readback callback if there is one.
+    Swapchain(Device&, VkExtent2D size, VkFormat format = VK_FORMAT_R8G8B8A8_UNORM, uint32_t image_count = 3);
     ~Swapchain();
 
     Device& device() const;
     VkFormat format() const;
 
-    /// Approximate FPS cap, avoids melting your GPU on a trivial scene
+    /// FPS cap, avoids melting your GPU on a trivial scene. Enforced when frames start rather than by holding back finished ones.
     int maxFps = 999;
 
+    enum class Pacing {
+        /// Frames start as soon as a frame in flight is free, up to maxFps
+        Throughput,
+        /// Only one frame is queued for display, and the next one starts just in time to make the following refresh, based on the measured CPU and GPU frame times.
+        /// Uses VK_KHR_present_wait when the device has it, otherwise waits for the previous frame on the GPU and paces to the monitor refresh rate.
+        LowLatency,
+    };
+    Pacing pacing = Pacing::Throughput;
+
+    /// Moving averages in nanoseconds, 0 until measured. GPU times are only measured for renderFrameSimplified(), present intervals only with VK_KHR_present_wait in low latency mode.
+    struct FrameTimings {
+        uint64_t cpu_time;
+        uint64_t gpu_time;
+        uint64_t present_interval;
+    };
+    FrameTimings frameTimings() const;
+
+    /// How many frames the CPU can record ahead of the GPU, independently of the number of swapchain images (2 by default).
+    /// Each frame in flight has its own command pools and cleanup queue, beginFrame() waits for the oldest one to be done before reusing them.
+    void setFramesInFlight(uint32_t);
+    uint32_t framesInFlight() const;
+
     struct Frame {
         void presentFromBuffer(VkBuffer buffer, VkFence signal_when_reusable, std::optional<VkSemaphore> sem);
         void presentFromImage(VkImage image, VkFence signal_when_reusable, std::optional<VkSemaphore> sem, VkImageLayout src_layout = VK_IMAGE_LAYOUT_GENERAL, std::optional<VkExtent2D> image_size = std::nullopt);
 
         size_t id;
         Image& image() const;
+        /// Both VK_NULL_HANDLE for offscreen swapchains
         VkSemaphore swapchain_image_available;
         VkSemaphore signal_when_ready;
         void queuePresent();
 
         void addCleanupFence(VkFence fence);
         void addCleanupAction(std::function<void(void)>&& fn);
+        /// The frame reads or writes the buffer, so uploads and downloads of it issued after the frame got submitted wait for the frame
+        void markUsed(Buffer&);
+
+        /// Comes from a pool owned by the frame in flight, don't free it: it is recycled along with the frame
+        /// Can be called from any thread, each thread gets its own pool
+        VkCommandBuffer allocateCommandBuffer(VkCommandBufferLevel level = VK_COMMAND_BUFFER_LEVEL_PRIMARY);
+        /// Calls fn(i, cmdbuf) for i in [0, count) on the device's worker threads, each with its own secondary command buffer, then executes them in order in primary.
+        /// No state is inherited from primary, and the secondaries can't be used inside a render pass or withRenderTargets().
+        void recordParallel(VkCommandBuffer primary, size_t count, std::function<void(size_t, VkCommandBuffer)> fn);
 
         void withRenderTargets(VkCommandBuffer, std::vector<Image*> color_images, Image* depth, std::function<void()> f);
 
@@ -252,6 +458,11 @@ struct Swapchain {
 
     void resize();
 
+    /// Called with the contents of each presented frame of an offscreen swapchain, as tightly packed rows of pixels.
+    /// The copy happens asynchronously: this runs from a later beginFrame(), drain() or Device::collect(), and the data is only valid during the call.
+    using ReadbackFn = std::function<void(size_t frame_id, Image& image, const void* pixels, size_t size)>;
+    void setReadback(ReadbackFn);
+
     /// Waits until all the in-flight frames are done and runs their cleanup jobs
     void drain();
 
@@ -259,15 +470,164 @@ struct Swapchain {
     std::unique_ptr<Impl> _impl;
 };
 
+/// Times labelled scopes of a frame's command buffers on the GPU with timestamp queries, from a pool of query pools (one per frame being profiled).
+/// The results are read back by a cleanup action of the frame, which only runs once the frame is done: this never stalls.
+/// Statistics are kept per label over the last `history` samples. Destroying it waits for the submitted frames it has scopes in,
+/// it must not happen while such a frame is still being recorded.
+struct GpuProfiler {
+    explicit GpuProfiler(Device&, uint32_t max_scopes_per_frame = 64, size_t history = 256);
+    GpuProfiler(GpuProfiler&) = delete;
+    ~GpuProfiler();
+
+    /// Scopes go outside of render passes, in any of the frame's command buffers: query pools are reset on the host, once the frame they were used by is done.
+    /// Scopes can nest and be recorded from several threads. Past max_scopes_per_frame, or if the queue has no timestamps, they are ignored.
+    uint32_t begin(Swapchain::Frame&, VkCommandBuffer, std::string label);
+    void end(Swapchain::Frame&, VkCommandBuffer, uint32_t scope);
+    void scope(Swapchain::Frame&, VkCommandBuffer, std::string label, std::function<void()> f);
+
+    /// In milliseconds, over the samples kept for the label. Sorted by label.
+    struct Stats {
+        std::string label;
+        size_t samples;
+        float last;
+        float average;
+        float p50;
+        float p95;
+        float p99;
+        float max;
+    };
+    std::vector<Stats> stats() const;
+    /// One line with the average of each label, e.g. for a window title
+    std::string summary() const;
+    /// Writes stats() as CSV
+    bool dump(const std::string& filename) const;
+
+    struct Impl;
+    std::unique_ptr<Impl> _impl;
+};
+
+/// Records a frame's worth of passes into a command buffer, inserting the barriers between them for you.
+/// Passes declare the images and buffers they access, and are otherwise recorded as if executed in the order they were added.
+/// Independent passes are grouped into levels that can overlap on the GPU, with a single batched barrier between levels.
+/// Passes that don't contribute to an exported resource (and aren't marked with sideEffects()) are culled.
+struct RenderGraph {
+    explicit RenderGraph(Device&);
+    /// Required for transient resources: their memory is handed back once the frame is done with it
+    explicit RenderGraph(Swapchain::Frame&);
+    RenderGraph(RenderGraph&) = delete;
+    ~RenderGraph();
+
+    struct Pass {
+        /// The access flags describe what the pass does with the resource, the stages where it does it
+        Pass& read(Image&, VkPipelineStageFlags2 stage, VkAccessFlags2 access = VK_ACCESS_2_SHADER_STORAGE_READ_BIT, VkImageLayout layout = VK_IMAGE_LAYOUT_GENERAL);
+        Pass& write(Image&, VkPipelineStageFlags2 stage, VkAccessFlags2 access = VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT, VkImageLayout layout = VK_IMAGE_LAYOUT_GENERAL);
+        Pass& read(Buffer&, VkPipelineStageFlags2 stage, VkAccessFlags2 access = VK_ACCESS_2_SHADER_STORAGE_READ_BIT);
+        Pass& write(Buffer&, VkPipelineStageFlags2 stage, VkAccessFlags2 access = VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT);
+        /// The pass does something the graph can't see (e.g. writes a buffer by device address), never cull it
+        Pass& sideEffects();
+
+        struct Impl;
+        std::unique_ptr<Impl> _impl;
+
+        Pass(std::unique_ptr<Impl>&&);
+        ~Pass();
+    };
+
+    /// The pass is recorded into the graph's command buffer, it must not leave barriers or layout transitions for the resources it declared to anyone else
+    Pass& addPass(std::string name, std::function<void(VkCommandBuffer)> record);
+
+    /// State of a resource before the graph runs: its layout, and the last access made to it in submission order.
+    /// Images that are not imported start from the state their Image tracked, and have it updated once the graph is recorded.
+    /// Buffers that are not imported are assumed to have no access to wait on.
+    void importImage(Image&, VkImageLayout layout, VkPipelineStageFlags2 stage = VK_PIPELINE_STAGE_2_NONE, VkAccessFlags2 access = VK_ACCESS_2_NONE);
+    void importBuffer(Buffer&, VkPipelineStageFlags2 stage = VK_PIPELINE_STAGE_2_NONE, VkAccessFlags2 access = VK_ACCESS_2_NONE);
+    /// Marks the resource as an output of the graph, it is left in the given layout and made visible to the given stage and access
+    void exportImage(Image&, VkImageLayout layout, VkPipelineStageFlags2 stage = VK_PIPELINE_STAGE_2_NONE, VkAccessFlags2 access = VK_ACCESS_2_NONE);
+    void exportBuffer(Buffer&, VkPipelineStageFlags2 stage = VK_PIPELINE_STAGE_2_NONE, VkAccessFlags2 access = VK_ACCESS_2_NONE);
+
+    /// Resources that only live for the duration of the graph. Their memory is bound by execute(), and shared with the other transient resources
+    /// whose lifetimes don't overlap with theirs, so their contents start out undefined, and views and device addresses are only valid inside pass callbacks.
+    /// Images with VK_IMAGE_USAGE_TRANSIENT_ATTACHMENT_BIT get lazily allocated memory where available.
+    Image& createTransientImage(VkImageType, VkExtent3D size, VkFormat, VkImageUsageFlags usage, uint32_t mip_levels = 1, uint32_t array_layers = 1, VkSampleCountFlagBits samples = VK_SAMPLE_COUNT_1_BIT);
+    Buffer& createTransientBuffer(size_t size, VkBufferUsageFlags usage);
+
+    /// Wraps each pass in a profiler scope named after it, only for graphs created from a frame.
+    /// Passes of the same level overlap on the GPU, and so do their scopes.
+    void profile(GpuProfiler&);
+
+    /// Schedules the passes and records them along with their barriers
+    void execute(VkCommandBuffer);
+
+    struct Impl;
+    std::unique_ptr<Impl> _impl;
+};
+
+/// Draws triangles with compute shaders. They are first binned into screen tiles, then each tile is rasterized by its own workgroup against the triangles overlapping it only,
+/// so the cost grows with the pixels plus the binned triangles instead of pixels × triangles.
+/// Same conventions as the compute cubes example: pixel (x, y) samples the point (x / width, y / height) * 2 - 1, and the smallest non-negative depth wins.
+struct ComputeRasterizer {
+    /// As laid out in the triangles buffer (scalar layout): the clip space vertices, their projection on screen, and a flat color
+    struct Triangle {
+        float v0[4], v1[4], v2[4];
+        float ss_v0[2], ss_v1[2], ss_v2[2];
+        float color[3];
+    };
+    static constexpr uint32_t TILE_SIZE = 16;
+
+    /// The bins have room for max_bin_entries (triangle, tile) pairs, 4 per triangle if 0.
+    /// Pairs that don't fit are dropped, and those triangles go missing from the tiles concerned: see binEntriesNeeded().
+    ComputeRasterizer(Device&, VkExtent2D max_size, uint32_t max_triangles, uint32_t max_bin_entries = 0);
+    ComputeRasterizer(ComputeRasterizer&) = delete;
+    ~ComputeRasterizer();
+
+    uint32_t binsCapacity() const;
+    /// The most (triangle, tile) pairs a draw needed so far, among the draws the GPU is done with. Overflows are also reported on stderr.
+    /// Above binsCapacity() triangles were dropped: recreate the rasterizer with at least that much room, once it's not in use anymore.
+    uint32_t binEntriesNeeded() const;
+
+    /// Draws count triangles read from the given device address into color, depth testing against (and updating) depth, a VK_FORMAT_R32_SFLOAT image of the same size.
+    /// Both images must be in VK_IMAGE_LAYOUT_GENERAL and ready for compute shader reads and writes, the triangles visible to compute shaders:
+    /// only the barriers between the internal passes are recorded (in a RenderGraph, declare these in the pass calling draw()).
+    /// Successive draws share the bins, they must be recorded for the same queue.
+    void draw(VkCommandBuffer, VkDeviceAddress triangles, uint32_t count, Image& color, Image& depth);
+
+    struct Impl;
+    std::unique_ptr<Impl> _impl;
+};
+
+/// Keeps the duration of the last HISTORY frames in a lock-free ring: tick() stays cheap, and the statistics can be read from another thread.
 struct FpsCounter {
     FpsCounter();
     FpsCounter(FpsCounter&) = delete;
     ~FpsCounter();
 
+    static constexpr size_t HISTORY = 1024;
+
+    /// Call once per frame, from a single thread
     void tick();
     int average_fps();
     float average_frametime();
-    void updateGlfwWindowTitle(GLFWwindow*);
+
+    /// In milliseconds, over the frames still in the ring. Stutters are frames that took more than twice the median.
+    struct Stats {
+        size_t frames;
+        float average;
+        float p50;
+        float p95;
+        float p99;
+        float max;
+        size_t stutters;
+    };
+    Stats stats() const;
+    /// Frame counts per bucket_ms wide bucket, the last bucket also gets all the longer frames
+    std::vector<size_t> histogram(float bucket_ms = 1.0f, size_t buckets = 34) const;
+    /// Every frame time still in the ring, oldest first, for offline analysis
+    bool export_csv(const std::string& filename) const;
+    /// Same, along with stats() and histogram()
+    bool export_json(const std::string& filename) const;
+
+    /// Appends the profiler's summary if there is one
+    void updateGlfwWindowTitle(GLFWwindow*, GpuProfiler* profiler = nullptr);
 
     class Impl;
     std::unique_ptr<Impl> _impl;
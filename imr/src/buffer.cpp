@@ -1,5 +1,9 @@
 #include "imr_private.h"
 
+#include <algorithm>
+#include <array>
+#include <mutex>
+
 namespace imr {
 
 struct Buffer::Impl {
@@ -7,21 +11,47 @@ struct Buffer::Impl {
     VkBufferUsageFlags usage;
     VkMemoryPropertyFlags memory_property;
 
-    VmaAllocation allocation;
-    VmaAllocationInfo allocation_info;
+    /// VK_NULL_HANDLE when the memory is bound from outside (see create_unbound_buffer)
+    VmaAllocation allocation = VK_NULL_HANDLE;
+    VmaAllocationInfo allocation_info = {};
+
+    /// Last timeline value of each queue known to use the buffer (see Buffer::markUsed), 0 if none
+    std::mutex use_mutex;
+    std::array<uint64_t, Device::QUEUES_COUNT> last_use = {};
 };
 
-Buffer::Buffer(imr::Device& device, size_t size, VkBufferUsageFlags usage, VkMemoryPropertyFlags memory_property) : size(size) {
-    _impl = std::make_unique<Impl>(device, usage, memory_property);
-    VkBufferCreateInfo buffer_ci = {
+/// Buffers are shared between all the queue families we use, so uploads and async compute don't need ownership transfers.
+/// Unlike with images, this doesn't cost anything on the hardware we care about.
+static std::vector<uint32_t> sharing_families(Device& device) {
+    std::vector<uint32_t> families;
+    for (auto& state : device._impl->queue_states) {
+        if (std::find(families.begin(), families.end(), state->family) == families.end())
+            families.push_back(state->family);
+    }
+    return families;
+}
+
+static VkBufferCreateInfo buffer_create_info(size_t size, VkBufferUsageFlags usage, const std::vector<uint32_t>& families) {
+    return {
         .sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
         .flags = 0,
         .size = size,
         .usage = usage | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT,
-        .sharingMode = VK_SHARING_MODE_EXCLUSIVE,
+        .sharingMode = families.size() > 1 ? VK_SHARING_MODE_CONCURRENT : VK_SHARING_MODE_EXCLUSIVE,
+        .queueFamilyIndexCount = families.size() > 1 ? static_cast<uint32_t>(families.size()) : 0,
+        .pQueueFamilyIndices = families.size() > 1 ? families.data() : nullptr,
     };
+}
+
+Buffer::Buffer(imr::Device& device, size_t size, VkBufferUsageFlags usage, VkMemoryPropertyFlags memory_property, bool persistently_mapped) : size(size) {
+    if (persistently_mapped && !(memory_property & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT))
+        throw std::runtime_error("Error: only host-visible buffers can be persistently mapped");
+
+    _impl = std::make_unique<Impl>(device, usage, memory_property);
+    auto families = sharing_families(device);
+    VkBufferCreateInfo buffer_ci = buffer_create_info(size, usage, families);
     VmaAllocationCreateInfo vma_aci = {
-        .flags = 0,
+        .flags = persistently_mapped ? (VmaAllocationCreateFlags) VMA_ALLOCATION_CREATE_MAPPED_BIT : 0,
         .usage = VMA_MEMORY_USAGE_UNKNOWN,
         .requiredFlags = memory_property
     };
@@ -30,6 +60,29 @@ Buffer::Buffer(imr::Device& device, size_t size, VkBufferUsageFlags usage, VkMem
     memory_offset = _impl->allocation_info.offset;
 }
 
+Buffer::Buffer(std::unique_ptr<Impl>&& impl, size_t size, VkBuffer handle) : size(size), handle(handle), memory(VK_NULL_HANDLE), memory_offset(0), _impl(std::move(impl)) {}
+
+std::unique_ptr<Buffer> create_unbound_buffer(Device& device, size_t size, VkBufferUsageFlags usage) {
+    auto families = sharing_families(device);
+    VkBufferCreateInfo buffer_ci = buffer_create_info(size, usage, families);
+    VkBuffer handle;
+    CHECK_VK_THROW(vkCreateBuffer(device.device, &buffer_ci, nullptr, &handle));
+    auto impl = std::make_unique<Buffer::Impl>(device, usage, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+    return std::make_unique<Buffer>(std::move(impl), size, handle);
+}
+
+void* Buffer::mapped_ptr() const {
+    return _impl->allocation_info.pMappedData;
+}
+
+void Buffer::flush(uint64_t offset, uint64_t size) {
+    CHECK_VK_THROW(vmaFlushAllocation(_impl->device._impl->allocator, _impl->allocation, offset, size));
+}
+
+void Buffer::invalidate(uint64_t offset, uint64_t size) {
+    CHECK_VK_THROW(vmaInvalidateAllocation(_impl->device._impl->allocator, _impl->allocation, offset, size));
+}
+
 VkDeviceAddress Buffer::device_address() {
     return vkGetBufferDeviceAddress(_impl->device.device, tmpPtr<VkBufferDeviceAddressInfo>({
         .sType = VK_STRUCTURE_TYPE_BUFFER_DEVICE_ADDRESS_INFO,
@@ -37,39 +90,176 @@ VkDeviceAddress Buffer::device_address() {
     }));
 }
 
+void Buffer::markUsed(Device::Token token) {
+    std::lock_guard guard(_impl->use_mutex);
+    auto& last = _impl->last_use[static_cast<size_t>(token.queue)];
+    last = std::max(last, token.value);
+}
+
+/// Host accesses wait for all the marked uses of the buffer. The copies run on the transfer queue, which only needs to wait for the uses on other queues, and nothing else.
+static void wait_for_last_use(Buffer::Impl& impl, std::vector<Device::Token>& wait_for, bool from_host) {
+    auto& device = impl.device;
+    auto& transfer = device._impl->queue(Device::Queue::Transfer);
+    std::lock_guard guard(impl.use_mutex);
+    for (size_t i = 0; i < Device::QUEUES_COUNT; i++) {
+        auto queue = static_cast<Device::Queue>(i);
+        // Ordered by the barrier in the copy instead
+        if ((!from_host && &device._impl->queue(queue) == &transfer) || impl.last_use[i] == 0)
+            continue;
+        wait_for.push_back({ &device, impl.last_use[i], queue });
+    }
+}
+
+/// Earlier work on other queues is covered by the semaphore waits, only the transfer queue's own copies are left, unless it falls back to the main queue
+static VkPipelineStageFlags2 copy_src_stages(Device& device) {
+    bool dedicated = &device._impl->queue(Device::Queue::Transfer) != &device._impl->queue(Device::Queue::Main);
+    return dedicated ? VK_PIPELINE_STAGE_2_COPY_BIT : VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT;
+}
+
 void Buffer::uploadDataSync(uint64_t offset, uint64_t size, void* data) {
+    uploadDataAsync(offset, size, data).wait();
+}
+
+Device::Token Buffer::uploadDataAsync(uint64_t offset, uint64_t size, void* data, std::vector<Device::Token> wait_for) {
     auto& device = _impl->device;
     if (_impl->memory_property & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT) {
-        void* mapped_buffer;
-        CHECK_VK_THROW(vkMapMemory(device.device, memory, memory_offset, size, 0, (void**) &mapped_buffer));
-        memcpy(mapped_buffer, data, size);
-        vkUnmapMemory(device.device, memory);
+        wait_for_last_use(*_impl, wait_for, true);
+        for (auto& token : wait_for)
+            token.wait();
+        if (void* mapped = mapped_ptr()) {
+            memcpy(static_cast<uint8_t*>(mapped) + offset, data, size);
+        } else {
+            // VMA refcounts the mappings of the (possibly shared) memory block for us
+            void* mapped_buffer;
+            CHECK_VK_THROW(vmaMapMemory(device._impl->allocator, _impl->allocation, &mapped_buffer));
+            memcpy(static_cast<uint8_t*>(mapped_buffer) + offset, data, size);
+            vmaUnmapMemory(device._impl->allocator, _impl->allocation);
+        }
+        flush(offset, size);
+        return Device::Token { &device, 0 };
     } else if (_impl->usage & VK_BUFFER_USAGE_TRANSFER_DST_BIT) {
-        // TODO: be less ridiculous, import host memory
-        auto staging = imr::Buffer(device, size, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT);
-        staging.uploadDataSync(0, size, data);
+        auto& ring = device._impl->staging_ring(device);
+        // Doesn't fit in the ring at all: gets a dedicated buffer that lives until the copy is done
+        auto staging = ring.stage(size, 16);
+        memcpy(staging.host_ptr, data, size);
 
-        device.executeCommandsSync([&](VkCommandBuffer cmdbuf) {
+        wait_for_last_use(*_impl, wait_for, false);
+        auto token = device.executeCommandsAsync([&](VkCommandBuffer cmdbuf) {
+            // The buffer might still be in use by previously submitted work, don't overwrite it under its feet
+            auto src_stages = copy_src_stages(device);
+            device.dispatch.cmdPipelineBarrier2KHR(cmdbuf, tmpPtr<VkDependencyInfo>({
+                .sType = VK_STRUCTURE_TYPE_DEPENDENCY_INFO,
+                .bufferMemoryBarrierCount = 1,
+                .pBufferMemoryBarriers = tmpPtr<VkBufferMemoryBarrier2>({
+                    .sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER_2,
+                    .srcStageMask = src_stages,
+                    .srcAccessMask = src_stages == VK_PIPELINE_STAGE_2_COPY_BIT ? VK_ACCESS_2_TRANSFER_WRITE_BIT : VK_ACCESS_2_MEMORY_READ_BIT | VK_ACCESS_2_MEMORY_WRITE_BIT,
+                    .dstStageMask = VK_PIPELINE_STAGE_2_COPY_BIT,
+                    .dstAccessMask = VK_ACCESS_2_TRANSFER_WRITE_BIT,
+                    .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+                    .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+                    .buffer = handle,
+                    .offset = offset,
+                    .size = size,
+                }),
+            }));
             vkCmdCopyBuffer2(cmdbuf, tmpPtr<VkCopyBufferInfo2>({
                 .sType = VK_STRUCTURE_TYPE_COPY_BUFFER_INFO_2,
-                .srcBuffer = staging.handle,
+                .srcBuffer = staging.buffer->handle,
                 .dstBuffer = handle,
                 .regionCount = 1,
                 .pRegions = tmpPtr<VkBufferCopy2>({
                     .sType = VK_STRUCTURE_TYPE_BUFFER_COPY_2,
-                    .srcOffset = 0,
+                    .srcOffset = staging.offset,
                     .dstOffset = offset,
                     .size = size,
                 })
             }));
-        });
+        }, std::move(wait_for), Device::Queue::Transfer);
+
+        ring.retire(staging, token);
+        return token;
     } else {
         throw std::runtime_error("Error: This buffer was allocated without VK_BUFFER_USAGE_TRANSFER_DST_BIT or VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT, we cannot do a host->GPU copy to it!");
     }
 }
 
+void Buffer::downloadDataSync(uint64_t offset, uint64_t size, void* data) {
+    downloadDataAsync(offset, size, data).wait();
+}
+
+Device::Token Buffer::downloadDataAsync(uint64_t offset, uint64_t size, void* data, std::vector<Device::Token> wait_for) {
+    auto& device = _impl->device;
+    if (_impl->memory_property & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT) {
+        wait_for_last_use(*_impl, wait_for, true);
+        for (auto& token : wait_for)
+            token.wait();
+        invalidate(offset, size);
+        if (void* mapped = mapped_ptr()) {
+            memcpy(data, static_cast<uint8_t*>(mapped) + offset, size);
+        } else {
+            void* mapped_buffer;
+            CHECK_VK_THROW(vmaMapMemory(device._impl->allocator, _impl->allocation, &mapped_buffer));
+            memcpy(data, static_cast<uint8_t*>(mapped_buffer) + offset, size);
+            vmaUnmapMemory(device._impl->allocator, _impl->allocation);
+        }
+        return Device::Token { &device, 0 };
+    } else if (_impl->usage & VK_BUFFER_USAGE_TRANSFER_SRC_BIT) {
+        auto& ring = device._impl->readback_ring(device);
+        auto staging = ring.stage(size, 16, true);
+
+        wait_for_last_use(*_impl, wait_for, false);
+        auto token = device.executeCommandsAsync([&](VkCommandBuffer cmdbuf) {
+            auto src_stages = copy_src_stages(device);
+            device.dispatch.cmdPipelineBarrier2KHR(cmdbuf, tmpPtr<VkDependencyInfo>({
+                .sType = VK_STRUCTURE_TYPE_DEPENDENCY_INFO,
+                .bufferMemoryBarrierCount = 1,
+                .pBufferMemoryBarriers = tmpPtr<VkBufferMemoryBarrier2>({
+                    .sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER_2,
+                    .srcStageMask = src_stages,
+                    .srcAccessMask = src_stages == VK_PIPELINE_STAGE_2_COPY_BIT ? VK_ACCESS_2_TRANSFER_WRITE_BIT : VK_ACCESS_2_MEMORY_WRITE_BIT,
+                    .dstStageMask = VK_PIPELINE_STAGE_2_COPY_BIT,
+                    .dstAccessMask = VK_ACCESS_2_TRANSFER_READ_BIT,
+                    .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+                    .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+                    .buffer = handle,
+                    .offset = offset,
+                    .size = size,
+                }),
+            }));
+            vkCmdCopyBuffer2(cmdbuf, tmpPtr<VkCopyBufferInfo2>({
+                .sType = VK_STRUCTURE_TYPE_COPY_BUFFER_INFO_2,
+                .srcBuffer = handle,
+                .dstBuffer = staging.buffer->handle,
+                .regionCount = 1,
+                .pRegions = tmpPtr<VkBufferCopy2>({
+                    .sType = VK_STRUCTURE_TYPE_BUFFER_COPY_2,
+                    .srcOffset = offset,
+                    .dstOffset = staging.offset,
+                    .size = size,
+                })
+            }));
+            make_transfers_host_visible(device, cmdbuf);
+        }, std::move(wait_for), Device::Queue::Transfer);
+
+        ring.retire(staging, token);
+        token.then([=, &ring]() {
+            staging.buffer->invalidate(staging.offset, size);
+            memcpy(data, staging.host_ptr, size);
+            ring.release(staging);
+        });
+        return token;
+    } else {
+        throw std::runtime_error("Error: This buffer was allocated without VK_BUFFER_USAGE_TRANSFER_SRC_BIT or VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT, we cannot do a GPU->host copy from it!");
+    }
+}
+
 Buffer::~Buffer() {
-    vmaDestroyBuffer(_impl->device._impl->allocator, handle, _impl->allocation);
+    _impl->device._impl->descriptors->evict_handle(reinterpret_cast<uint64_t>(handle));
+    if (_impl->allocation)
+        vmaDestroyBuffer(_impl->device._impl->allocator, handle, _impl->allocation);
+    else
+        vkDestroyBuffer(_impl->device.device, handle, nullptr);
 }
 
 }
@@ -0,0 +1,145 @@
+#include "imr_private.h"
+#include "thread_pool.h"
+
+namespace imr {
+
+CommandPoolRegistry::CommandPoolRegistry(Device& device, uint32_t queue_family, VkCommandPoolCreateFlags flags) : device(device), queue_family(queue_family), flags(flags) {}
+
+CommandPoolRegistry::~CommandPoolRegistry() {
+    // Destroying a pool frees all of its command buffers, garbage included
+    for (auto& [thread, pool] : pools)
+        vkDestroyCommandPool(device.device, pool->pool, nullptr);
+}
+
+/// The pools of every registry the thread allocated from, flagged as orphaned when it exits.
+/// Registries might be gone by then, which is why this holds on to the pools too.
+static thread_local struct OwnedPools {
+    std::vector<std::shared_ptr<CommandPoolRegistry::Pool>> pools;
+
+    void add(std::shared_ptr<CommandPoolRegistry::Pool> pool) {
+        // Forget the pools of registries that were destroyed in the meantime
+        std::erase_if(pools, [](auto& owned) { return owned.use_count() == 1; });
+        pools.push_back(std::move(pool));
+    }
+
+    ~OwnedPools() {
+        for (auto& pool : pools) {
+            std::lock_guard guard(pool->mutex);
+            pool->orphaned = true;
+        }
+    }
+} owned_pools;
+
+void CommandPoolRegistry::reap() {
+    for (auto i = pools.begin(); i != pools.end();) {
+        auto& pool = *i->second;
+        bool unused;
+        {
+            std::lock_guard guard(pool.mutex);
+            unused = pool.orphaned && pool.live == pool.garbage.size() && pool.handed_out[0].empty() && pool.handed_out[1].empty();
+        }
+        if (unused) {
+            vkDestroyCommandPool(device.device, pool.pool, nullptr);
+            i = pools.erase(i);
+        } else {
+            i++;
+        }
+    }
+}
+
+std::tuple<CommandPoolRegistry::Pool*, VkCommandBuffer> CommandPoolRegistry::allocate(VkCommandBufferLevel level) {
+    Pool* pool;
+    {
+        std::lock_guard guard(mutex);
+        reap();
+        auto& entry = pools[std::this_thread::get_id()];
+        if (!entry) {
+            entry = std::make_shared<Pool>();
+            CHECK_VK_THROW(vkCreateCommandPool(device.device, tmpPtr<VkCommandPoolCreateInfo>({
+                .sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO,
+                .flags = flags,
+                .queueFamilyIndex = queue_family,
+            }), nullptr, &entry->pool));
+            owned_pools.add(entry);
+        } else {
+            // Thread ids get reused, this thread inherits the pool of the exited one it shares its id with
+            std::lock_guard pool_guard(entry->mutex);
+            if (entry->orphaned) {
+                entry->orphaned = false;
+                owned_pools.add(entry);
+            }
+        }
+        pool = entry.get();
+    }
+
+    bool transient = flags & VK_COMMAND_POOL_CREATE_TRANSIENT_BIT;
+    size_t level_index = level == VK_COMMAND_BUFFER_LEVEL_PRIMARY ? 0 : 1;
+    VkCommandBuffer cmdbuf = VK_NULL_HANDLE;
+    std::vector<VkCommandBuffer> garbage;
+    {
+        std::lock_guard guard(pool->mutex);
+        std::swap(garbage, pool->garbage);
+        pool->live -= garbage.size();
+        if (transient && !pool->recycled[level_index].empty()) {
+            cmdbuf = pool->recycled[level_index].back();
+            pool->recycled[level_index].pop_back();
+        }
+    }
+    if (!garbage.empty())
+        vkFreeCommandBuffers(device.device, pool->pool, static_cast<uint32_t>(garbage.size()), garbage.data());
+
+    if (cmdbuf == VK_NULL_HANDLE) {
+        CHECK_VK_THROW(vkAllocateCommandBuffers(device.device, tmpPtr<VkCommandBufferAllocateInfo>({
+            .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
+            .commandPool = pool->pool,
+            .level = level,
+            .commandBufferCount = 1,
+        }), &cmdbuf));
+    }
+
+    std::lock_guard guard(pool->mutex);
+    if (transient)
+        pool->handed_out[level_index].push_back(cmdbuf);
+    else
+        pool->live++;
+    return { pool, cmdbuf };
+}
+
+void CommandPoolRegistry::release(Pool* pool, VkCommandBuffer cmdbuf) {
+    std::lock_guard guard(pool->mutex);
+    pool->garbage.push_back(cmdbuf);
+}
+
+void CommandPoolRegistry::reset_all() {
+    std::lock_guard guard(mutex);
+    for (auto& [thread, pool] : pools) {
+        std::lock_guard pool_guard(pool->mutex);
+        pool->live -= pool->garbage.size();
+        pool->garbage.clear();
+        CHECK_VK_THROW(vkResetCommandPool(device.device, pool->pool, 0));
+        // The pool only resets its command buffers, allocating new ones every frame would grow it forever
+        for (size_t level = 0; level < 2; level++) {
+            auto& recycled = pool->recycled[level];
+            recycled.insert(recycled.end(), pool->handed_out[level].begin(), pool->handed_out[level].end());
+            pool->handed_out[level].clear();
+        }
+    }
+    // Transient pools have nothing in use after a reset, so those of exited threads can go
+    reap();
+}
+
+ThreadPool& Device::Impl::worker_pool() {
+    std::lock_guard guard(submission_mutex);
+    if (!workers)
+        workers = std::make_unique<ThreadPool>(0);
+    return *workers;
+}
+
+ThreadPool& Device::Impl::compile_pool() {
+    std::lock_guard guard(submission_mutex);
+    if (!compile_workers)
+        compile_workers = std::make_unique<ThreadPool>(0);
+    return *compile_workers;
+}
+
+}
@@ -0,0 +1,155 @@
+#include "shader_private.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <iterator>
+
+// Generated at build time from src/shaders/, see CMakeLists.txt
+#include "compute_raster_bin.h"
+#include "compute_raster_scan.h"
+#include "compute_raster_tiles.h"
+
+namespace imr {
+
+/// Shared by the three shaders, in the same order as their push constant blocks (scalar layout)
+struct RasterPushConstants {
+    VkDeviceAddress triangles;
+    VkDeviceAddress tiles;
+    VkDeviceAddress bins;
+    VkDeviceAddress stats;
+    uint32_t triangles_count;
+    uint32_t bins_capacity;
+    uint32_t image_size[2];
+    uint32_t tiles_count[2];
+    /// The binning shader runs twice, first counting then writing
+    uint32_t write_bins;
+};
+/// Without the padding the C++ struct has at the end
+static constexpr uint32_t RASTER_PUSH_CONSTANTS_SIZE = offsetof(RasterPushConstants, write_bins) + sizeof(uint32_t);
+
+/// Workgroup size of the binning shader
+static constexpr uint32_t BIN_GROUP_SIZE = 256;
+
+struct ComputeRasterizer::Impl {
+    Device& device;
+    VkExtent2D max_size;
+    uint32_t bins_capacity;
+
+    std::unique_ptr<ComputePipeline> bin;
+    std::unique_ptr<ComputePipeline> scan;
+    std::unique_ptr<ComputePipeline> raster;
+
+    /// A (count, offset) pair of uints per tile
+    std::unique_ptr<Buffer> tiles;
+    /// Triangle ids, grouped by tile
+    std::unique_ptr<Buffer> bins;
+    /// Host-visible, the largest number of bin entries a draw needed
+    std::unique_ptr<Buffer> stats;
+    /// Last overflow we complained about, so it's only reported when it gets worse
+    uint32_t reported_overflow = 0;
+};
+
+ComputeRasterizer::ComputeRasterizer(Device& device, VkExtent2D max_size, uint32_t max_triangles, uint32_t max_bin_entries) {
+    _impl = std::make_unique<Impl>(device, max_size);
+    _impl->bins_capacity = max_bin_entries > 0 ? max_bin_entries : std::max(max_triangles, 1u) * 4;
+
+    _impl->bin = make_compute_pipeline(device, SPIRVModule::borrow(compute_raster_bin_spv, std::size(compute_raster_bin_spv)));
+    _impl->scan = make_compute_pipeline(device, SPIRVModule::borrow(compute_raster_scan_spv, std::size(compute_raster_scan_spv)));
+    _impl->raster = make_compute_pipeline(device, SPIRVModule::borrow(compute_raster_tiles_spv, std::size(compute_raster_tiles_spv)));
+
+    size_t tiles = size_t((max_size.width + TILE_SIZE - 1) / TILE_SIZE) * ((max_size.height + TILE_SIZE - 1) / TILE_SIZE);
+    auto usage = VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT;
+    _impl->tiles = std::make_unique<Buffer>(device, std::max<size_t>(tiles, 1) * 2 * sizeof(uint32_t), usage);
+    _impl->bins = std::make_unique<Buffer>(device, size_t(_impl->bins_capacity) * sizeof(uint32_t), usage);
+    _impl->stats = std::make_unique<Buffer>(device, sizeof(uint32_t), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, true);
+    *_impl->stats->host_ptr<uint32_t>() = 0;
+}
+
+ComputeRasterizer::~ComputeRasterizer() {}
+
+uint32_t ComputeRasterizer::binsCapacity() const {
+    return _impl->bins_capacity;
+}
+
+uint32_t ComputeRasterizer::binEntriesNeeded() const {
+    return *static_cast<volatile uint32_t*>(_impl->stats->mapped_ptr());
+}
+
+void ComputeRasterizer::draw(VkCommandBuffer cmdbuf, VkDeviceAddress triangles, uint32_t count, Image& color, Image& depth) {
+    auto& vk = _impl->device.dispatch;
+    VkExtent3D size = color.size();
+    if (size.width > _impl->max_size.width || size.height > _impl->max_size.height)
+        throw std::runtime_error("image is larger than the rasterizer's max_size");
+    if (count == 0)
+        return;
+
+    uint32_t needed = binEntriesNeeded();
+    if (needed > _impl->bins_capacity && needed > _impl->reported_overflow) {
+        fprintf(stderr, "ComputeRasterizer: a draw needed %u bin entries but there is only room for %u, some triangles were dropped\n", needed, _impl->bins_capacity);
+        _impl->reported_overflow = needed;
+    }
+
+    uint32_t tiles_x = (size.width + TILE_SIZE - 1) / TILE_SIZE;
+    uint32_t tiles_y = (size.height + TILE_SIZE - 1) / TILE_SIZE;
+
+    RasterPushConstants push_constants = {
+        .triangles = triangles,
+        .tiles = _impl->tiles->device_address(),
+        .bins = _impl->bins->device_address(),
+        .stats = _impl->stats->device_address(),
+        .triangles_count = count,
+        .bins_capacity = _impl->bins_capacity,
+        .image_size = { size.width, size.height },
+        .tiles_count = { tiles_x, tiles_y },
+        .write_bins = 0,
+    };
+
+    auto barrier = [&](VkPipelineStageFlags2 src_stage, VkAccessFlags2 src_access, VkPipelineStageFlags2 dst_stage, VkAccessFlags2 dst_access) {
+        vk.cmdPipelineBarrier2KHR(cmdbuf, tmpPtr<VkDependencyInfo>({
+            .sType = VK_STRUCTURE_TYPE_DEPENDENCY_INFO,
+            .memoryBarrierCount = 1,
+            .pMemoryBarriers = tmpPtr<VkMemoryBarrier2>({
+                .sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER_2,
+                .srcStageMask = src_stage,
+                .srcAccessMask = src_access,
+                .dstStageMask = dst_stage,
+                .dstAccessMask = dst_access,
+            }),
+        }));
+    };
+    auto compute_barrier = [&]() {
+        barrier(VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT, VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT, VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT, VK_ACCESS_2_SHADER_STORAGE_READ_BIT | VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT);
+    };
+    auto dispatch = [&](ComputePipeline& pipeline, uint32_t x, uint32_t y) {
+        vk.cmdBindPipeline(cmdbuf, VK_PIPELINE_BIND_POINT_COMPUTE, pipeline.pipeline());
+        vk.cmdPushConstants(cmdbuf, pipeline.layout(), VK_SHADER_STAGE_COMPUTE_BIT, 0, RASTER_PUSH_CONSTANTS_SIZE, &push_constants);
+        vk.cmdDispatch(cmdbuf, x, y, 1);
+    };
+
+    // The previous draw might still be reading the bins
+    barrier(VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT, VK_ACCESS_2_SHADER_STORAGE_READ_BIT | VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT, VK_PIPELINE_STAGE_2_TRANSFER_BIT, VK_ACCESS_2_TRANSFER_WRITE_BIT);
+    vk.cmdFillBuffer(cmdbuf, _impl->tiles->handle, 0, size_t(tiles_x) * tiles_y * 2 * sizeof(uint32_t), 0);
+    barrier(VK_PIPELINE_STAGE_2_TRANSFER_BIT, VK_ACCESS_2_TRANSFER_WRITE_BIT, VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT, VK_ACCESS_2_SHADER_STORAGE_READ_BIT | VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT);
+
+    uint32_t bin_groups = (count + BIN_GROUP_SIZE - 1) / BIN_GROUP_SIZE;
+    // Count the triangles overlapping each tile, turn that into offsets in the bins, then fill them in
+    dispatch(*_impl->bin, bin_groups, 1);
+    compute_barrier();
+    dispatch(*_impl->scan, 1, 1);
+    // binEntriesNeeded() reads what the scan wrote once the GPU is done
+    barrier(VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT, VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT, VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT | VK_PIPELINE_STAGE_2_HOST_BIT, VK_ACCESS_2_SHADER_STORAGE_READ_BIT | VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT | VK_ACCESS_2_HOST_READ_BIT);
+    push_constants.write_bins = 1;
+    dispatch(*_impl->bin, bin_groups, 1);
+    compute_barrier();
+
+    auto& raster = *_impl->raster;
+    auto bind_helper = raster.create_bind_helper();
+    bind_helper->set_storage_image(0, 0, color.whole_image_view());
+    bind_helper->set_storage_image(0, 1, depth.whole_image_view());
+    bind_helper->commit(cmdbuf);
+    delete bind_helper;
+    dispatch(raster, tiles_x, tiles_y);
+}
+
+}
@@ -2,14 +2,17 @@
 
 namespace imr {
 
-Context::Context(std::function<void(vkb::InstanceBuilder&)>&& instance_custom) {
+Context::Context(std::function<void(vkb::InstanceBuilder&)>&& instance_custom, bool headless) : headless(headless) {
     auto instance_builder = vkb::InstanceBuilder()
         .use_default_debug_messenger()
         .request_validation_layers()
         .set_minimum_instance_version(1, 3, 0)
-        .enable_extension("VK_KHR_get_surface_capabilities2")
-        //.enable_extension("VK_EXT_surface_maintenance1")
+        .set_headless(headless)
         .require_api_version(1, 3, 0);
+    if (!headless) {
+        instance_builder.enable_extension("VK_KHR_get_surface_capabilities2");
+        //instance_builder.enable_extension("VK_EXT_surface_maintenance1");
+    }
 
     instance_custom(instance_builder);
 
@@ -1,5 +1,7 @@
 #include "shader_private.h"
 
+#include <map>
+
 namespace imr {
 
 struct DescriptorBindHelper::Impl {
@@ -8,69 +10,23 @@ struct DescriptorBindHelper::Impl {
     ReflectedLayout& reflected;
     VkPipelineBindPoint bind_point;
 
-    unsigned nsets;
-    VkDescriptorSet* sets;
-    VkDescriptorPool pool;
-
-    std::vector<std::function<void(void)>> cleanup;
+    /// What gets bound in each set, resolved to actual descriptor sets by the device's cache on commit()
+    std::map<unsigned, std::vector<DescriptorCache::Binding>> bindings;
     bool committed = false;
 
-    Impl(Device& device, PipelineLayout& layout, ReflectedLayout& reflected, VkPipelineBindPoint bind_point) : device(device), layout(layout), reflected(reflected), bind_point(bind_point) {
-        auto& vk = device.dispatch;
-        nsets = reflected.set_bindings.size();
-
-        std::unordered_map<VkDescriptorType, uint32_t> descriptor_counts;
-        auto access_map = [&](VkDescriptorType key) -> uint32_t& {
-            if (descriptor_counts.contains(key))
-                return descriptor_counts[key];
-            return descriptor_counts[key] = 0;
-        };
-        for (auto& [set, bindings] : reflected.set_bindings) {
-            for (auto& binding : bindings) {
-                access_map(binding.descriptorType) += binding.descriptorCount;
-            }
-        }
-
-        std::vector<VkDescriptorPoolSize> pool_sizes;
-        for (auto& [type, count] : descriptor_counts) {
-            VkDescriptorPoolSize size = {
-                .type = type,
-                .descriptorCount = count,
-            };
-            pool_sizes.push_back(size);
-        }
-
-        vkCreateDescriptorPool(vk.device, tmpPtr<VkDescriptorPoolCreateInfo>({
-            .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO,
-            .flags = VK_DESCRIPTOR_POOL_CREATE_FREE_DESCRIPTOR_SET_BIT,
-            .maxSets = static_cast<uint32_t>(layout.set_layouts.size()),
-            .poolSizeCount = static_cast<uint32_t>(pool_sizes.size()),
-            .pPoolSizes = pool_sizes.data(),
-        }), nullptr, &pool);
-
-        sets = reinterpret_cast<VkDescriptorSet*>(calloc(nsets, sizeof(VkDescriptorSet)));
-    }
-
-    // Lazily allocates the set if we need it
-    VkDescriptorSet get_or_create_set(unsigned set) {
-        if (sets[set] == 0) {
-            CHECK_VK_THROW(vkAllocateDescriptorSets(device.device, tmpPtr<VkDescriptorSetAllocateInfo>({
-                .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO,
-                .descriptorPool = pool,
-                .descriptorSetCount = 1,
-                .pSetLayouts = &layout.set_layouts[set],
-            }), &sets[set]));
-        }
-        return sets[set];
-    }
+    Impl(Device& device, PipelineLayout& layout, ReflectedLayout& reflected, VkPipelineBindPoint bind_point) : device(device), layout(layout), reflected(reflected), bind_point(bind_point) {}
 
-    ~Impl() {
-        free(sets);
-        vkDestroyDescriptorPool(device.device, pool, nullptr);
-
-        for (auto& fn : cleanup) {
-            fn();
+    void bind(unsigned set, DescriptorCache::Binding binding) {
+        assert(!committed);
+        assert(set < layout.set_layouts.size());
+        auto& set_bindings = bindings[set];
+        for (auto& existing : set_bindings) {
+            if (existing.binding == binding.binding && existing.array_element == binding.array_element) {
+                existing = binding;
+                return;
+            }
         }
+        set_bindings.push_back(binding);
     }
 };
 
@@ -91,67 +47,74 @@ DescriptorBindHelper* GraphicsPipeline::create_bind_helper() {
 }
 
 void DescriptorBindHelper::set_storage_image(uint32_t set, uint32_t binding, VkImageView view, uint32_t array_element) {
-    assert(!_impl->committed);
-    auto& device = _impl->device;
-
-    vkUpdateDescriptorSets(device.device, 1, tmpPtr<VkWriteDescriptorSet>({
-        .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
-        .dstSet = _impl->get_or_create_set(set),
-        .dstBinding = binding,
-        .dstArrayElement = array_element,
-        .descriptorCount = 1,
-        .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE,
-        .pImageInfo = tmpPtr<VkDescriptorImageInfo>({
-            .sampler = VK_NULL_HANDLE,
-            .imageView = view,
-            .imageLayout = VK_IMAGE_LAYOUT_GENERAL,
-        }),
-    }), 0, nullptr);
+    _impl->bind(set, {
+        .binding = binding,
+        .array_element = array_element,
+        .type = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE,
+        .handle = reinterpret_cast<uint64_t>(view),
+        .layout = VK_IMAGE_LAYOUT_GENERAL,
+    });
 }
 
 void DescriptorBindHelper::set_sampler(uint32_t set, uint32_t binding, VkSampler sampler, uint32_t array_element) {
-    assert(!_impl->committed);
-    auto& device = _impl->device;
-
-    vkUpdateDescriptorSets(device.device, 1, tmpPtr<VkWriteDescriptorSet>({
-        .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
-        .dstSet = _impl->get_or_create_set(set),
-        .dstBinding = binding,
-        .dstArrayElement = array_element,
-        .descriptorCount = 1,
-        .descriptorType = VK_DESCRIPTOR_TYPE_SAMPLER,
-        .pImageInfo = tmpPtr<VkDescriptorImageInfo>({
-            .sampler = sampler,
-        }),
-    }), 0, nullptr);
+    _impl->bind(set, {
+        .binding = binding,
+        .array_element = array_element,
+        .type = VK_DESCRIPTOR_TYPE_SAMPLER,
+        .handle = reinterpret_cast<uint64_t>(sampler),
+        .layout = VK_IMAGE_LAYOUT_UNDEFINED,
+    });
 }
 
-void DescriptorBindHelper::set_texture_image(uint32_t set, uint32_t binding, VkImageView view, uint32_t array_element) {
-    assert(!_impl->committed);
-    auto& device = _impl->device;
-
-    vkUpdateDescriptorSets(device.device, 1, tmpPtr<VkWriteDescriptorSet>({
-        .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
-        .dstSet = _impl->get_or_create_set(set),
-        .dstBinding = binding,
-        .dstArrayElement = array_element,
-        .descriptorCount = 1,
-        .descriptorType = VK_DESCRIPTOR_TYPE_SAMPLED_IMAGE,
-        .pImageInfo = tmpPtr<VkDescriptorImageInfo>({
-            .sampler = VK_NULL_HANDLE,
-            .imageView = view,
-            .imageLayout = VK_IMAGE_LAYOUT_GENERAL,
-        }),
-    }), 0, nullptr);
+void DescriptorBindHelper::set_texture_image(uint32_t set, uint32_t binding, VkImageView view, uint32_t array_element, VkImageLayout layout) {
+    _impl->bind(set, {
+        .binding = binding,
+        .array_element = array_element,
+        .type = VK_DESCRIPTOR_TYPE_SAMPLED_IMAGE,
+        .handle = reinterpret_cast<uint64_t>(view),
+        .layout = layout,
+    });
+}
+
+void DescriptorBindHelper::set_storage_buffer(uint32_t set, uint32_t binding, VkBuffer buffer, VkDeviceSize offset, VkDeviceSize range, uint32_t array_element) {
+    _impl->bind(set, {
+        .binding = binding,
+        .array_element = array_element,
+        .type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+        .handle = reinterpret_cast<uint64_t>(buffer),
+        .layout = VK_IMAGE_LAYOUT_UNDEFINED,
+        .offset = offset,
+        .range = range,
+    });
+}
+
+void DescriptorBindHelper::set_uniform_buffer(uint32_t set, uint32_t binding, VkBuffer buffer, VkDeviceSize offset, VkDeviceSize range, uint32_t array_element) {
+    _impl->bind(set, {
+        .binding = binding,
+        .array_element = array_element,
+        .type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER,
+        .handle = reinterpret_cast<uint64_t>(buffer),
+        .layout = VK_IMAGE_LAYOUT_UNDEFINED,
+        .offset = offset,
+        .range = range,
+    });
 }
 
 void DescriptorBindHelper::commit(VkCommandBuffer cmdbuf) {
     assert(!_impl->committed);
-    for (unsigned set = 0; set < _impl->nsets; set++) {
-        if (_impl->sets[set])
-            vkCmdBindDescriptorSets(cmdbuf, _impl->bind_point, _impl->layout.pipeline_layout, set, 1, &_impl->sets[set], 0, nullptr);
+    auto& cache = *_impl->device._impl->descriptors;
+    for (auto& [set, bindings] : _impl->bindings) {
+        if (_impl->layout.push_set == set) {
+            // No set to allocate or cache, the writes are recorded straight into the command buffer
+            DescriptorCache::Writes writes(bindings, VK_NULL_HANDLE);
+            _impl->device.dispatch.cmdPushDescriptorSetKHR(cmdbuf, _impl->bind_point, _impl->layout.pipeline_layout, set, static_cast<uint32_t>(writes.writes.size()), writes.writes.data());
+            continue;
+        }
+        VkDescriptorSet descriptor_set = cache.get(_impl->layout.set_layouts[set], std::move(bindings));
+        vkCmdBindDescriptorSets(cmdbuf, _impl->bind_point, _impl->layout.pipeline_layout, set, 1, &descriptor_set, 0, nullptr);
     }
+    _impl->bindings.clear();
     _impl->committed = true;
 }
 
-}
\ No newline at end of file
+}
@@ -0,0 +1,240 @@
+#include "imr_private.h"
+
+#include <algorithm>
+
+namespace imr {
+
+/// Every shared pool has room for this many sets, and this many descriptors of each type
+static constexpr uint32_t POOL_MAX_SETS = 256;
+static constexpr uint32_t POOL_DESCRIPTORS_PER_TYPE = 1024;
+/// Past this many cached sets, the least recently used quarter of them is evicted
+static constexpr size_t MAX_CACHED_SETS = 4096;
+
+/// What the shared pools have room for
+static constexpr VkDescriptorType POOL_DESCRIPTOR_TYPES[] = { VK_DESCRIPTOR_TYPE_SAMPLER, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, VK_DESCRIPTOR_TYPE_SAMPLED_IMAGE, VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER };
+
+size_t DescriptorCache::KeyHash::operator()(const Key& key) const {
+    auto combine = [](size_t& seed, uint64_t value) {
+        seed ^= std::hash<uint64_t>()(value) + 0x9e3779b97f4a7c15ULL + (seed << 6) + (seed >> 2);
+    };
+    size_t seed = 0;
+    combine(seed, reinterpret_cast<uint64_t>(key.layout));
+    for (auto& binding : key.bindings) {
+        combine(seed, binding.binding);
+        combine(seed, binding.array_element);
+        combine(seed, binding.type);
+        combine(seed, binding.handle);
+        combine(seed, binding.layout);
+        combine(seed, binding.offset);
+        combine(seed, binding.range);
+    }
+    return seed;
+}
+
+static bool is_buffer_descriptor(VkDescriptorType type) {
+    return type == VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER || type == VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+}
+
+DescriptorCache::Writes::Writes(const std::vector<Binding>& bindings, VkDescriptorSet dst) {
+    // The writes point into these, so they must not reallocate
+    image_infos.reserve(bindings.size());
+    buffer_infos.reserve(bindings.size());
+    for (auto& binding : bindings) {
+        VkWriteDescriptorSet write = {
+            .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+            .dstSet = dst,
+            .dstBinding = binding.binding,
+            .dstArrayElement = binding.array_element,
+            .descriptorCount = 1,
+            .descriptorType = binding.type,
+        };
+        if (is_buffer_descriptor(binding.type)) {
+            buffer_infos.push_back({
+                .buffer = reinterpret_cast<VkBuffer>(binding.handle),
+                .offset = binding.offset,
+                .range = binding.range,
+            });
+            write.pBufferInfo = &buffer_infos.back();
+        } else {
+            bool is_sampler = binding.type == VK_DESCRIPTOR_TYPE_SAMPLER;
+            image_infos.push_back({
+                .sampler = is_sampler ? reinterpret_cast<VkSampler>(binding.handle) : VK_NULL_HANDLE,
+                .imageView = is_sampler ? VK_NULL_HANDLE : reinterpret_cast<VkImageView>(binding.handle),
+                .imageLayout = binding.layout,
+            });
+            write.pImageInfo = &image_infos.back();
+        }
+        writes.push_back(write);
+    }
+}
+
+DescriptorCache::DescriptorCache(Device& device) : device(device) {}
+
+DescriptorCache::~DescriptorCache() {
+    for (auto pool : pools)
+        vkDestroyDescriptorPool(device.device, pool, nullptr);
+}
+
+VkDescriptorPool DescriptorCache::create_pool() {
+    std::vector<VkDescriptorPoolSize> pool_sizes;
+    for (auto type : POOL_DESCRIPTOR_TYPES) {
+        pool_sizes.push_back({
+            .type = type,
+            .descriptorCount = POOL_DESCRIPTORS_PER_TYPE,
+        });
+    }
+
+    VkDescriptorPool pool;
+    CHECK_VK_THROW(vkCreateDescriptorPool(device.device, tmpPtr<VkDescriptorPoolCreateInfo>({
+        .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO,
+        .flags = VK_DESCRIPTOR_POOL_CREATE_FREE_DESCRIPTOR_SET_BIT,
+        .maxSets = POOL_MAX_SETS,
+        .poolSizeCount = static_cast<uint32_t>(pool_sizes.size()),
+        .pPoolSizes = pool_sizes.data(),
+    }), nullptr, &pool));
+    pools.push_back(pool);
+    return pool;
+}
+
+DescriptorCache::Entry DescriptorCache::allocate(VkDescriptorSetLayout layout) {
+    // Try the most recent pool first, as the older ones are likely full
+    for (auto i = pools.rbegin(); i != pools.rend(); i++) {
+        VkDescriptorSet set;
+        VkResult result = vkAllocateDescriptorSets(device.device, tmpPtr<VkDescriptorSetAllocateInfo>({
+            .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO,
+            .descriptorPool = *i,
+            .descriptorSetCount = 1,
+            .pSetLayouts = &layout,
+        }), &set);
+        if (result == VK_SUCCESS)
+            return { set, *i };
+        if (result != VK_ERROR_OUT_OF_POOL_MEMORY && result != VK_ERROR_FRAGMENTED_POOL)
+            throw std::runtime_error("vkAllocateDescriptorSets failed");
+    }
+
+    auto pool = create_pool();
+    VkDescriptorSet set;
+    VkResult result = vkAllocateDescriptorSets(device.device, tmpPtr<VkDescriptorSetAllocateInfo>({
+        .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO,
+        .descriptorPool = pool,
+        .descriptorSetCount = 1,
+        .pSetLayouts = &layout,
+    }), &set);
+    if (result != VK_SUCCESS) {
+        // Doesn't even fit in an empty pool (e.g. a descriptor type the pools have no room for), don't keep adding pools for nothing
+        pools.pop_back();
+        vkDestroyDescriptorPool(device.device, pool, nullptr);
+        throw std::runtime_error("vkAllocateDescriptorSets failed on a fresh pool");
+    }
+    return { set, pool };
+}
+
+VkDescriptorSet DescriptorCache::get(VkDescriptorSetLayout layout, std::vector<Binding>&& bindings) {
+    std::sort(bindings.begin(), bindings.end(), [](const Binding& a, const Binding& b) {
+        return std::tie(a.binding, a.array_element) < std::tie(b.binding, b.array_element);
+    });
+    for (auto& binding : bindings) {
+        if (std::find(std::begin(POOL_DESCRIPTOR_TYPES), std::end(POOL_DESCRIPTOR_TYPES), binding.type) == std::end(POOL_DESCRIPTOR_TYPES))
+            throw std::runtime_error("Unsupported descriptor type " + std::to_string(binding.type));
+    }
+    Key key = { layout, std::move(bindings) };
+
+    std::lock_guard guard(mutex);
+    use_clock++;
+    if (auto found = entries.find(key); found != entries.end()) {
+        found->second.last_used = use_clock;
+        return found->second.set;
+    }
+
+    free_retired();
+    auto entry = allocate(layout);
+    entry.last_used = use_clock;
+
+    Writes writes(key.bindings, entry.set);
+    vkUpdateDescriptorSets(device.device, static_cast<uint32_t>(writes.writes.size()), writes.writes.data(), 0, nullptr);
+
+    entries.emplace(std::move(key), entry);
+    if (entries.size() > MAX_CACHED_SETS)
+        trim();
+    return entry.set;
+}
+
+void DescriptorCache::retire(const Entry& entry) {
+    Retired r = { entry.set, entry.pool, {} };
+    std::lock_guard guard(device._impl->submission_mutex);
+    for (auto& state : device._impl->queue_states) {
+        uint64_t value = state->pending ? state->pending->value : state->last_submitted;
+        // Frames take their timeline value when they are submitted, so the one being recorded right now gets the next one
+        if (state->queue == Device::Queue::Main)
+            value = std::max(value, state->last_submitted + 1);
+        r.values[static_cast<size_t>(state->queue)] = value;
+    }
+    retired.push_back(r);
+}
+
+void DescriptorCache::free_retired() {
+    if (retired.empty())
+        return;
+    std::array<uint64_t, Device::QUEUES_COUNT> completed;
+    for (auto& state : device._impl->queue_states)
+        completed[static_cast<size_t>(state->queue)] = device._impl->completed_value(device, *state);
+
+    for (auto i = retired.begin(); i != retired.end();) {
+        bool done = true;
+        for (size_t q = 0; q < Device::QUEUES_COUNT; q++)
+            done &= i->values[q] <= completed[q];
+        if (done) {
+            vkFreeDescriptorSets(device.device, i->pool, 1, &i->set);
+            i = retired.erase(i);
+        } else {
+            i++;
+        }
+    }
+}
+
+template<typename P>
+void DescriptorCache::evict_if(P predicate) {
+    for (auto i = entries.begin(); i != entries.end();) {
+        if (predicate(i->first, i->second)) {
+            retire(i->second);
+            i = entries.erase(i);
+        } else {
+            i++;
+        }
+    }
+}
+
+void DescriptorCache::trim() {
+    std::vector<uint64_t> ages;
+    ages.reserve(entries.size());
+    for (auto& [key, entry] : entries)
+        ages.push_back(entry.last_used);
+    // The least recently used quarter goes, so this doesn't run on every miss
+    auto cutoff = ages.begin() + ages.size() / 4;
+    std::nth_element(ages.begin(), cutoff, ages.end());
+    evict_if([&](const Key&, const Entry& entry) {
+        return entry.last_used < *cutoff;
+    });
+}
+
+void DescriptorCache::evict_handle(uint64_t handle) {
+    std::lock_guard guard(mutex);
+    evict_if([&](const Key& key, const Entry&) {
+        for (auto& binding : key.bindings) {
+            if (binding.handle == handle)
+                return true;
+        }
+        return false;
+    });
+    free_retired();
+}
+
+void DescriptorCache::evict_layout(VkDescriptorSetLayout layout) {
+    std::lock_guard guard(mutex);
+    evict_if([&](const Key& key, const Entry&) {
+        return key.layout == layout;
+    });
+    free_retired();
+}
+
+}
@@ -1,4 +1,5 @@
 #include "imr_private.h"
+#include "thread_pool.h"
 
 namespace imr {
 
@@ -29,6 +30,14 @@ static auto make_default_device_selector(Context& context) {
         .add_required_extension_features(VkPhysicalDeviceDynamicRenderingFeaturesKHR({
                 .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_DYNAMIC_RENDERING_FEATURES_KHR,
                 .dynamicRendering = VK_TRUE
+        }))
+        .add_required_extension_features(VkPhysicalDeviceTimelineSemaphoreFeatures({
+            .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_TIMELINE_SEMAPHORE_FEATURES,
+            .timelineSemaphore = true,
+        }))
+        .add_required_extension_features(VkPhysicalDeviceHostQueryResetFeatures({
+            .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_HOST_QUERY_RESET_FEATURES,
+            .hostQueryReset = true,
         }));
     return device_selector;
 }
@@ -54,7 +63,22 @@ Device::Device(Context& context, std::function<void(vkb::PhysicalDeviceSelector&
 Device::Device(imr::Context& context, vkb::PhysicalDevice physical_device) : context(context), physical_device(physical_device) {
     _impl = std::make_unique<Impl>();
 
-    if (auto built = vkb::DeviceBuilder(physical_device)
+    _impl->push_descriptors_supported = this->physical_device.enable_extension_if_present(VK_KHR_PUSH_DESCRIPTOR_EXTENSION_NAME);
+    // Only useful to pace presentation, and headless devices don't get VK_KHR_swapchain which they depend on
+    if (!context.headless && this->physical_device.is_extension_present(VK_KHR_PRESENT_ID_EXTENSION_NAME) && this->physical_device.is_extension_present(VK_KHR_PRESENT_WAIT_EXTENSION_NAME)) {
+        _impl->present_wait_supported = this->physical_device.enable_extension_if_present(VK_KHR_PRESENT_ID_EXTENSION_NAME)
+            && this->physical_device.enable_extension_if_present(VK_KHR_PRESENT_WAIT_EXTENSION_NAME)
+            && this->physical_device.enable_extension_features_if_present(VkPhysicalDevicePresentIdFeaturesKHR({
+                .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PRESENT_ID_FEATURES_KHR,
+                .presentId = true,
+            }))
+            && this->physical_device.enable_extension_features_if_present(VkPhysicalDevicePresentWaitFeaturesKHR({
+                .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PRESENT_WAIT_FEATURES_KHR,
+                .presentWait = true,
+            }));
+    }
+
+    if (auto built = vkb::DeviceBuilder(this->physical_device)
             .build(); built.has_value())
     {
         device = built.value();
@@ -64,10 +88,47 @@ Device::Device(imr::Context& context, vkb::PhysicalDevice physical_device) : con
     main_queue_idx = device.get_queue_index(vkb::QueueType((int) vkb::QueueType::graphics | (int) vkb::QueueType::present)).value();
     main_queue = device.get_queue(vkb::QueueType((int) vkb::QueueType::graphics | (int) vkb::QueueType::present)).value();
 
-    CHECK_VK(vkCreateCommandPool(device, tmpPtr<VkCommandPoolCreateInfo>({
-        .sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO,
-        .queueFamilyIndex = main_queue_idx,
-    }), nullptr, &pool), throw std::runtime_error("failed to create cmdpool"));
+    // Prefer a family that does nothing else, then any family without graphics, then give up and use the main queue
+    auto find_queue = [&](vkb::QueueType type, VkQueue& queue, uint32_t& idx) {
+        if (auto dedicated = device.get_dedicated_queue_index(type); dedicated.has_value()) {
+            idx = dedicated.value();
+            queue = device.get_dedicated_queue(type).value();
+        } else if (auto separate = device.get_queue_index(type); separate.has_value()) {
+            idx = separate.value();
+            queue = device.get_queue(type).value();
+        } else {
+            idx = main_queue_idx;
+            queue = main_queue;
+        }
+    };
+    find_queue(vkb::QueueType::transfer, transfer_queue, transfer_queue_idx);
+    find_queue(vkb::QueueType::compute, compute_queue, compute_queue_idx);
+
+    auto add_queue_state = [&](Queue queue, VkQueue handle, uint32_t family) {
+        auto& slot = _impl->queues[static_cast<size_t>(queue)];
+        if (queue != Queue::Main && handle == main_queue) {
+            slot = &_impl->queue(Queue::Main);
+            return;
+        }
+        auto state = std::make_unique<Impl::QueueState>();
+        state->queue = queue;
+        state->handle = handle;
+        state->family = family;
+        state->command_pools = std::make_unique<CommandPoolRegistry>(*this, family, 0);
+        CHECK_VK(vkCreateSemaphore(device, tmpPtr<VkSemaphoreCreateInfo>({
+            .sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO,
+            .pNext = tmpPtr<VkSemaphoreTypeCreateInfo>({
+                .sType = VK_STRUCTURE_TYPE_SEMAPHORE_TYPE_CREATE_INFO,
+                .semaphoreType = VK_SEMAPHORE_TYPE_TIMELINE,
+                .initialValue = 0,
+            }),
+        }), nullptr, &state->timeline), throw std::runtime_error("failed to create timeline semaphore"));
+        slot = state.get();
+        _impl->queue_states.push_back(std::move(state));
+    };
+    add_queue_state(Queue::Main, main_queue, main_queue_idx);
+    add_queue_state(Queue::Transfer, transfer_queue, transfer_queue_idx);
+    add_queue_state(Queue::Compute, compute_queue, compute_queue_idx);
 
     CHECK_VK(vmaCreateAllocator(tmpPtr<VmaAllocatorCreateInfo>({
         .flags = VMA_ALLOCATOR_CREATE_BUFFER_DEVICE_ADDRESS_BIT,
@@ -75,13 +136,46 @@ Device::Device(imr::Context& context, vkb::PhysicalDevice physical_device) : con
         .device = device,
         .instance = context.instance,
     }), &_impl->allocator), throw std::runtime_error("failed to create VMA allocator"));
+
+    _impl->descriptors = std::make_unique<DescriptorCache>(*this);
+    _impl->load_pipeline_cache(*this);
+}
+
+void Device::forgetHandle(uint64_t handle) {
+    _impl->descriptors->evict_handle(handle);
+}
+
+bool Device::supports_push_descriptors() const {
+    return _impl->push_descriptors_supported;
+}
+
+bool Device::supports_present_wait() const {
+    return _impl->present_wait_supported;
 }
 
 Device::~Device() {
+    // Queued compiles still use the device
+    _impl->compile_workers.reset();
+    _impl->workers.reset();
+    flush();
     vkDeviceWaitIdle(device);
+    collect();
+
+    _impl->staging.reset();
+    _impl->readback.reset();
+    _impl->transient.reset();
+    _impl->descriptors.reset();
+    for (auto& state : _impl->queue_states) {
+        vkDestroySemaphore(device, state->timeline, nullptr);
+        state->command_pools.reset();
+    }
+    for (auto semaphore : _impl->free_semaphores)
+        vkDestroySemaphore(device, semaphore, nullptr);
+
+    _impl->save_pipeline_cache(*this);
+    vkDestroyPipelineCache(device, _impl->pipeline_cache, nullptr);
 
     vmaDestroyAllocator(_impl->allocator);
-    vkDestroyCommandPool(device, pool, nullptr);
     vkb::destroy_device(device);
     _impl.reset();
 }
@@ -2,14 +2,21 @@
 
 namespace imr {
 
+/// Past this many recordings, the pending batch is submitted on its own
+static constexpr size_t MAX_BATCH_SIZE = 64;
+
 void Device::executeCommandsSync(std::function<void(VkCommandBuffer)> lambda) {
-    VkCommandBuffer cmdbuf;
-    vkAllocateCommandBuffers(device.device, tmpPtr<VkCommandBufferAllocateInfo>({
-        .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
-        .commandPool = pool,
-        .level = VK_COMMAND_BUFFER_LEVEL_PRIMARY,
-        .commandBufferCount = 1,
-    }), &cmdbuf);
+    executeCommandsAsync(std::move(lambda)).wait();
+}
+
+Device::Token Device::executeCommandsAsync(std::function<void(VkCommandBuffer)> lambda, std::vector<Token> wait_for, Queue queue) {
+    collect();
+
+    auto& state = _impl->queue(queue);
+
+    // Recording doesn't need the lock, every thread has its own pool.
+    // The lambda may call back into executeCommandsAsync and flush or replace the pending batch, so nothing about it is looked at before it returns.
+    auto [cmdbuf_pool, cmdbuf] = state.command_pools->allocate();
     vkBeginCommandBuffer(cmdbuf, tmpPtr<VkCommandBufferBeginInfo>({
         .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
         .flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT,
@@ -17,29 +24,184 @@ void Device::executeCommandsSync(std::function<void(VkCommandBuffer)> lambda) {
 
     lambda(cmdbuf);
 
-    VkFence fence;
-    vkCreateFence(device.device, tmpPtr<VkFenceCreateInfo>({
-        .sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO,
-        .flags = 0,
-    }), nullptr, &fence);
-
     vkEndCommandBuffer(cmdbuf);
-    vkQueueSubmit(main_queue, 1, tmpPtr<VkSubmitInfo>({
-        .sType = VK_STRUCTURE_TYPE_SUBMIT_INFO,
-        .waitSemaphoreCount = 0,
-        .pWaitSemaphores = nullptr,
-        .pWaitDstStageMask = tmpPtr((VkPipelineStageFlags) VK_PIPELINE_STAGE_2_TOP_OF_PIPE_BIT),
-        .commandBufferCount = 1,
-        .pCommandBuffers = &cmdbuf,
-        .signalSemaphoreCount = 0,
-        .pSignalSemaphores = nullptr,
-    }), fence);
 
-    vkWaitForFences(device, 1, &fence, true, UINT64_MAX);
+    std::lock_guard guard(_impl->submission_mutex);
+    std::array<uint64_t, QUEUES_COUNT> wait_values = {};
+    for (auto& token : wait_for) {
+        assert(token.device == this && "Tokens cannot be shared across devices");
+        auto& token_state = _impl->queue(token.queue);
+        // Work from the same batch is not ordered against us, and other queues can only wait on what was submitted: get it on the GPU first
+        if (token_state.pending && token.value == token_state.pending->value)
+            _impl->flush(*this, token_state);
+        auto& wait_value = wait_values[static_cast<size_t>(token_state.queue)];
+        wait_value = std::max(wait_value, token.value);
+    }
+
+    // Flushing for the waits above might have submitted the pending batch too
+    if (!state.pending)
+        state.pending = Impl::Batch { .value = state.last_submitted + 1 };
+    for (size_t i = 0; i < QUEUES_COUNT; i++)
+        state.pending->wait_values[i] = std::max(state.pending->wait_values[i], wait_values[i]);
+    state.pending->cmdbufs.emplace_back(cmdbuf_pool, cmdbuf);
+
+    Token token = { this, state.pending->value, state.queue };
+    if (state.pending->cmdbufs.size() >= MAX_BATCH_SIZE)
+        _impl->flush(*this, state);
+    return token;
+}
 
-    vkDestroyFence(device.device, fence, nullptr);
-    vkFreeCommandBuffers(device.device, pool, 1, &cmdbuf);
+void Device::flush() {
+    std::lock_guard guard(_impl->submission_mutex);
+    for (auto& state : _impl->queue_states)
+        _impl->flush(*this, *state);
 }
 
+void Device::Impl::flush(Device& device, QueueState& state) {
+    std::lock_guard guard(submission_mutex);
+    if (!state.pending)
+        return;
+    auto batch = std::move(*state.pending);
+    state.pending.reset();
 
-}
\ No newline at end of file
+    std::vector<VkCommandBufferSubmitInfo> cmdbuf_infos;
+    for (auto [pool, cmdbuf] : batch.cmdbufs) {
+        cmdbuf_infos.push_back({
+            .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_SUBMIT_INFO,
+            .commandBuffer = cmdbuf,
+        });
+    }
+
+    // Only the biggest value matters on each timeline
+    std::vector<VkSemaphoreSubmitInfo> waits;
+    for (auto& other : queue_states) {
+        uint64_t wait_value = batch.wait_values[static_cast<size_t>(other->queue)];
+        if (wait_value > 0) {
+            waits.push_back({
+                .sType = VK_STRUCTURE_TYPE_SEMAPHORE_SUBMIT_INFO,
+                .semaphore = other->timeline,
+                .value = wait_value,
+                .stageMask = VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT,
+            });
+        }
+    }
+
+    std::lock_guard handle_guard(state.handle_mutex);
+    CHECK_VK_THROW(device.dispatch.queueSubmit2KHR(state.handle, 1, tmpPtr<VkSubmitInfo2>({
+        .sType = VK_STRUCTURE_TYPE_SUBMIT_INFO_2,
+        .waitSemaphoreInfoCount = static_cast<uint32_t>(waits.size()),
+        .pWaitSemaphoreInfos = waits.data(),
+        .commandBufferInfoCount = static_cast<uint32_t>(cmdbuf_infos.size()),
+        .pCommandBufferInfos = cmdbuf_infos.data(),
+        .signalSemaphoreInfoCount = 1,
+        .pSignalSemaphoreInfos = tmpPtr<VkSemaphoreSubmitInfo>({
+            .sType = VK_STRUCTURE_TYPE_SEMAPHORE_SUBMIT_INFO,
+            .semaphore = state.timeline,
+            .value = batch.value,
+            .stageMask = VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT,
+        }),
+    }), VK_NULL_HANDLE));
+
+    state.last_submitted = batch.value;
+    state.last_batch_submitted = batch.value;
+    state.in_flight.push_back(std::move(batch));
+}
+
+uint64_t Device::Impl::completed_value(Device& device, QueueState& state) {
+    uint64_t value;
+    CHECK_VK_THROW(vkGetSemaphoreCounterValue(device.device, state.timeline, &value));
+    return value;
+}
+
+uint64_t Device::Impl::reserve_submission(Device& device) {
+    std::lock_guard guard(submission_mutex);
+    device.flush();
+    return ++queue(Device::Queue::Main).last_submitted;
+}
+
+VkSemaphore Device::Impl::get_binary_semaphore(Device& device) {
+    std::lock_guard guard(submission_mutex);
+    if (!free_semaphores.empty()) {
+        VkSemaphore semaphore = free_semaphores.back();
+        free_semaphores.pop_back();
+        return semaphore;
+    }
+    VkSemaphore semaphore;
+    CHECK_VK_THROW(vkCreateSemaphore(device.device, tmpPtr<VkSemaphoreCreateInfo>({
+        .sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO,
+    }), nullptr, &semaphore));
+    return semaphore;
+}
+
+void Device::Impl::recycle_binary_semaphore(VkSemaphore semaphore) {
+    std::lock_guard guard(submission_mutex);
+    free_semaphores.push_back(semaphore);
+}
+
+void Device::collect() {
+    std::array<uint64_t, QUEUES_COUNT> completed;
+    for (auto& state : _impl->queue_states)
+        completed[static_cast<size_t>(state->queue)] = _impl->completed_value(*this, *state);
+    auto is_done = [&](const Token& token) {
+        return token.value <= completed[static_cast<size_t>(_impl->queue(token.queue).queue)];
+    };
+
+    std::unique_lock lock(_impl->submission_mutex);
+    for (auto& state : _impl->queue_states) {
+        while (!state->in_flight.empty() && state->in_flight.front().value <= completed[static_cast<size_t>(state->queue)]) {
+            auto& batch = state->in_flight.front();
+            for (auto [pool, cmdbuf] : batch.cmdbufs)
+                CommandPoolRegistry::release(pool, cmdbuf);
+            state->in_flight.pop_front();
+        }
+    }
+
+    // Continuations might enqueue more of them, so we take them out of the list before running them
+    std::vector<std::function<void(void)>> ready;
+    auto& continuations = _impl->continuations;
+    for (auto i = continuations.begin(); i != continuations.end();) {
+        auto& [token, fn] = *i;
+        if (is_done(token)) {
+            ready.push_back(std::move(fn));
+            i = continuations.erase(i);
+        } else {
+            i++;
+        }
+    }
+    lock.unlock();
+    for (auto& fn : ready)
+        fn();
+}
+
+bool Device::Token::done() const {
+    auto& state = device->_impl->queue(queue);
+    {
+        std::lock_guard guard(device->_impl->submission_mutex);
+        if (value > state.last_submitted)
+            return false;
+    }
+    return device->_impl->completed_value(*device, state) >= value;
+}
+
+void Device::Token::wait() const {
+    auto& state = device->_impl->queue(queue);
+    {
+        std::lock_guard guard(device->_impl->submission_mutex);
+        if (value > state.last_submitted)
+            device->_impl->flush(*device, state);
+    }
+    CHECK_VK_THROW(vkWaitSemaphores(device->device, tmpPtr<VkSemaphoreWaitInfo>({
+        .sType = VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO,
+        .semaphoreCount = 1,
+        .pSemaphores = &state.timeline,
+        .pValues = &value,
+    }), UINT64_MAX));
+    device->collect();
+}
+
+void Device::Token::then(std::function<void(void)>&& fn) const {
+    std::lock_guard guard(device->_impl->submission_mutex);
+    device->_impl->continuations.emplace_back(*this, std::move(fn));
+}
+
+}
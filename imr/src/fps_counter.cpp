@@ -1,6 +1,9 @@
 #include "imr_private.h"
 #include "imr/util.h"
 
+#include <algorithm>
+#include <array>
+#include <atomic>
 #include <iostream>
 
 namespace imr {
@@ -9,8 +12,21 @@ struct FpsCounter::Impl {
     uint64_t last_epoch = imr_get_time_nano();
     int frames_since_last_epoch = 0;
 
-    int fps;
-    float avg_frametime;
+    int fps = 0;
+    float avg_frametime = 0;
+
+    /// Only touched by tick()
+    uint64_t last_tick = 0;
+    /// Frame durations in nanoseconds, frame i goes in ring[i % HISTORY]. Single producer: the writes are published by incrementing ticks.
+    std::array<std::atomic<uint64_t>, HISTORY> ring {};
+    std::atomic<uint64_t> ticks = 0;
+
+    /// The window title is refreshed every frame, only redo the sorting when the epoch changes
+    uint64_t title_epoch = 0;
+    float title_p99 = 0;
+
+    /// Oldest first
+    std::vector<uint64_t> snapshot() const;
 };
 
 FpsCounter::FpsCounter() {
@@ -33,6 +49,30 @@ void FpsCounter::tick() {
         //std::cout << average_fps() << ", " << average_frametime() * 1000.0f << "\n";
     }
     _impl->frames_since_last_epoch++;
+
+    // The first tick only marks the start of the first frame
+    if (_impl->last_tick != 0) {
+        uint64_t ticks = _impl->ticks.load(std::memory_order_relaxed);
+        _impl->ring[ticks % HISTORY].store(now - _impl->last_tick, std::memory_order_relaxed);
+        _impl->ticks.store(ticks + 1, std::memory_order_release);
+    }
+    _impl->last_tick = now;
+}
+
+std::vector<uint64_t> FpsCounter::Impl::snapshot() const {
+    uint64_t end = ticks.load(std::memory_order_acquire);
+    // With a full ring, the oldest slot is also the one the next tick() writes to, before it publishes it: it can't be trusted
+    uint64_t begin = end >= HISTORY ? end - HISTORY + 1 : 0;
+    std::vector<uint64_t> frames;
+    frames.reserve(end - begin);
+    for (uint64_t i = begin; i < end; i++)
+        frames.push_back(ring[i % HISTORY].load(std::memory_order_relaxed));
+
+    // Whatever tick() wrote in the meantime overwrote our oldest entries
+    std::atomic_thread_fence(std::memory_order_acquire);
+    uint64_t overwritten = ticks.load(std::memory_order_relaxed) - end;
+    frames.erase(frames.begin(), frames.begin() + std::min<uint64_t>(overwritten, frames.size()));
+    return frames;
 }
 
 int FpsCounter::average_fps() {
@@ -43,12 +83,103 @@ float FpsCounter::average_frametime() {
     return _impl->avg_frametime;
 }
 
-void FpsCounter::updateGlfwWindowTitle(GLFWwindow* window) {
+static FpsCounter::Stats frame_stats(std::vector<uint64_t> frames) {
+    if (frames.empty())
+        return {};
+    std::sort(frames.begin(), frames.end());
+
+    auto percentile = [&](double p) {
+        return frames[std::min(frames.size() - 1, size_t(p * frames.size()))] / 1e6f;
+    };
+    uint64_t total = 0;
+    for (auto frame : frames)
+        total += frame;
+    uint64_t median = frames[frames.size() / 2];
+    // Sorted, so the stutters are all at the end
+    size_t stutters = frames.end() - std::upper_bound(frames.begin(), frames.end(), median * 2);
+
+    return {
+        .frames = frames.size(),
+        .average = float(total / 1e6 / frames.size()),
+        .p50 = percentile(0.50),
+        .p95 = percentile(0.95),
+        .p99 = percentile(0.99),
+        .max = frames.back() / 1e6f,
+        .stutters = stutters,
+    };
+}
+
+static std::vector<size_t> frame_histogram(const std::vector<uint64_t>& frames, float bucket_ms, size_t buckets) {
+    std::vector<size_t> histogram(std::max<size_t>(buckets, 1));
+    for (auto frame : frames)
+        histogram[std::min(histogram.size() - 1, size_t(frame / 1e6 / bucket_ms))]++;
+    return histogram;
+}
+
+FpsCounter::Stats FpsCounter::stats() const {
+    return frame_stats(_impl->snapshot());
+}
+
+std::vector<size_t> FpsCounter::histogram(float bucket_ms, size_t buckets) const {
+    return frame_histogram(_impl->snapshot(), bucket_ms, buckets);
+}
+
+bool FpsCounter::export_csv(const std::string& filename) const {
+    std::string csv = "frame,frametime_ms\n";
+    char buffer[64];
+    size_t i = 0;
+    for (auto frame : _impl->snapshot()) {
+        snprintf(buffer, sizeof(buffer), "%zu,%f\n", i++, frame / 1e6);
+        csv.append(buffer);
+    }
+    return imr_write_file(filename.c_str(), csv.size(), csv.data());
+}
+
+bool FpsCounter::export_json(const std::string& filename) const {
+    // One snapshot for everything, so the stats, histogram and frame times agree with each other
+    auto frames = _impl->snapshot();
+    auto s = frame_stats(frames);
+    char buffer[256];
+
+    std::string json = "{\n";
+    snprintf(buffer, sizeof(buffer), "  \"stats\": { \"frames\": %zu, \"average_ms\": %f, \"p50_ms\": %f, \"p95_ms\": %f, \"p99_ms\": %f, \"max_ms\": %f, \"stutters\": %zu },\n",
+             s.frames, s.average, s.p50, s.p95, s.p99, s.max, s.stutters);
+    json.append(buffer);
+
+    json.append("  \"histogram_1ms\": [");
+    auto buckets = frame_histogram(frames, 1.0f, 34);
+    for (size_t i = 0; i < buckets.size(); i++) {
+        snprintf(buffer, sizeof(buffer), "%s%zu", i > 0 ? ", " : "", buckets[i]);
+        json.append(buffer);
+    }
+    json.append("],\n");
+
+    json.append("  \"frametimes_ms\": [");
+    for (size_t i = 0; i < frames.size(); i++) {
+        snprintf(buffer, sizeof(buffer), "%s%f", i > 0 ? ", " : "", frames[i] / 1e6);
+        json.append(buffer);
+    }
+    json.append("]\n}\n");
+    return imr_write_file(filename.c_str(), json.size(), json.data());
+}
+
+void FpsCounter::updateGlfwWindowTitle(GLFWwindow* window, GpuProfiler* profiler) {
+    if (_impl->title_epoch != _impl->last_epoch) {
+        _impl->title_epoch = _impl->last_epoch;
+        _impl->title_p99 = stats().p99;
+    }
+
     std::string str = "Fps: ";
     str.append(std::to_string(average_fps()));
     str.append(", Avg frametime: ");
     str.append(std::to_string(average_frametime() * 1000.0f));
+    str.append("ms, p99: ");
+    str.append(std::to_string(_impl->title_p99));
     str.append("ms");
+    if (profiler) {
+        str.append(", GPU: ");
+        str.append(profiler->summary());
+    }
     glfwSetWindowTitle(window, str.c_str());
 }
 
@@ -1,8 +1,8 @@
 #include "swapchain_private.h"
 #include "imr/util.h"
+#include "thread_pool.h"
 
-#include <chrono>
-#include <thread>
+#include <algorithm>
 
 namespace imr {
 
@@ -14,23 +14,73 @@ void Swapchain::Frame::addCleanupAction(std::function<void(void)>&& fn) {
     _impl->cleanup_queue.push_back(std::move(fn));
 }
 
+void Swapchain::Frame::markUsed(Buffer& buffer) {
+    if (std::find(_impl->used_buffers.begin(), _impl->used_buffers.end(), &buffer) == _impl->used_buffers.end())
+        _impl->used_buffers.push_back(&buffer);
+}
+
+VkCommandBuffer Swapchain::Frame::allocateCommandBuffer(VkCommandBufferLevel level) {
+    auto [pool, cmdbuf] = _impl->context.command_pools->allocate(level);
+    return cmdbuf;
+}
+
+void Swapchain::Frame::recordParallel(VkCommandBuffer primary, size_t count, std::function<void(size_t, VkCommandBuffer)> fn) {
+    auto& workers = _impl->device._impl->worker_pool();
+
+    std::vector<std::future<VkCommandBuffer>> recorded;
+    for (size_t i = 0; i < count; i++) {
+        recorded.push_back(workers.submit([this, &fn, i]() {
+            VkCommandBuffer cmdbuf = allocateCommandBuffer(VK_COMMAND_BUFFER_LEVEL_SECONDARY);
+            CHECK_VK_THROW(vkBeginCommandBuffer(cmdbuf, tmpPtr<VkCommandBufferBeginInfo>({
+                .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
+                .flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT,
+                .pInheritanceInfo = tmpPtr<VkCommandBufferInheritanceInfo>({
+                    .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_INHERITANCE_INFO,
+                }),
+            })));
+            fn(i, cmdbuf);
+            CHECK_VK_THROW(vkEndCommandBuffer(cmdbuf));
+            return cmdbuf;
+        }));
+    }
+
+    // Wait for all of them before rethrowing anything, fn is still referenced by the pending ones
+    std::vector<VkCommandBuffer> cmdbufs;
+    std::exception_ptr error;
+    for (auto& future : recorded) {
+        try {
+            cmdbufs.push_back(future.get());
+        } catch (...) {
+            error = std::current_exception();
+        }
+    }
+    if (error)
+        std::rethrow_exception(error);
+
+    vkCmdExecuteCommands(primary, static_cast<uint32_t>(cmdbufs.size()), cmdbufs.data());
+}
+
 Swapchain::Frame::Frame(Impl&& impl) {
     _impl = std::make_unique<Frame::Impl>(std::move(impl));
 }
 
-Swapchain::Frame::Impl::Impl(Device& device, SwapchainSlot& slot) : device(device), slot(slot) {
-    auto vkb_swapchain = slot.swapchain._impl->swapchain;
-    VkExtent3D size = { vkb_swapchain.extent.width, vkb_swapchain.extent.height, 1 };
-    auto i = make_image_from(device, slot.image, VK_IMAGE_TYPE_2D, size, vkb_swapchain.image_format);
-    image = std::make_unique<Image>(std::move(i));
+Swapchain::Frame::Impl::Impl(Device& device, SwapchainSlot& slot, FrameContext& context) : device(device), slot(slot), context(context) {}
+
+void Swapchain::Frame::Impl::set_timeline_value(uint64_t value) {
+    timeline_value = value;
+    for (auto buffer : used_buffers)
+        buffer->markUsed({ &device, value, Device::Queue::Main });
+    used_buffers.clear();
 }
 
-Image& Swapchain::Frame::image() const { return *_impl->image; }
+Image& Swapchain::Frame::image() const { return *_impl->slot.wrapped_image; }
 
 Swapchain::Frame::~Frame() {
     //printf("Recycling frame %d in slot %d\n", id, _impl->slot.image_index);
-    // Before we can cleanup the resources we need to wait on the relevant fences
-    // for now let's just wait on ALL of them at once
+    // Before we can cleanup the resources we need to wait for the frame to be done on the GPU
+    if (_impl->timeline_value > 0)
+        Device::Token { &_impl->device, _impl->timeline_value }.wait();
+    // ... as well as on any fence the user gave us
     if (!_impl->cleanup_fences.empty()) {
         for (auto fence : _impl->cleanup_fences) {
             //printf("Waited on fence = %llx\n", fence);
@@ -45,6 +95,12 @@ Swapchain::Frame::~Frame() {
         fn();
     }
     _impl->cleanup_queue.clear();
+    // The blocks the graphs of this frame used were just released, whatever went unused for long enough can go
+    if (auto& heaps = _impl->device._impl->transient)
+        heaps->trim();
+
+    // Resets every command buffer of this frame at once, this is much cheaper than doing it one by one
+    _impl->context.command_pools->reset_all();
 }
 
 void Swapchain::Frame::queuePresent() {
@@ -54,33 +110,39 @@ void Swapchain::Frame::queuePresent() {
     assert(!_impl->submitted && "Cannot submit a frame twice!");
     _impl->submitted = true;
 
-    uint64_t now = imr_get_time_nano();
-    uint64_t delta = now - swapchain._impl->last_present;
-    int64_t delta_us = (int64_t)(delta / 1000);
+    uint64_t present_id = swapchain._impl->pacer.frame_recorded(*swapchain._impl, *this);
 
-    int64_t min_delta = int64_t(1000000.0 / swapchain.maxFps);
-    //printf("delta: %zu us, min_delta = %zu \n", delta_us, min_delta);
-    int64_t sleep_time = min_delta - delta_us;
-    if (sleep_time > 0) {
-        //printf("we're too fast. throttling by: %zu us\n", sleep_time);
-        std::this_thread::sleep_for(std::chrono::microseconds(sleep_time));
+    // Nothing to present to, and nothing to wait for either: we go as fast as the GPU does
+    if (swapchain._impl->offscreen()) {
+        if (_impl->timeline_value > 0)
+            slot.last_use = Device::Token { &device, _impl->timeline_value };
+        swapchain._impl->read_back(*this);
+        return;
     }
 
-    swapchain._impl->last_present = now;
-
     //printf("Presenting in slot: %d\n", slot.image_index);
 
     std::vector<VkSemaphore> semaphores;
     semaphores.push_back(slot.present_semaphore);
 
+    // The queue is shared with executeCommandsAsync, which might be submitting from another thread.
+    // Only the queue itself is locked: presenting can block, and the submission bookkeeping doesn't need to wait for it.
+    std::unique_lock lock(device._impl->queue(Device::Queue::Main).handle_mutex);
     VkResult present_result = vkQueuePresentKHR(device.main_queue, tmpPtr<VkPresentInfoKHR>({
         .sType = VK_STRUCTURE_TYPE_PRESENT_INFO_KHR,
+        // Lets the pacer wait for this present to be on screen
+        .pNext = present_id > 0 ? tmpPtr<VkPresentIdKHR>({
+            .sType = VK_STRUCTURE_TYPE_PRESENT_ID_KHR,
+            .swapchainCount = 1,
+            .pPresentIds = &present_id,
+        }) : nullptr,
         .waitSemaphoreCount = static_cast<uint32_t>(semaphores.size()),
         .pWaitSemaphores = semaphores.data(),
         .swapchainCount = 1,
         .pSwapchains = &swapchain._impl->swapchain.swapchain,
         .pImageIndices = &slot.image_index,
     }));
+    lock.unlock();
     //printf("Queued presentation, will signal %llx\n", (uint64_t) slot.wait_for_previous_present);
     switch (present_result) {
         case VK_SUCCESS:
@@ -95,10 +157,19 @@ void Swapchain::Frame::queuePresent() {
 
 void Swapchain::beginFrame(std::function<void(Swapchain::Frame&)>&& fn) {
     auto& device = _impl->device;
+    // Let's recycle the resources that the last frame using this context left behind:
+    // its destructor waits for that frame to be done on the device timeline.
+    auto& context = *_impl->frame_contexts[_impl->frame_counter % _impl->frame_contexts.size()];
+    context.frame.reset();
+    _impl->pacer.frame_done(device, context);
+    // Not in the loop below: once we waited for our turn, we don't want to wait again when the swapchain gets rebuilt
+    _impl->pacer.wait_for_next_frame(*_impl);
+
     while (true) {
         if (_impl->should_resize) {
             _impl->should_resize = false;
-            glfwPollEvents();
+            if (_impl->window)
+                glfwPollEvents();
             drain();
             _impl->destroy_swapchain();
             _impl->build_swapchain();
@@ -109,18 +180,29 @@ void Swapchain::beginFrame(std::function<void(Swapchain::Frame&)>&& fn) {
             continue;
         }
         auto [slot, acquired] = *result;
-        slot.frame.reset();
-        slot.frame = std::make_unique<Frame>(std::move(Frame::Impl(device, slot)));
-        slot.frame->swapchain_image_available = acquired;
-        slot.frame->signal_when_ready = slot.present_semaphore;
-        slot.frame->id = _impl->frame_counter++;
-        assert(acquired);
-        slot.frame->addCleanupAction([=, &device]() {
-            vkDestroySemaphore(device.device, acquired, nullptr);
-        });
-
-        //printf("Preparing frame: %d\n", slot.frame->id);
-        fn(*slot.frame);
+        // Opportunistically recycle finished async work
+        device.collect();
+        context.frame = std::make_unique<Frame>(std::move(Frame::Impl(device, slot, context)));
+        auto& frame = *context.frame;
+        frame.swapchain_image_available = acquired;
+        frame.signal_when_ready = slot.present_semaphore;
+        frame.id = _impl->frame_counter++;
+        if (_impl->offscreen()) {
+            frame.signal_when_ready = VK_NULL_HANDLE;
+        } else {
+            assert(acquired);
+            auto& frame_impl = *frame._impl;
+            frame.addCleanupAction([=, &device, &frame_impl]() {
+                // Once the submission that waited on it is done, the semaphore is unsignaled and can be used again
+                if (frame_impl.timeline_value > 0)
+                    device._impl->recycle_binary_semaphore(acquired);
+                else
+                    vkDestroySemaphore(device.device, acquired, nullptr);
+            });
+        }
+
+        //printf("Preparing frame: %d\n", frame.id);
+        fn(frame);
         break;
     }
 }
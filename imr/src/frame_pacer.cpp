@@ -0,0 +1,144 @@
+#include "swapchain_private.h"
+#include "imr/util.h"
+
+#include <algorithm>
+#include <chrono>
+#include <thread>
+
+namespace imr {
+
+/// Weight of the newest sample in the moving averages, smooths out the odd hiccup but still follows scene changes within a few frames
+static uint64_t moving_average(uint64_t average, uint64_t sample) {
+    if (average == 0)
+        return sample;
+    return (average * 7 + sample) / 8;
+}
+
+/// Headroom left when starting a frame just in time, covers the scheduler and the variance of the estimates
+static constexpr uint64_t PACING_SLACK = 1000000;
+/// How long we wait on a present before giving up on it (e.g. the window got minimized)
+static constexpr uint64_t PRESENT_WAIT_TIMEOUT = 100000000;
+
+/// Part of a wait spent yielding instead of sleeping. That's a core kept busy for up to this long per frame, so it only covers the typical
+/// oversleep of a timer-driven sleep, the rare worse one just eats into PACING_SLACK.
+static constexpr uint64_t SPIN_MARGIN = 200000;
+
+static void sleep_until(uint64_t deadline) {
+    uint64_t now = imr_get_time_nano();
+    if (deadline > now + SPIN_MARGIN)
+        std::this_thread::sleep_for(std::chrono::nanoseconds(deadline - now - SPIN_MARGIN));
+    while (imr_get_time_nano() < deadline)
+        std::this_thread::yield();
+}
+
+static uint64_t monitor_refresh_interval(GLFWwindow* window) {
+    GLFWmonitor* monitor = glfwGetWindowMonitor(window);
+    if (!monitor)
+        monitor = glfwGetPrimaryMonitor();
+    const GLFWvidmode* mode = monitor ? glfwGetVideoMode(monitor) : nullptr;
+    if (!mode || mode->refreshRate <= 0)
+        return 0;
+    return 1000000000 / mode->refreshRate;
+}
+
+void FramePacer::wait_for_next_frame(Swapchain::Impl& swapchain) {
+    auto& device = swapchain.device;
+    auto& parent = swapchain.parent;
+
+    if (swapchain.offscreen()) {
+        frame_start = imr_get_time_nano();
+        return;
+    }
+
+    uint64_t min_interval = parent.maxFps > 0 ? 1000000000 / parent.maxFps : 0;
+    uint64_t start = next_start;
+
+    if (parent.pacing == Swapchain::Pacing::LowLatency) {
+        if (device._impl->present_wait_supported && present_id > 0) {
+            // The previous frame is on screen once this returns, nothing of ours is queued anymore
+            VkResult result = device.dispatch.waitForPresentKHR(swapchain.swapchain, present_id, PRESENT_WAIT_TIMEOUT);
+            if (result == VK_SUCCESS) {
+                uint64_t now = imr_get_time_nano();
+                if (last_present_done > 0)
+                    present_interval = moving_average(present_interval, now - last_present_done);
+                last_present_done = now;
+                // Aim for our frame to be done right before the next refresh. When we're GPU or CPU bound this is already in the past.
+                if (present_interval > cpu_time + gpu_time + PACING_SLACK)
+                    start = std::max(start, last_present_done + present_interval - cpu_time - gpu_time - PACING_SLACK);
+            }
+        } else {
+            // No way to tell when things hit the screen: don't get ahead of the GPU, and don't go faster than the monitor does
+            if (last_timeline_value > 0)
+                Device::Token { &device, last_timeline_value }.wait();
+            min_interval = std::max(min_interval, monitor_refresh_interval(swapchain.window));
+        }
+    }
+
+    sleep_until(start);
+    frame_start = imr_get_time_nano();
+    // Scheduled from the previous deadline rather than from now so the cap doesn't drift, but without catching up after a hiccup either
+    next_start = std::max(next_start + min_interval, frame_start);
+}
+
+uint64_t FramePacer::frame_recorded(Swapchain::Impl& swapchain, Swapchain::Frame& frame) {
+    cpu_time = moving_average(cpu_time, imr_get_time_nano() - frame_start);
+    if (frame._impl->timeline_value > 0)
+        last_timeline_value = frame._impl->timeline_value;
+    if (swapchain.offscreen() || !swapchain.device._impl->present_wait_supported)
+        return 0;
+    return ++present_id;
+}
+
+void FramePacer::frame_done(Device& device, FrameContext& context) {
+    if (!context.timestamps_written)
+        return;
+    context.timestamps_written = false;
+
+    uint64_t timestamps[2];
+    if (device.dispatch.getQueryPoolResults(context.timestamps, 0, 2, sizeof(timestamps), timestamps, sizeof(uint64_t), VK_QUERY_RESULT_64_BIT) != VK_SUCCESS)
+        return;
+    if (timestamps[1] < timestamps[0])
+        return;
+    gpu_time = moving_average(gpu_time, uint64_t(double(timestamps[1] - timestamps[0]) * timestamp_period(device)));
+}
+
+void FramePacer::reset_presents() {
+    present_id = 0;
+    last_present_done = 0;
+}
+
+double timestamp_period(Device& device) {
+    auto families = device.physical_device.get_queue_families();
+    if (families[device.main_queue_idx].timestampValidBits == 0)
+        return 0;
+    return device.physical_device.properties.limits.timestampPeriod;
+}
+
+VkQueryPool create_timestamp_pool(Device& device, uint32_t count) {
+    if (timestamp_period(device) == 0)
+        return VK_NULL_HANDLE;
+    VkQueryPool pool;
+    CHECK_VK_THROW(vkCreateQueryPool(device.device, tmpPtr<VkQueryPoolCreateInfo>({
+        .sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO,
+        .queryType = VK_QUERY_TYPE_TIMESTAMP,
+        .queryCount = count,
+    }), nullptr, &pool));
+    return pool;
+}
+
+void FrameContext::write_timestamp(VkCommandBuffer cmdbuf, VkPipelineStageFlags2 stage, uint32_t query) {
+    if (timestamps == VK_NULL_HANDLE)
+        return;
+    auto& vk = device.dispatch;
+    if (query == 0)
+        vk.cmdResetQueryPool(cmdbuf, timestamps, 0, 2);
+    vk.cmdWriteTimestamp2KHR(cmdbuf, stage, timestamps, query);
+    timestamps_written = true;
+}
+
+Swapchain::FrameTimings Swapchain::frameTimings() const {
+    auto& pacer = _impl->pacer;
+    return { pacer.cpu_time, pacer.gpu_time, pacer.present_interval };
+}
+
+}
@@ -0,0 +1,223 @@
+#include "swapchain_private.h"
+#include "imr/util.h"
+
+#include <algorithm>
+#include <map>
+#include <mutex>
+
+namespace imr {
+
+/// Returned by begin() when the scope isn't measured
+static constexpr uint32_t NO_SCOPE = UINT32_MAX;
+
+struct GpuProfiler::Impl {
+    Device& device;
+    uint32_t max_scopes;
+    size_t history;
+    /// Nanoseconds per timestamp tick, 0 if the main queue can't write timestamps
+    double period = 0;
+
+    /// Shared with the cleanup actions of the frames, which can run after the profiler is gone: impl is cleared by then
+    struct Shared {
+        std::mutex mutex;
+        Impl* impl;
+    };
+    std::shared_ptr<Shared> shared;
+    std::vector<VkQueryPool> pools;
+    /// Already reset, on the host: the pool of a frame is never reset from its command buffers, whichever gets executed first
+    std::vector<VkQueryPool> free_pools;
+
+    /// Scopes of the frames being recorded, or waiting for the GPU
+    struct FrameScopes {
+        VkQueryPool pool;
+        std::vector<std::string> labels;
+    };
+    std::unordered_map<Swapchain::Frame*, FrameScopes> frames;
+
+    /// Ring of the last `history` durations, in nanoseconds
+    struct Samples {
+        std::vector<uint64_t> ring;
+        size_t next = 0;
+        uint64_t last = 0;
+    };
+    std::map<std::string, Samples> samples;
+
+    FrameScopes* frame_scopes(Swapchain::Frame&);
+    void resolve(FrameScopes&);
+};
+
+GpuProfiler::GpuProfiler(Device& device, uint32_t max_scopes_per_frame, size_t history) {
+    _impl = std::make_unique<Impl>(device, max_scopes_per_frame, std::max<size_t>(history, 1));
+    _impl->period = timestamp_period(device);
+    _impl->shared = std::make_shared<Impl::Shared>();
+    _impl->shared->impl = _impl.get();
+}
+
+GpuProfiler::~GpuProfiler() {
+    // The frames we still have scopes in may write to our pools until they are done on the GPU
+    std::vector<uint64_t> timeline_values;
+    {
+        std::lock_guard guard(_impl->shared->mutex);
+        for (auto& [frame, scopes] : _impl->frames) {
+            if (frame->_impl->timeline_value > 0)
+                timeline_values.push_back(frame->_impl->timeline_value);
+        }
+        _impl->shared->impl = nullptr;
+    }
+    for (auto value : timeline_values)
+        Device::Token { &_impl->device, value }.wait();
+
+    for (auto pool : _impl->pools)
+        vkDestroyQueryPool(_impl->device.device, pool, nullptr);
+}
+
+GpuProfiler::Impl::FrameScopes* GpuProfiler::Impl::frame_scopes(Swapchain::Frame& frame) {
+    if (period == 0)
+        return nullptr;
+    if (auto found = frames.find(&frame); found != frames.end())
+        return &found->second;
+
+    VkQueryPool pool;
+    if (!free_pools.empty()) {
+        pool = free_pools.back();
+        free_pools.pop_back();
+    } else {
+        pool = create_timestamp_pool(device, max_scopes * 2);
+        device.dispatch.resetQueryPool(pool, 0, max_scopes * 2);
+        pools.push_back(pool);
+    }
+
+    // Only runs once the frame is done on the GPU, so the results are there and the pool can be reset for the next one
+    frame.addCleanupAction([shared = shared, &frame]() {
+        std::lock_guard guard(shared->mutex);
+        auto impl = shared->impl;
+        if (!impl)
+            return;
+        auto found = impl->frames.find(&frame);
+        impl->resolve(found->second);
+        impl->device.dispatch.resetQueryPool(found->second.pool, 0, impl->max_scopes * 2);
+        impl->free_pools.push_back(found->second.pool);
+        impl->frames.erase(found);
+    });
+    return &frames.emplace(&frame, FrameScopes { pool }).first->second;
+}
+
+void GpuProfiler::Impl::resolve(FrameScopes& scopes) {
+    uint32_t count = scopes.labels.size();
+    if (count == 0)
+        return;
+    // Value and availability of each query: a scope that was never ended (or never submitted) is just skipped
+    std::vector<uint64_t> results(count * 2 * 2);
+    VkResult result = device.dispatch.getQueryPoolResults(scopes.pool, 0, count * 2, results.size() * sizeof(uint64_t), results.data(), 2 * sizeof(uint64_t), VK_QUERY_RESULT_64_BIT | VK_QUERY_RESULT_WITH_AVAILABILITY_BIT);
+    if (result != VK_SUCCESS && result != VK_NOT_READY)
+        return;
+
+    for (uint32_t i = 0; i < count; i++) {
+        uint64_t* begin = &results[i * 4];
+        uint64_t* end = &results[i * 4 + 2];
+        if (!begin[1] || !end[1] || end[0] < begin[0])
+            continue;
+        uint64_t duration = uint64_t(double(end[0] - begin[0]) * period);
+
+        auto& label = samples[scopes.labels[i]];
+        if (label.ring.size() < history)
+            label.ring.push_back(duration);
+        else
+            label.ring[label.next] = duration;
+        label.next = (label.next + 1) % history;
+        label.last = duration;
+    }
+}
+
+uint32_t GpuProfiler::begin(Swapchain::Frame& frame, VkCommandBuffer cmdbuf, std::string label) {
+    std::lock_guard guard(_impl->shared->mutex);
+    auto scopes = _impl->frame_scopes(frame);
+    if (!scopes || scopes->labels.size() >= _impl->max_scopes)
+        return NO_SCOPE;
+    uint32_t scope = scopes->labels.size();
+    scopes->labels.push_back(std::move(label));
+    _impl->device.dispatch.cmdWriteTimestamp2KHR(cmdbuf, VK_PIPELINE_STAGE_2_TOP_OF_PIPE_BIT, scopes->pool, scope * 2);
+    return scope;
+}
+
+void GpuProfiler::end(Swapchain::Frame& frame, VkCommandBuffer cmdbuf, uint32_t scope) {
+    if (scope == NO_SCOPE)
+        return;
+    std::lock_guard guard(_impl->shared->mutex);
+    auto& scopes = _impl->frames.at(&frame);
+    _impl->device.dispatch.cmdWriteTimestamp2KHR(cmdbuf, VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT, scopes.pool, scope * 2 + 1);
+}
+
+void GpuProfiler::scope(Swapchain::Frame& frame, VkCommandBuffer cmdbuf, std::string label, std::function<void()> f) {
+    uint32_t scope = begin(frame, cmdbuf, std::move(label));
+    f();
+    end(frame, cmdbuf, scope);
+}
+
+std::vector<GpuProfiler::Stats> GpuProfiler::stats() const {
+    std::lock_guard guard(_impl->shared->mutex);
+    std::vector<Stats> stats;
+    for (auto& [label, samples] : _impl->samples) {
+        std::vector<uint64_t> sorted = samples.ring;
+        std::sort(sorted.begin(), sorted.end());
+        auto percentile = [&](double p) {
+            return sorted[std::min(sorted.size() - 1, size_t(p * sorted.size()))] / 1e6f;
+        };
+        uint64_t total = 0;
+        for (auto duration : sorted)
+            total += duration;
+        stats.push_back({
+            .label = label,
+            .samples = sorted.size(),
+            .last = samples.last / 1e6f,
+            .average = float(total / 1e6 / sorted.size()),
+            .p50 = percentile(0.50),
+            .p95 = percentile(0.95),
+            .p99 = percentile(0.99),
+            .max = sorted.back() / 1e6f,
+        });
+    }
+    return stats;
+}
+
+std::string GpuProfiler::summary() const {
+    std::string str;
+    char buffer[32];
+    for (auto& scope : stats()) {
+        if (!str.empty())
+            str.append(", ");
+        snprintf(buffer, sizeof(buffer), "%.3f", scope.average);
+        str.append(scope.label);
+        str.append(" ");
+        str.append(buffer);
+        str.append("ms");
+    }
+    return str;
+}
+
+/// Labels are free-form (pass names, ...), quoted as per RFC 4180 when they'd break the CSV
+static std::string csv_field(const std::string& str) {
+    if (str.find_first_of(",\"\r\n") == std::string::npos)
+        return str;
+    std::string quoted = "\"";
+    for (char c : str) {
+        if (c == '"')
+            quoted.push_back('"');
+        quoted.push_back(c);
+    }
+    quoted.push_back('"');
+    return quoted;
+}
+
+bool GpuProfiler::dump(const std::string& filename) const {
+    std::string csv = "label,samples,last_ms,average_ms,p50_ms,p95_ms,p99_ms,max_ms\n";
+    char buffer[256];
+    for (auto& scope : stats()) {
+        snprintf(buffer, sizeof(buffer), ",%zu,%f,%f,%f,%f,%f,%f\n", scope.samples, scope.last, scope.average, scope.p50, scope.p95, scope.p99, scope.max);
+        csv.append(csv_field(scope.label));
+        csv.append(buffer);
+    }
+    return imr_write_file(filename.c_str(), csv.size(), csv.data());
+}
+
+}
@@ -9,11 +9,11 @@ T* optional_to_ptr(std::optional<T>& o) {
     return nullptr;
 }
 
-GraphicsPipeline::GraphicsPipeline(imr::Device& d, std::vector<ShaderEntryPoint*>&& stages, RenderTargetsState rts, imr::GraphicsPipeline::StateBuilder state) {
-    _impl = std::make_unique<Impl>(d, std::move(stages), rts, state);
+GraphicsPipeline::GraphicsPipeline(imr::Device& d, std::vector<ShaderEntryPoint*>&& stages, RenderTargetsState rts, imr::GraphicsPipeline::StateBuilder state, bool push_descriptors) {
+    _impl = std::make_unique<Impl>(d, std::move(stages), rts, state, push_descriptors);
 }
 
-GraphicsPipeline::Impl::Impl(Device& device, std::vector<ShaderEntryPoint*>&& stages, RenderTargetsState render_targets, StateBuilder state) : device_(device) {
+GraphicsPipeline::Impl::Impl(Device& device, std::vector<ShaderEntryPoint*>&& stages, RenderTargetsState render_targets, StateBuilder state, bool push_descriptors) : device_(device) {
     std::vector<VkPipelineShaderStageCreateInfo> vk_stages;
     VkShaderStageFlags conflicts = 0;
     std::optional<ReflectedLayout> merged_layout;
@@ -33,7 +33,7 @@ GraphicsPipeline::Impl::Impl(Device& device, std::vector<ShaderEntryPoint*>&& st
             merged_layout = ReflectedLayout(*merged_layout, *stage->_impl->reflected);
     }
 
-    layout = std::make_unique<PipelineLayout>(device, *merged_layout);
+    layout = std::make_unique<PipelineLayout>(device, *merged_layout, push_descriptors ? std::optional<unsigned>(0) : std::nullopt);
     final_layout = *merged_layout;
 
     std::vector<VkDynamicState> dynamic_states = {
@@ -94,7 +94,7 @@ GraphicsPipeline::Impl::Impl(Device& device, std::vector<ShaderEntryPoint*>&& st
 
     appendPNext((VkBaseOutStructure*) &pipeline_create_info, (VkBaseOutStructure*) &rendertargets_state);
 
-    CHECK_VK_THROW(vkCreateGraphicsPipelines(device_.device, VK_NULL_HANDLE, 1, &pipeline_create_info, VK_NULL_HANDLE, &pipeline));
+    CHECK_VK_THROW(vkCreateGraphicsPipelines(device_.device, device_._impl->pipeline_cache, 1, &pipeline_create_info, VK_NULL_HANDLE, &pipeline));
 }
 
 GraphicsPipeline::Impl::~Impl() {
@@ -1,83 +1,96 @@
 #include "imr_private.h"
 
-namespace imr {
-
-struct Image::Impl {
-    Device& device;
-    VkImage handle;
-    VkImageType type;
-    VkExtent3D size;
-    VkFormat format;
-    std::optional<VmaAllocation> vma_allocation;
-
-    VkImageView view;
+#include <algorithm>
 
-    Impl(Device& device, VkImageType type, VkExtent3D size, VkFormat format)
-    : device(device), handle(VK_NULL_HANDLE), type(type), size(size), format(format) {}
-    Impl(Device& device, VkImage existing_handle, VkImageType type, VkExtent3D size, VkFormat format)
-    : device(device), handle(existing_handle), type(type), size(size), format(format) {}
-};
+namespace imr {
 
 VkImage Image::handle() const { return _impl->handle; }
 VkImageType Image::type() const { return _impl->type; }
 VkExtent3D Image::size() const { return _impl->size; }
 VkFormat Image::format() const { return _impl->format; }
 
-VkImageViewType image_type_to_view_type(VkImageType type) {
-    switch (type) {
-        case VK_IMAGE_TYPE_1D: return VK_IMAGE_VIEW_TYPE_1D;
-        case VK_IMAGE_TYPE_2D: return VK_IMAGE_VIEW_TYPE_2D;
+uint32_t Image::mip_levels() const { return _impl->levels; }
+uint32_t Image::array_layers() const { return _impl->layers; }
+VkSampleCountFlagBits Image::samples() const { return _impl->samples; }
+
+VkExtent3D Image::size(uint32_t mip_level) const {
+    return {
+        std::max(1u, _impl->size.width >> mip_level),
+        std::max(1u, _impl->size.height >> mip_level),
+        std::max(1u, _impl->size.depth >> mip_level),
+    };
+}
+
+uint32_t Image::full_mip_chain(VkExtent3D size) {
+    uint32_t largest = std::max({ size.width, size.height, size.depth });
+    uint32_t levels = 1;
+    while (largest >>= 1)
+        levels++;
+    return levels;
+}
+
+/// Arrayed images get array views. Cube-compatible images only get cube views when asked for (they can't be rendered to) and the layer count allows it.
+static VkImageViewType view_type_for(const Image::Impl& impl, uint32_t layers, bool cube = false) {
+    switch (impl.type) {
+        case VK_IMAGE_TYPE_1D: return layers > 1 ? VK_IMAGE_VIEW_TYPE_1D_ARRAY : VK_IMAGE_VIEW_TYPE_1D;
+        case VK_IMAGE_TYPE_2D:
+            if (cube && (impl.flags & VK_IMAGE_CREATE_CUBE_COMPATIBLE_BIT) && layers % 6 == 0)
+                return layers == 6 ? VK_IMAGE_VIEW_TYPE_CUBE : VK_IMAGE_VIEW_TYPE_CUBE_ARRAY;
+            return layers > 1 ? VK_IMAGE_VIEW_TYPE_2D_ARRAY : VK_IMAGE_VIEW_TYPE_2D;
         case VK_IMAGE_TYPE_3D: return VK_IMAGE_VIEW_TYPE_3D;
         default: throw std::runtime_error("Unknown image type");
     }
 }
 
-Image::Image(Device& device, VkImageType dim, VkExtent3D size, VkFormat format, VkImageUsageFlagBits usage) {
-    _impl = std::make_unique<Impl>(device, dim, size, format);
-    VkImageCreateInfo image_create_info = {
+static VkImageCreateInfo image_create_info(const Image::Impl& impl, VkImageUsageFlags usage) {
+    if (impl.levels > 1 && impl.samples != VK_SAMPLE_COUNT_1_BIT)
+        throw std::runtime_error("multisampled images can't have mip levels");
+    return {
         .sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO,
-        .imageType = dim,
-        .format = format,
-        .extent = size,
-        .mipLevels = 1,
-        .arrayLayers = 1,
-        .samples = VK_SAMPLE_COUNT_1_BIT,
+        .flags = impl.flags,
+        .imageType = impl.type,
+        .format = impl.format,
+        .extent = impl.size,
+        .mipLevels = impl.levels,
+        .arrayLayers = impl.layers,
+        .samples = impl.samples,
         .tiling = VK_IMAGE_TILING_OPTIMAL,
-        .usage = (VkImageUsageFlags) usage,
+        .usage = usage,
         .sharingMode = VK_SHARING_MODE_EXCLUSIVE,
         .initialLayout = VK_IMAGE_LAYOUT_UNDEFINED,
     };
+}
+
+Image::Image(Device& device, VkImageType dim, VkExtent3D size, VkFormat format, VkImageUsageFlagBits usage, uint32_t mip_levels, uint32_t array_layers, VkSampleCountFlagBits samples, VkImageCreateFlags flags) {
+    _impl = std::make_unique<Impl>(device, VK_NULL_HANDLE, dim, size, format, mip_levels, array_layers, samples, flags);
+    VkImageCreateInfo create_info = image_create_info(*_impl, usage);
     VmaAllocationCreateInfo alloc_info = {
         .flags = 0,
         // .usage = VMA_MEMORY_USAGE_AUTO,
     };
+    // Transient attachments never leave tile memory on tilers, where they don't need to be backed by actual memory
+    if (usage & VK_IMAGE_USAGE_TRANSIENT_ATTACHMENT_BIT) {
+        alloc_info.requiredFlags = VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT;
+        alloc_info.preferredFlags = VK_MEMORY_PROPERTY_LAZILY_ALLOCATED_BIT;
+    }
     VmaAllocation& vma_allocation = _impl->vma_allocation.emplace();
-    vmaCreateImage(device._impl->allocator, &image_create_info, &alloc_info, &_impl->handle, &vma_allocation, nullptr);
-
-    vkCreateImageView(device.device, tmpPtr<VkImageViewCreateInfo>({
-       .sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO,
-       .image = handle(),
-       .viewType = image_type_to_view_type(type()),
-       .format = format,
-       .subresourceRange = whole_image_subresource_range(),
-    }), nullptr, &_impl->view);
+    CHECK_VK_THROW(vmaCreateImage(device._impl->allocator, &create_info, &alloc_info, &_impl->handle, &vma_allocation, nullptr));
 }
 
-Image make_image_from(Device& device, VkImage existing_handle, VkImageType dim, VkExtent3D size, VkFormat format) {
-    return Image(Image::Impl(device, existing_handle, dim, size, format));
+std::unique_ptr<Image> create_unbound_image(Device& device, VkImageType dim, VkExtent3D size, VkFormat format, VkImageUsageFlags usage, uint32_t mip_levels, uint32_t array_layers, VkSampleCountFlagBits samples) {
+    auto impl = std::make_unique<Image::Impl>(device, VK_NULL_HANDLE, dim, size, format, mip_levels, array_layers, samples);
+    VkImageCreateInfo create_info = image_create_info(*impl, usage);
+    CHECK_VK_THROW(vkCreateImage(device.device, &create_info, nullptr, &impl->handle));
+    impl->owns_handle = true;
+    return std::make_unique<Image>(std::move(impl));
 }
 
-Image::Image(Impl&& impl) {
-    _impl = std::make_unique<Impl>(impl);
-    vkCreateImageView(_impl->device.device, tmpPtr<VkImageViewCreateInfo>({
-       .sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO,
-       .image = handle(),
-       .viewType = image_type_to_view_type(type()),
-       .format = format(),
-       .subresourceRange = whole_image_subresource_range(),
-    }), nullptr, &_impl->view);
+Image make_image_from(Device& device, VkImage existing_handle, VkImageType dim, VkExtent3D size, VkFormat format) {
+    return Image(std::make_unique<Image::Impl>(device, existing_handle, dim, size, format));
 }
 
+Image::Image(std::unique_ptr<Impl>&& impl) : _impl(std::move(impl)) {}
+
 Image::Image(Image&& other) : _impl(std::move(other._impl)) {}
 
 static VkImageAspectFlagBits aspects_from_format(VkFormat format) {
@@ -341,36 +354,259 @@ static VkImageAspectFlagBits aspects_from_format(VkFormat format) {
     throw std::runtime_error("TODO: unhandled format");
 }
 
+VkImageView Image::view(VkImageViewType view_type, VkImageSubresourceRange range) {
+    Impl::ViewKey key = { view_type, range.aspectMask, range.baseMipLevel, range.levelCount, range.baseArrayLayer, range.layerCount };
+    std::lock_guard guard(_impl->views_mutex);
+    if (auto found = _impl->views.find(key); found != _impl->views.end())
+        return found->second;
+
+    VkImageView view;
+    CHECK_VK_THROW(vkCreateImageView(_impl->device.device, tmpPtr<VkImageViewCreateInfo>({
+        .sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO,
+        .image = handle(),
+        .viewType = view_type,
+        .format = format(),
+        .subresourceRange = range,
+    }), nullptr, &view));
+    _impl->views.emplace(key, view);
+    return view;
+}
+
 VkImageView Image::whole_image_view() {
-    return _impl->view;
+    return view(view_type_for(*_impl, _impl->layers, true), whole_image_subresource_range());
+}
+
+VkImageView Image::mip_view(uint32_t mip_level) {
+    auto range = whole_image_subresource_range();
+    range.baseMipLevel = mip_level;
+    range.levelCount = 1;
+    return view(view_type_for(*_impl, _impl->layers), range);
+}
+
+VkImageView Image::layer_view(uint32_t mip_level, uint32_t array_layer) {
+    auto range = whole_image_subresource_range();
+    range.baseMipLevel = mip_level;
+    range.levelCount = 1;
+    range.baseArrayLayer = array_layer;
+    range.layerCount = 1;
+    return view(view_type_for(*_impl, 1), range);
 }
 
 VkImageSubresourceRange Image::whole_image_subresource_range() const {
     VkImageSubresourceRange range = {
         .aspectMask = static_cast<VkImageAspectFlags>(aspects_from_format(format())),
         .baseMipLevel = 0,
-        .levelCount = 1,
+        .levelCount = _impl->levels,
         .baseArrayLayer = 0,
-        .layerCount = 1,
+        .layerCount = _impl->layers,
     };
     return range;
 }
 
-VkImageSubresourceLayers Image::whole_image_subresource_layers() const {
+VkImageSubresourceLayers Image::whole_image_subresource_layers(uint32_t mip_level) const {
     VkImageSubresourceLayers range = {
         .aspectMask = static_cast<VkImageAspectFlags>(aspects_from_format(format())),
-        .mipLevel = 0,
+        .mipLevel = mip_level,
         .baseArrayLayer = 0,
-        .layerCount = 1,
+        .layerCount = _impl->layers,
     };
     return range;
 }
 
+AccessState AccessState::assume(VkImageLayout layout, VkPipelineStageFlags2 stage, VkAccessFlags2 access) {
+    AccessState state;
+    state.layout = layout;
+    if (access & WRITE_ACCESSES) {
+        state.write_stages = stage;
+        state.write_access = access & WRITE_ACCESSES;
+    } else {
+        state.read_stages = stage;
+    }
+    return state;
+}
+
+std::optional<Hazard> AccessState::access(bool is_image, VkPipelineStageFlags2 stage, VkAccessFlags2 access, VkImageLayout new_layout, bool write) {
+    bool layout_change = is_image && new_layout != layout;
+    if (write || layout_change) {
+        // Writes (and layout transitions, which are writes too) have to wait for everything that came before
+        Hazard hazard = { write_stages | read_stages, write_access, stage, access, layout, new_layout };
+        layout = new_layout;
+        visible_stages = VK_PIPELINE_STAGE_2_NONE;
+        visible_access = VK_ACCESS_2_NONE;
+        read_stages = VK_PIPELINE_STAGE_2_NONE;
+        if (write) {
+            write_stages = stage;
+            write_access = access & WRITE_ACCESSES;
+        } else {
+            // The transition is done and visible by the time this stage runs, other stages still have to wait for it
+            write_stages = stage;
+            write_access = VK_ACCESS_2_NONE;
+            visible_stages = stage;
+            visible_access = access;
+            read_stages = stage;
+        }
+        if (hazard.src_stage == VK_PIPELINE_STAGE_2_NONE && !layout_change)
+            return std::nullopt;
+        return hazard;
+    }
+
+    // Reads after reads are fine, they only need the last write to be visible to them
+    read_stages |= stage;
+    if (write_stages == VK_PIPELINE_STAGE_2_NONE)
+        return std::nullopt;
+    if ((stage & ~visible_stages) == 0 && (access & ~visible_access) == 0)
+        return std::nullopt;
+    visible_stages |= stage;
+    visible_access |= access;
+    return Hazard { write_stages, write_access, stage, access, layout, layout };
+}
+
+AccessState& Image::Impl::whole_image_state() {
+    for (auto& state : subresources) {
+        if (state != subresources[0])
+            throw std::runtime_error("the subresources of this image are in different states, transition() the whole image first");
+    }
+    return subresources[0];
+}
+
+VkImageLayout Image::layout(uint32_t mip_level, uint32_t array_layer) const {
+    return _impl->subresource(mip_level, array_layer).layout;
+}
+
+void Image::transition(VkCommandBuffer cmdbuf, VkImageLayout new_layout, VkPipelineStageFlags2 stage, VkAccessFlags2 access) {
+    transition(cmdbuf, whole_image_subresource_range(), new_layout, stage, access);
+}
+
+void Image::transition(VkCommandBuffer cmdbuf, VkImageSubresourceRange range, VkImageLayout new_layout, VkPipelineStageFlags2 stage, VkAccessFlags2 access) {
+    uint32_t level_count = range.levelCount == VK_REMAINING_MIP_LEVELS ? _impl->levels - range.baseMipLevel : range.levelCount;
+    uint32_t layer_count = range.layerCount == VK_REMAINING_ARRAY_LAYERS ? _impl->layers - range.baseArrayLayer : range.layerCount;
+    bool write = access & WRITE_ACCESSES;
+
+    std::vector<std::tuple<uint32_t, uint32_t, Hazard>> hazards;
+    for (uint32_t level = range.baseMipLevel; level < range.baseMipLevel + level_count; level++) {
+        for (uint32_t layer = range.baseArrayLayer; layer < range.baseArrayLayer + layer_count; layer++) {
+            if (auto hazard = _impl->subresource(level, layer).access(true, stage, access, new_layout, write))
+                hazards.emplace_back(level, layer, *hazard);
+        }
+    }
+    if (hazards.empty())
+        return;
+
+    std::vector<VkImageMemoryBarrier2> barriers;
+    auto add_barrier = [&](Hazard& hazard, VkImageSubresourceRange subresources) {
+        barriers.push_back({
+            .sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER_2,
+            .srcStageMask = hazard.src_stage,
+            .srcAccessMask = hazard.src_access,
+            .dstStageMask = hazard.dst_stage,
+            .dstAccessMask = hazard.dst_access,
+            .oldLayout = hazard.old_layout,
+            .newLayout = hazard.new_layout,
+            .image = handle(),
+            .subresourceRange = subresources,
+        });
+    };
+
+    // Usually all the subresources were in the same state, and one barrier covers them all
+    bool uniform = hazards.size() == level_count * layer_count;
+    for (auto& [level, layer, hazard] : hazards)
+        uniform &= hazard == std::get<2>(hazards[0]);
+    if (uniform) {
+        add_barrier(std::get<2>(hazards[0]), range);
+    } else {
+        for (auto& [level, layer, hazard] : hazards)
+            add_barrier(hazard, { range.aspectMask, level, 1, layer, 1 });
+    }
+
+    _impl->device.dispatch.cmdPipelineBarrier2KHR(cmdbuf, tmpPtr<VkDependencyInfo>({
+        .sType = VK_STRUCTURE_TYPE_DEPENDENCY_INFO,
+        .imageMemoryBarrierCount = static_cast<uint32_t>(barriers.size()),
+        .pImageMemoryBarriers = barriers.data(),
+    }));
+}
+
+void Image::assumeState(VkImageLayout layout, VkPipelineStageFlags2 stage, VkAccessFlags2 access) {
+    for (auto& state : _impl->subresources)
+        state = AccessState::assume(layout, stage, access);
+}
+
+void Image::generate_mips(VkCommandBuffer cmdbuf, VkImageLayout final_layout, VkPipelineStageFlags2 stage, VkAccessFlags2 access) {
+    VkFormatProperties properties;
+    vkGetPhysicalDeviceFormatProperties(_impl->device.physical_device, format(), &properties);
+    if (!(properties.optimalTilingFeatures & VK_FORMAT_FEATURE_BLIT_SRC_BIT) || !(properties.optimalTilingFeatures & VK_FORMAT_FEATURE_BLIT_DST_BIT))
+        throw std::runtime_error("can't generate mips for a format that doesn't support blits");
+    VkFilter filter = (properties.optimalTilingFeatures & VK_FORMAT_FEATURE_SAMPLED_IMAGE_FILTER_LINEAR_BIT) ? VK_FILTER_LINEAR : VK_FILTER_NEAREST;
+
+    auto aspects = whole_image_subresource_range().aspectMask;
+    auto corner = [](VkExtent3D extent) {
+        return VkOffset3D { static_cast<int32_t>(extent.width), static_cast<int32_t>(extent.height), static_cast<int32_t>(extent.depth) };
+    };
+    // Each level is downsampled from the previous one, which has to be done being written to first
+    for (uint32_t level = 1; level < _impl->levels; level++) {
+        transition(cmdbuf, { aspects, level - 1, 1, 0, _impl->layers }, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, VK_PIPELINE_STAGE_2_TRANSFER_BIT, VK_ACCESS_2_TRANSFER_READ_BIT);
+        transition(cmdbuf, { aspects, level, 1, 0, _impl->layers }, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, VK_PIPELINE_STAGE_2_TRANSFER_BIT, VK_ACCESS_2_TRANSFER_WRITE_BIT);
+        vkCmdBlitImage(cmdbuf, handle(), VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, handle(), VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, tmpPtr<VkImageBlit>({
+            .srcSubresource = whole_image_subresource_layers(level - 1),
+            .srcOffsets = { {}, corner(size(level - 1)) },
+            .dstSubresource = whole_image_subresource_layers(level),
+            .dstOffsets = { {}, corner(size(level)) },
+        }), filter);
+    }
+    transition(cmdbuf, final_layout, stage, access);
+}
+
+static void ownership_barrier(Device& device, VkCommandBuffer cmdbuf, VkImageMemoryBarrier2 barrier) {
+    device.dispatch.cmdPipelineBarrier2KHR(cmdbuf, tmpPtr<VkDependencyInfo>({
+        .sType = VK_STRUCTURE_TYPE_DEPENDENCY_INFO,
+        .imageMemoryBarrierCount = 1,
+        .pImageMemoryBarriers = &barrier,
+    }));
+}
+
+void Image::releaseOwnership(VkCommandBuffer cmdbuf, uint32_t src_family, uint32_t dst_family, VkImageLayout old_layout, VkImageLayout new_layout, VkPipelineStageFlags2 src_stage, VkAccessFlags2 src_access) {
+    // The destination half of the barrier is ignored on release
+    ownership_barrier(_impl->device, cmdbuf, {
+        .sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER_2,
+        .srcStageMask = src_stage,
+        .srcAccessMask = src_access,
+        .oldLayout = old_layout,
+        .newLayout = new_layout,
+        .srcQueueFamilyIndex = src_family,
+        .dstQueueFamilyIndex = dst_family,
+        .image = handle(),
+        .subresourceRange = whole_image_subresource_range(),
+    });
+    // Whatever happens on the other queue isn't tracked
+    assumeState(new_layout, src_stage, VK_ACCESS_2_NONE);
+}
+
+void Image::acquireOwnership(VkCommandBuffer cmdbuf, uint32_t src_family, uint32_t dst_family, VkImageLayout old_layout, VkImageLayout new_layout, VkPipelineStageFlags2 dst_stage, VkAccessFlags2 dst_access) {
+    // The source half of the barrier is ignored on acquire
+    ownership_barrier(_impl->device, cmdbuf, {
+        .sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER_2,
+        .dstStageMask = dst_stage,
+        .dstAccessMask = dst_access,
+        .oldLayout = old_layout,
+        .newLayout = new_layout,
+        .srcQueueFamilyIndex = src_family,
+        .dstQueueFamilyIndex = dst_family,
+        .image = handle(),
+        .subresourceRange = whole_image_subresource_range(),
+    });
+    assumeState(new_layout, dst_stage, VK_ACCESS_2_NONE);
+}
+
 Image::~Image() {
     if (_impl) {
+        // Nothing in the cache may refer to the views (or through them, the image) once we start destroying things
+        for (auto& [key, view] : _impl->views)
+            _impl->device._impl->descriptors->evict_handle(reinterpret_cast<uint64_t>(view));
+        for (auto& [key, view] : _impl->views)
+            vkDestroyImageView(_impl->device.device, view, nullptr);
         if (_impl->vma_allocation)
             vmaDestroyImage(_impl->device._impl->allocator, _impl->handle, _impl->vma_allocation.value());
-        vkDestroyImageView(_impl->device.device, _impl->view, nullptr);
+        else if (_impl->owns_handle)
+            vkDestroyImage(_impl->device.device, _impl->handle, nullptr);
     }
 }
 
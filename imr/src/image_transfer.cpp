@@ -0,0 +1,376 @@
+#include "imr_private.h"
+
+#include <numeric>
+
+namespace imr {
+
+/// Size of a texel block in bytes and its dimensions in texels, uncompressed formats have 1x1 blocks
+struct FormatBlock {
+    uint32_t bytes;
+    uint32_t width = 1;
+    uint32_t height = 1;
+};
+
+static FormatBlock format_block(VkFormat format) {
+    switch (format) {
+        case VK_FORMAT_R4G4_UNORM_PACK8:
+        case VK_FORMAT_R8_UNORM:
+        case VK_FORMAT_R8_SNORM:
+        case VK_FORMAT_R8_USCALED:
+        case VK_FORMAT_R8_SSCALED:
+        case VK_FORMAT_R8_UINT:
+        case VK_FORMAT_R8_SINT:
+        case VK_FORMAT_R8_SRGB:
+        case VK_FORMAT_S8_UINT:
+            return { 1 };
+        case VK_FORMAT_R4G4B4A4_UNORM_PACK16:
+        case VK_FORMAT_B4G4R4A4_UNORM_PACK16:
+        case VK_FORMAT_R5G6B5_UNORM_PACK16:
+        case VK_FORMAT_B5G6R5_UNORM_PACK16:
+        case VK_FORMAT_R5G5B5A1_UNORM_PACK16:
+        case VK_FORMAT_B5G5R5A1_UNORM_PACK16:
+        case VK_FORMAT_A1R5G5B5_UNORM_PACK16:
+        case VK_FORMAT_R8G8_UNORM:
+        case VK_FORMAT_R8G8_SNORM:
+        case VK_FORMAT_R8G8_USCALED:
+        case VK_FORMAT_R8G8_SSCALED:
+        case VK_FORMAT_R8G8_UINT:
+        case VK_FORMAT_R8G8_SINT:
+        case VK_FORMAT_R8G8_SRGB:
+        case VK_FORMAT_R16_UNORM:
+        case VK_FORMAT_R16_SNORM:
+        case VK_FORMAT_R16_USCALED:
+        case VK_FORMAT_R16_SSCALED:
+        case VK_FORMAT_R16_UINT:
+        case VK_FORMAT_R16_SINT:
+        case VK_FORMAT_R16_SFLOAT:
+        case VK_FORMAT_D16_UNORM:
+            return { 2 };
+        case VK_FORMAT_R8G8B8_UNORM:
+        case VK_FORMAT_R8G8B8_SNORM:
+        case VK_FORMAT_R8G8B8_USCALED:
+        case VK_FORMAT_R8G8B8_SSCALED:
+        case VK_FORMAT_R8G8B8_UINT:
+        case VK_FORMAT_R8G8B8_SINT:
+        case VK_FORMAT_R8G8B8_SRGB:
+        case VK_FORMAT_B8G8R8_UNORM:
+        case VK_FORMAT_B8G8R8_SNORM:
+        case VK_FORMAT_B8G8R8_USCALED:
+        case VK_FORMAT_B8G8R8_SSCALED:
+        case VK_FORMAT_B8G8R8_UINT:
+        case VK_FORMAT_B8G8R8_SINT:
+        case VK_FORMAT_B8G8R8_SRGB:
+            return { 3 };
+        case VK_FORMAT_R8G8B8A8_UNORM:
+        case VK_FORMAT_R8G8B8A8_SNORM:
+        case VK_FORMAT_R8G8B8A8_USCALED:
+        case VK_FORMAT_R8G8B8A8_SSCALED:
+        case VK_FORMAT_R8G8B8A8_UINT:
+        case VK_FORMAT_R8G8B8A8_SINT:
+        case VK_FORMAT_R8G8B8A8_SRGB:
+        case VK_FORMAT_B8G8R8A8_UNORM:
+        case VK_FORMAT_B8G8R8A8_SNORM:
+        case VK_FORMAT_B8G8R8A8_USCALED:
+        case VK_FORMAT_B8G8R8A8_SSCALED:
+        case VK_FORMAT_B8G8R8A8_UINT:
+        case VK_FORMAT_B8G8R8A8_SINT:
+        case VK_FORMAT_B8G8R8A8_SRGB:
+        case VK_FORMAT_A8B8G8R8_UNORM_PACK32:
+        case VK_FORMAT_A8B8G8R8_SNORM_PACK32:
+        case VK_FORMAT_A8B8G8R8_USCALED_PACK32:
+        case VK_FORMAT_A8B8G8R8_SSCALED_PACK32:
+        case VK_FORMAT_A8B8G8R8_UINT_PACK32:
+        case VK_FORMAT_A8B8G8R8_SINT_PACK32:
+        case VK_FORMAT_A8B8G8R8_SRGB_PACK32:
+        case VK_FORMAT_A2R10G10B10_UNORM_PACK32:
+        case VK_FORMAT_A2R10G10B10_SNORM_PACK32:
+        case VK_FORMAT_A2R10G10B10_USCALED_PACK32:
+        case VK_FORMAT_A2R10G10B10_SSCALED_PACK32:
+        case VK_FORMAT_A2R10G10B10_UINT_PACK32:
+        case VK_FORMAT_A2R10G10B10_SINT_PACK32:
+        case VK_FORMAT_A2B10G10R10_UNORM_PACK32:
+        case VK_FORMAT_A2B10G10R10_SNORM_PACK32:
+        case VK_FORMAT_A2B10G10R10_USCALED_PACK32:
+        case VK_FORMAT_A2B10G10R10_SSCALED_PACK32:
+        case VK_FORMAT_A2B10G10R10_UINT_PACK32:
+        case VK_FORMAT_A2B10G10R10_SINT_PACK32:
+        case VK_FORMAT_R16G16_UNORM:
+        case VK_FORMAT_R16G16_SNORM:
+        case VK_FORMAT_R16G16_USCALED:
+        case VK_FORMAT_R16G16_SSCALED:
+        case VK_FORMAT_R16G16_UINT:
+        case VK_FORMAT_R16G16_SINT:
+        case VK_FORMAT_R16G16_SFLOAT:
+        case VK_FORMAT_R32_UINT:
+        case VK_FORMAT_R32_SINT:
+        case VK_FORMAT_R32_SFLOAT:
+        case VK_FORMAT_B10G11R11_UFLOAT_PACK32:
+        case VK_FORMAT_E5B9G9R9_UFLOAT_PACK32:
+        case VK_FORMAT_X8_D24_UNORM_PACK32:
+        case VK_FORMAT_D32_SFLOAT:
+            return { 4 };
+        case VK_FORMAT_R16G16B16_UNORM:
+        case VK_FORMAT_R16G16B16_SNORM:
+        case VK_FORMAT_R16G16B16_USCALED:
+        case VK_FORMAT_R16G16B16_SSCALED:
+        case VK_FORMAT_R16G16B16_UINT:
+        case VK_FORMAT_R16G16B16_SINT:
+        case VK_FORMAT_R16G16B16_SFLOAT:
+            return { 6 };
+        case VK_FORMAT_R16G16B16A16_UNORM:
+        case VK_FORMAT_R16G16B16A16_SNORM:
+        case VK_FORMAT_R16G16B16A16_USCALED:
+        case VK_FORMAT_R16G16B16A16_SSCALED:
+        case VK_FORMAT_R16G16B16A16_UINT:
+        case VK_FORMAT_R16G16B16A16_SINT:
+        case VK_FORMAT_R16G16B16A16_SFLOAT:
+        case VK_FORMAT_R32G32_UINT:
+        case VK_FORMAT_R32G32_SINT:
+        case VK_FORMAT_R32G32_SFLOAT:
+        case VK_FORMAT_R64_UINT:
+        case VK_FORMAT_R64_SINT:
+        case VK_FORMAT_R64_SFLOAT:
+            return { 8 };
+        case VK_FORMAT_R32G32B32_UINT:
+        case VK_FORMAT_R32G32B32_SINT:
+        case VK_FORMAT_R32G32B32_SFLOAT:
+            return { 12 };
+        case VK_FORMAT_R32G32B32A32_UINT:
+        case VK_FORMAT_R32G32B32A32_SINT:
+        case VK_FORMAT_R32G32B32A32_SFLOAT:
+        case VK_FORMAT_R64G64_UINT:
+        case VK_FORMAT_R64G64_SINT:
+        case VK_FORMAT_R64G64_SFLOAT:
+            return { 16 };
+        case VK_FORMAT_R64G64B64_UINT:
+        case VK_FORMAT_R64G64B64_SINT:
+        case VK_FORMAT_R64G64B64_SFLOAT:
+            return { 24 };
+        case VK_FORMAT_R64G64B64A64_UINT:
+        case VK_FORMAT_R64G64B64A64_SINT:
+        case VK_FORMAT_R64G64B64A64_SFLOAT:
+            return { 32 };
+        case VK_FORMAT_BC1_RGB_UNORM_BLOCK:
+        case VK_FORMAT_BC1_RGB_SRGB_BLOCK:
+        case VK_FORMAT_BC1_RGBA_UNORM_BLOCK:
+        case VK_FORMAT_BC1_RGBA_SRGB_BLOCK:
+        case VK_FORMAT_BC4_UNORM_BLOCK:
+        case VK_FORMAT_BC4_SNORM_BLOCK:
+        case VK_FORMAT_ETC2_R8G8B8_UNORM_BLOCK:
+        case VK_FORMAT_ETC2_R8G8B8_SRGB_BLOCK:
+        case VK_FORMAT_ETC2_R8G8B8A1_UNORM_BLOCK:
+        case VK_FORMAT_ETC2_R8G8B8A1_SRGB_BLOCK:
+        case VK_FORMAT_EAC_R11_UNORM_BLOCK:
+        case VK_FORMAT_EAC_R11_SNORM_BLOCK:
+            return { 8, 4, 4 };
+        case VK_FORMAT_BC2_UNORM_BLOCK:
+        case VK_FORMAT_BC2_SRGB_BLOCK:
+        case VK_FORMAT_BC3_UNORM_BLOCK:
+        case VK_FORMAT_BC3_SRGB_BLOCK:
+        case VK_FORMAT_BC5_UNORM_BLOCK:
+        case VK_FORMAT_BC5_SNORM_BLOCK:
+        case VK_FORMAT_BC6H_UFLOAT_BLOCK:
+        case VK_FORMAT_BC6H_SFLOAT_BLOCK:
+        case VK_FORMAT_BC7_UNORM_BLOCK:
+        case VK_FORMAT_BC7_SRGB_BLOCK:
+        case VK_FORMAT_ETC2_R8G8B8A8_UNORM_BLOCK:
+        case VK_FORMAT_ETC2_R8G8B8A8_SRGB_BLOCK:
+        case VK_FORMAT_EAC_R11G11_UNORM_BLOCK:
+        case VK_FORMAT_EAC_R11G11_SNORM_BLOCK:
+        case VK_FORMAT_ASTC_4x4_UNORM_BLOCK:
+        case VK_FORMAT_ASTC_4x4_SRGB_BLOCK:
+            return { 16, 4, 4 };
+        case VK_FORMAT_ASTC_5x4_UNORM_BLOCK:
+        case VK_FORMAT_ASTC_5x4_SRGB_BLOCK:
+            return { 16, 5, 4 };
+        case VK_FORMAT_ASTC_5x5_UNORM_BLOCK:
+        case VK_FORMAT_ASTC_5x5_SRGB_BLOCK:
+            return { 16, 5, 5 };
+        case VK_FORMAT_ASTC_6x5_UNORM_BLOCK:
+        case VK_FORMAT_ASTC_6x5_SRGB_BLOCK:
+            return { 16, 6, 5 };
+        case VK_FORMAT_ASTC_6x6_UNORM_BLOCK:
+        case VK_FORMAT_ASTC_6x6_SRGB_BLOCK:
+            return { 16, 6, 6 };
+        case VK_FORMAT_ASTC_8x5_UNORM_BLOCK:
+        case VK_FORMAT_ASTC_8x5_SRGB_BLOCK:
+            return { 16, 8, 5 };
+        case VK_FORMAT_ASTC_8x6_UNORM_BLOCK:
+        case VK_FORMAT_ASTC_8x6_SRGB_BLOCK:
+            return { 16, 8, 6 };
+        case VK_FORMAT_ASTC_8x8_UNORM_BLOCK:
+        case VK_FORMAT_ASTC_8x8_SRGB_BLOCK:
+            return { 16, 8, 8 };
+        case VK_FORMAT_ASTC_10x5_UNORM_BLOCK:
+        case VK_FORMAT_ASTC_10x5_SRGB_BLOCK:
+            return { 16, 10, 5 };
+        case VK_FORMAT_ASTC_10x6_UNORM_BLOCK:
+        case VK_FORMAT_ASTC_10x6_SRGB_BLOCK:
+            return { 16, 10, 6 };
+        case VK_FORMAT_ASTC_10x8_UNORM_BLOCK:
+        case VK_FORMAT_ASTC_10x8_SRGB_BLOCK:
+            return { 16, 10, 8 };
+        case VK_FORMAT_ASTC_10x10_UNORM_BLOCK:
+        case VK_FORMAT_ASTC_10x10_SRGB_BLOCK:
+            return { 16, 10, 10 };
+        case VK_FORMAT_ASTC_12x10_UNORM_BLOCK:
+        case VK_FORMAT_ASTC_12x10_SRGB_BLOCK:
+            return { 16, 12, 10 };
+        case VK_FORMAT_ASTC_12x12_UNORM_BLOCK:
+        case VK_FORMAT_ASTC_12x12_SRGB_BLOCK:
+            return { 16, 12, 12 };
+        default: break;
+    }
+    throw std::runtime_error("TODO: unhandled format");
+}
+
+/// Where a region is in the image, and how many bytes its rows of texel blocks take up.
+/// In staging memory, the rows are tightly packed.
+struct RegionLayout {
+    VkImageSubresourceLayers subresource;
+    VkOffset3D offset;
+    VkExtent3D extent;
+    size_t row_size;
+    /// Rows of texel blocks per depth slice
+    size_t rows;
+    /// Depth slices times layers
+    size_t slices;
+    size_t host_row_pitch;
+    /// Of the region in staging memory, copies want it aligned to 4 bytes and to the block size
+    size_t alignment;
+
+    size_t staging_size() const { return row_size * rows * slices; }
+    size_t host_size() const { return host_row_pitch * rows * slices; }
+
+    VkImageSubresourceRange range() const {
+        return { subresource.aspectMask, subresource.mipLevel, 1, subresource.baseArrayLayer, subresource.layerCount };
+    }
+
+    VkBufferImageCopy2 copy(size_t staging_offset) const {
+        return {
+            .sType = VK_STRUCTURE_TYPE_BUFFER_IMAGE_COPY_2,
+            .bufferOffset = staging_offset,
+            .imageSubresource = subresource,
+            .imageOffset = offset,
+            .imageExtent = extent,
+        };
+    }
+};
+
+static RegionLayout region_layout(const Image& image, const ImageRegion& region) {
+    if (image.samples() != VK_SAMPLE_COUNT_1_BIT)
+        throw std::runtime_error("multisampled images can't be copied from or to the host");
+    if (region.mip_level >= image.mip_levels() || region.base_layer >= image.array_layers())
+        throw std::runtime_error("region is outside of the image");
+
+    RegionLayout layout;
+    layout.subresource = image.whole_image_subresource_layers(region.mip_level);
+    if (layout.subresource.aspectMask == (VK_IMAGE_ASPECT_DEPTH_BIT | VK_IMAGE_ASPECT_STENCIL_BIT))
+        throw std::runtime_error("combined depth/stencil images can't be copied from or to the host");
+    layout.subresource.baseArrayLayer = region.base_layer;
+    layout.subresource.layerCount = region.layer_count ? region.layer_count : image.array_layers() - region.base_layer;
+
+    VkExtent3D level = image.size(region.mip_level);
+    layout.offset = region.offset;
+    if (layout.offset.x < 0 || layout.offset.y < 0 || layout.offset.z < 0)
+        throw std::runtime_error("region is outside of the image");
+    uint32_t x = layout.offset.x, y = layout.offset.y, z = layout.offset.z;
+    if (x > level.width || y > level.height || z > level.depth)
+        throw std::runtime_error("region is outside of the image");
+    layout.extent = region.extent.value_or(VkExtent3D { level.width - x, level.height - y, level.depth - z });
+    if (x + layout.extent.width > level.width || y + layout.extent.height > level.height || z + layout.extent.depth > level.depth || region.base_layer + layout.subresource.layerCount > image.array_layers())
+        throw std::runtime_error("region is outside of the image");
+
+    auto block = format_block(image.format());
+    // Only whole blocks can be copied, except on the edges of the image
+    auto on_blocks = [](uint32_t start, uint32_t size, uint32_t block_size, uint32_t limit) {
+        return start % block_size == 0 && (size % block_size == 0 || start + size == limit);
+    };
+    if (!on_blocks(x, layout.extent.width, block.width, level.width) || !on_blocks(y, layout.extent.height, block.height, level.height))
+        throw std::runtime_error("region doesn't line up with the texel blocks of the format");
+
+    layout.row_size = (size_t) (layout.extent.width + block.width - 1) / block.width * block.bytes;
+    layout.rows = (layout.extent.height + block.height - 1) / block.height;
+    layout.slices = (size_t) layout.extent.depth * layout.subresource.layerCount;
+    layout.host_row_pitch = region.row_pitch ? region.row_pitch : layout.row_size;
+    if (layout.host_row_pitch < layout.row_size)
+        throw std::runtime_error("row pitch is smaller than a row of the region");
+    layout.alignment = std::lcm<size_t>(block.bytes, 4);
+    return layout;
+}
+
+/// Copies the rows from one pitch to the other, in one go when they are the same
+static void repack(uint8_t* dst, size_t dst_pitch, const uint8_t* src, size_t src_pitch, const RegionLayout& layout) {
+    size_t rows = layout.rows * layout.slices;
+    if (dst_pitch == src_pitch) {
+        memcpy(dst, src, dst_pitch * rows);
+        return;
+    }
+    for (size_t row = 0; row < rows; row++)
+        memcpy(dst + row * dst_pitch, src + row * src_pitch, layout.row_size);
+}
+
+size_t Image::host_size(const ImageRegion& region) const {
+    return region_layout(*this, region).host_size();
+}
+
+void Image::uploadDataSync(const void* data, const ImageRegion& region) {
+    uploadDataAsync(data, region).wait();
+}
+
+Device::Token Image::uploadDataAsync(const void* data, const ImageRegion& region, std::vector<Device::Token> wait_for) {
+    auto layout = region_layout(*this, region);
+    auto& device = _impl->device;
+    auto& ring = device._impl->staging_ring(device);
+    auto staging = ring.stage(layout.staging_size(), layout.alignment);
+    repack(staging.host_ptr, layout.row_size, static_cast<const uint8_t*>(data), layout.host_row_pitch, layout);
+
+    auto token = device.executeCommandsAsync([&](VkCommandBuffer cmdbuf) {
+        transition(cmdbuf, layout.range(), VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, VK_PIPELINE_STAGE_2_TRANSFER_BIT, VK_ACCESS_2_TRANSFER_WRITE_BIT);
+        vkCmdCopyBufferToImage2(cmdbuf, tmpPtr<VkCopyBufferToImageInfo2>({
+            .sType = VK_STRUCTURE_TYPE_COPY_BUFFER_TO_IMAGE_INFO_2,
+            .srcBuffer = staging.buffer->handle,
+            .dstImage = handle(),
+            .dstImageLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+            .regionCount = 1,
+            .pRegions = tmpPtr(layout.copy(staging.offset)),
+        }));
+    }, std::move(wait_for));
+
+    ring.retire(staging, token);
+    return token;
+}
+
+void Image::downloadDataSync(void* data, const ImageRegion& region) {
+    downloadDataAsync(data, region).wait();
+}
+
+Device::Token Image::downloadDataAsync(void* data, const ImageRegion& region, std::vector<Device::Token> wait_for) {
+    auto layout = region_layout(*this, region);
+    auto& device = _impl->device;
+    auto& ring = device._impl->readback_ring(device);
+    auto staging = ring.stage(layout.staging_size(), layout.alignment, true);
+
+    auto token = device.executeCommandsAsync([&](VkCommandBuffer cmdbuf) {
+        transition(cmdbuf, layout.range(), VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, VK_PIPELINE_STAGE_2_TRANSFER_BIT, VK_ACCESS_2_TRANSFER_READ_BIT);
+        vkCmdCopyImageToBuffer2(cmdbuf, tmpPtr<VkCopyImageToBufferInfo2>({
+            .sType = VK_STRUCTURE_TYPE_COPY_IMAGE_TO_BUFFER_INFO_2,
+            .srcImage = handle(),
+            .srcImageLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+            .dstBuffer = staging.buffer->handle,
+            .regionCount = 1,
+            .pRegions = tmpPtr(layout.copy(staging.offset)),
+        }));
+        make_transfers_host_visible(device, cmdbuf);
+    }, std::move(wait_for));
+
+    ring.retire(staging, token);
+    token.then([=, &ring]() {
+        staging.buffer->invalidate(staging.offset, layout.staging_size());
+        repack(static_cast<uint8_t*>(data), layout.host_row_pitch, staging.host_ptr, layout.row_size, layout);
+        ring.release(staging);
+    });
+    return token;
+}
+
+}
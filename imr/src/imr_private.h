@@ -5,15 +5,377 @@
 
 #include "vk_mem_alloc.h"
 
+#include <array>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+
 #define CHECK_VK_THROW(do) CHECK_VK(do, throw std::runtime_error(#do))
 
 namespace imr {
 
+struct ThreadPool;
+struct TransientHeaps;
+
+/// One command pool per recording thread, created on demand, so recording needs no locking.
+/// Command pools can only be used by one thread at a time, so command buffers released by other threads are freed by their owner later on.
+/// Once the owning thread has exited, its pool is destroyed as soon as all of its command buffers were released.
+struct CommandPoolRegistry {
+    CommandPoolRegistry(Device&, uint32_t queue_family, VkCommandPoolCreateFlags flags);
+    CommandPoolRegistry(CommandPoolRegistry&) = delete;
+    ~CommandPoolRegistry();
+
+    struct Pool {
+        VkCommandPool pool;
+        std::mutex mutex;
+        /// Released from another thread, waiting for the owner to free them
+        std::vector<VkCommandBuffer> garbage;
+        /// Allocated and not freed yet, garbage included
+        size_t live = 0;
+        /// Transient registries only: handed out since the last reset_all(), and reset ones waiting to be handed out again, per level
+        std::array<std::vector<VkCommandBuffer>, 2> handed_out;
+        std::array<std::vector<VkCommandBuffer>, 2> recycled;
+        /// Set when the owning thread exits
+        bool orphaned = false;
+    };
+
+    /// Allocates from the calling thread's pool, which also gets rid of its garbage
+    std::tuple<Pool*, VkCommandBuffer> allocate(VkCommandBufferLevel level = VK_COMMAND_BUFFER_LEVEL_PRIMARY);
+    /// Safe to call from any thread
+    static void release(Pool*, VkCommandBuffer);
+    /// Nothing may be recording or executing from any of the pools. For registries created with VK_COMMAND_POOL_CREATE_TRANSIENT_BIT,
+    /// which are reset as a whole instead of releasing command buffers one by one: the reset command buffers get handed out again.
+    void reset_all();
+
+private:
+    Device& device;
+    uint32_t queue_family;
+    VkCommandPoolCreateFlags flags;
+    std::mutex mutex;
+    /// Shared with the owning thread, which flags them as orphaned when it exits
+    std::unordered_map<std::thread::id, std::shared_ptr<Pool>> pools;
+
+    /// Destroys the pools of exited threads that have nothing in use anymore
+    void reap();
+};
+
+/// Persistently mapped, host-visible buffer that is sub-allocated linearly and wraps around.
+/// Space is handed back once the submission that consumed it has retired on the device timeline.
+/// Readback rings hand out host_owned space instead, which is only reclaimed once the host has read it back and called release().
+/// Safe to use from any thread, like the async uploads and readbacks built on it.
+struct StagingRing {
+    StagingRing(Device&, size_t capacity, VkBufferUsageFlags usage, VkMemoryPropertyFlags memory_property);
+    StagingRing(StagingRing&) = delete;
+
+    struct Allocation {
+        size_t offset;
+        uint8_t* host_ptr;
+    };
+
+    /// Blocks on older submissions (or on other threads submitting theirs) if the ring is full.
+    /// Returns nullopt if the request is larger than the whole ring, or if the space is held by the calling thread's own allocations that weren't submitted yet.
+    std::optional<Allocation> allocate(size_t size, size_t alignment = 16, bool host_owned = false);
+    /// The allocation at offset is reclaimed once this token is done
+    void retire_at(size_t offset, Device::Token);
+    /// Hands back a host_owned allocation
+    void release(size_t offset);
+
+    /// Space in the ring, or a dedicated buffer with the same usage and memory properties when the request doesn't fit in it
+    struct Staging {
+        Buffer* buffer;
+        size_t offset;
+        uint8_t* host_ptr;
+        bool dedicated;
+        bool host_owned;
+    };
+    Staging stage(size_t size, size_t alignment, bool host_owned = false);
+    /// Ties the staging space to the submission using it, it is reclaimed once the submission is done unless it's host_owned
+    void retire(const Staging&, Device::Token);
+    /// Hands back host_owned staging space
+    void release(const Staging&);
+
+    Device& device;
+    size_t capacity;
+    VkBufferUsageFlags usage;
+    VkMemoryPropertyFlags memory_property;
+    std::unique_ptr<Buffer> buffer;
+    uint8_t* mapped;
+
+private:
+    struct Range {
+        size_t begin, end;
+        /// Submission this range is waiting on, with a zero value while it is not yet tied to one
+        Device::Token token;
+        bool host_owned = false;
+        bool released = false;
+        /// Thread that allocated it, the only one that can tie it to a submission
+        std::thread::id owner;
+    };
+    /// Recursive since continuations that release host_owned space can run from within allocate()
+    std::recursive_mutex mutex;
+    /// Notified whenever ranges get retired, released or reclaimed
+    std::condition_variable_any changed;
+    size_t head = 0;
+    std::deque<Range> in_use;
+
+    std::optional<size_t> try_allocate(size_t size, size_t alignment);
+    void reclaim();
+};
+
+/// Readbacks record this after their copies: signaling the timeline doesn't make the writes visible to the host by itself
+void make_transfers_host_visible(Device&, VkCommandBuffer);
+
+/// Nanoseconds per tick of the main queue's timestamps, 0 if it can't write any
+double timestamp_period(Device&);
+/// Timestamp queries for the main queue, VK_NULL_HANDLE if it can't write any (see timestamp_period)
+VkQueryPool create_timestamp_pool(Device&, uint32_t count);
+
+/// Device-wide cache of populated descriptor sets, keyed by set layout and the resources bound in it.
+/// The sets come out of large shared pools, and are only written to on a cache miss.
+/// Evicted sets are only freed once the work submitted so far (and the next main queue submission, e.g. the frame being recorded) is done.
+struct DescriptorCache {
+    struct Binding {
+        uint32_t binding;
+        uint32_t array_element;
+        VkDescriptorType type;
+        /// VkImageView, VkSampler or VkBuffer
+        uint64_t handle;
+        VkImageLayout layout;
+        /// Only used by buffer descriptors
+        VkDeviceSize offset;
+        VkDeviceSize range;
+
+        bool operator==(const Binding&) const = default;
+    };
+
+    struct Key {
+        VkDescriptorSetLayout layout;
+        /// Sorted by (binding, array_element)
+        std::vector<Binding> bindings;
+
+        bool operator==(const Key&) const = default;
+    };
+
+    struct KeyHash {
+        size_t operator()(const Key&) const;
+    };
+
+    /// Turns bindings into descriptor writes, the infos they point to live as long as this object
+    struct Writes {
+        Writes(const std::vector<Binding>& bindings, VkDescriptorSet dst);
+        Writes(Writes&) = delete;
+
+        std::vector<VkDescriptorImageInfo> image_infos;
+        std::vector<VkDescriptorBufferInfo> buffer_infos;
+        std::vector<VkWriteDescriptorSet> writes;
+    };
+
+    DescriptorCache(Device&);
+    DescriptorCache(DescriptorCache&) = delete;
+    ~DescriptorCache();
+
+    VkDescriptorSet get(VkDescriptorSetLayout, std::vector<Binding>&& bindings);
+
+    /// Must be called before the handle is destroyed, drops the sets that refer to it
+    void evict_handle(uint64_t);
+    /// Must be called before the set layout is destroyed
+    void evict_layout(VkDescriptorSetLayout);
+
+private:
+    struct Entry {
+        VkDescriptorSet set;
+        VkDescriptorPool pool;
+        /// Value of use_clock when the set was last handed out
+        uint64_t last_used = 0;
+    };
+
+    /// Evicted, waiting for these timeline values (per queue) before being freed
+    struct Retired {
+        VkDescriptorSet set;
+        VkDescriptorPool pool;
+        std::array<uint64_t, Device::QUEUES_COUNT> values;
+    };
+
+    Device& device;
+    /// Bind helpers get committed from recording threads
+    std::mutex mutex;
+    std::unordered_map<Key, Entry, KeyHash> entries;
+    std::vector<VkDescriptorPool> pools;
+    std::vector<Retired> retired;
+    uint64_t use_clock = 0;
+
+    Entry allocate(VkDescriptorSetLayout);
+    VkDescriptorPool create_pool();
+    template<typename P>
+    void evict_if(P predicate);
+    void retire(const Entry&);
+    void free_retired();
+    /// Drops the least recently used sets once there are too many of them
+    void trim();
+};
+
 struct Device::Impl {
     VmaAllocator allocator;
 
     //std::vector<std::unique_ptr<Buffer>> buffers;
     std::vector<std::unique_ptr<Image>> images;
+
+    /// Worker threads for parallel recording, created on first use
+    std::unique_ptr<ThreadPool> workers;
+    ThreadPool& worker_pool();
+    /// Worker threads for PipelineBuilder, created on first use and kept for the device's lifetime.
+    /// Separate from the recording workers so a batch of compiles doesn't hold up a frame.
+    std::unique_ptr<ThreadPool> compile_workers;
+    ThreadPool& compile_pool();
+
+    /// Guards the submission state below, executeCommandsAsync can be called from any thread
+    std::recursive_mutex submission_mutex;
+
+    struct Batch {
+        uint64_t value;
+        std::vector<std::tuple<CommandPoolRegistry::Pool*, VkCommandBuffer>> cmdbufs;
+        /// Timeline values this batch has to wait for before it can start, per queue
+        std::array<uint64_t, Device::QUEUES_COUNT> wait_values = {};
+    };
+
+    /// Submission state of one of the device queues. When a queue is not available the main one is used in its place, and the states are shared.
+    struct QueueState {
+        Device::Queue queue;
+        VkQueue handle;
+        uint32_t family;
+        /// Vulkan wants submits and presents to a queue externally synchronized. Presents only take this one, not submission_mutex,
+        /// so a present that blocks doesn't hold up bookkeeping or other queues. Always taken after submission_mutex.
+        std::mutex handle_mutex;
+
+        /// Only used by executeCommandsAsync, frames record from their own pools
+        std::unique_ptr<CommandPoolRegistry> command_pools;
+
+        /// Signaled by every submission to this queue, in submission order
+        VkSemaphore timeline;
+        /// Last value a submission will signal
+        uint64_t last_submitted = 0;
+        /// Same, but only counting executeCommandsAsync batches and not frames
+        uint64_t last_batch_submitted = 0;
+
+        std::optional<Batch> pending;
+        std::deque<Batch> in_flight;
+    };
+    std::vector<std::unique_ptr<QueueState>> queue_states;
+    std::array<QueueState*, Device::QUEUES_COUNT> queues;
+    QueueState& queue(Device::Queue q) { return *queues[static_cast<size_t>(q)]; }
+
+    std::vector<std::tuple<Device::Token, std::function<void(void)>>> continuations;
+
+    uint64_t completed_value(Device&, QueueState&);
+    void flush(Device&, QueueState&);
+    /// Submits the pending batches, then hands out the next timeline value of the main queue for a submission made outside of executeCommandsAsync.
+    /// That submission has to signal it, so hold submission_mutex until it is made.
+    uint64_t reserve_submission(Device&);
+
+    /// Recycled binary semaphores, for the things that can't use the timeline (swapchain acquire and present)
+    std::vector<VkSemaphore> free_semaphores;
+    VkSemaphore get_binary_semaphore(Device&);
+    /// The semaphore must be unsignaled, with no pending wait or signal operation
+    void recycle_binary_semaphore(VkSemaphore);
+
+    /// Created on first use
+    std::unique_ptr<TransientHeaps> transient;
+    TransientHeaps& transient_heaps(Device&);
+
+    /// Created on first use, see staging_ring()
+    std::unique_ptr<StagingRing> staging;
+    StagingRing& staging_ring(Device&);
+    /// Same thing for device->host copies, in cached memory
+    std::unique_ptr<StagingRing> readback;
+    StagingRing& readback_ring(Device&);
+
+    std::unique_ptr<DescriptorCache> descriptors;
+    /// VK_KHR_push_descriptor was found and enabled
+    bool push_descriptors_supported = false;
+    /// VK_KHR_present_id and VK_KHR_present_wait were found and enabled, along with their features
+    bool present_wait_supported = false;
+
+    /// Shared by every pipeline created on this device, persisted next to the executable
+    VkPipelineCache pipeline_cache = VK_NULL_HANDLE;
+    std::string pipeline_cache_path;
+    void load_pipeline_cache(Device&);
+    void save_pipeline_cache(Device&);
+};
+
+/// Access flags that write to a resource
+static constexpr VkAccessFlags2 WRITE_ACCESSES = VK_ACCESS_2_SHADER_WRITE_BIT
+    | VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT
+    | VK_ACCESS_2_COLOR_ATTACHMENT_WRITE_BIT
+    | VK_ACCESS_2_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT
+    | VK_ACCESS_2_TRANSFER_WRITE_BIT
+    | VK_ACCESS_2_HOST_WRITE_BIT
+    | VK_ACCESS_2_MEMORY_WRITE_BIT;
+
+/// What needs to be waited on before an access can happen, and the layout transition that goes with it
+struct Hazard {
+    VkPipelineStageFlags2 src_stage;
+    VkAccessFlags2 src_access;
+    VkPipelineStageFlags2 dst_stage;
+    VkAccessFlags2 dst_access;
+    VkImageLayout old_layout;
+    VkImageLayout new_layout;
+
+    bool operator==(const Hazard&) const = default;
+};
+
+/// What the GPU will have done to a resource (or image subresource) once the commands recorded so far are executed
+struct AccessState {
+    VkImageLayout layout = VK_IMAGE_LAYOUT_UNDEFINED;
+    /// Last write, and the stages and accesses it has already been made visible to
+    VkPipelineStageFlags2 write_stages = VK_PIPELINE_STAGE_2_NONE;
+    VkAccessFlags2 write_access = VK_ACCESS_2_NONE;
+    VkPipelineStageFlags2 visible_stages = VK_PIPELINE_STAGE_2_NONE;
+    VkAccessFlags2 visible_access = VK_ACCESS_2_NONE;
+    /// Reads since the last write, the next write has to wait for them
+    VkPipelineStageFlags2 read_stages = VK_PIPELINE_STAGE_2_NONE;
+
+    /// Starts over from an access made without tracking
+    static AccessState assume(VkImageLayout layout, VkPipelineStageFlags2 stage, VkAccessFlags2 access);
+
+    /// Updates the state with the new access, and returns what it has to wait on (if anything)
+    std::optional<Hazard> access(bool is_image, VkPipelineStageFlags2 stage, VkAccessFlags2 access, VkImageLayout layout, bool write);
+
+    bool operator==(const AccessState&) const = default;
+};
+
+struct Image::Impl {
+    Device& device;
+    VkImage handle;
+    VkImageType type;
+    VkExtent3D size;
+    VkFormat format;
+    uint32_t levels;
+    uint32_t layers;
+    VkSampleCountFlagBits samples;
+    VkImageCreateFlags flags;
+    std::optional<VmaAllocation> vma_allocation;
+    /// Created by us but with memory bound from elsewhere, see create_unbound_image
+    bool owns_handle = false;
+
+    /// (type, aspects, base level, level count, base layer, layer count)
+    using ViewKey = std::tuple<VkImageViewType, VkImageAspectFlags, uint32_t, uint32_t, uint32_t, uint32_t>;
+    /// Created on demand, possibly from several recording threads at once
+    std::mutex views_mutex;
+    std::map<ViewKey, VkImageView> views;
+
+    /// One per subresource, indexed by level * layers + layer
+    std::vector<AccessState> subresources;
+
+    /// existing_handle is VK_NULL_HANDLE when the image is to be allocated by us
+    Impl(Device& device, VkImage existing_handle, VkImageType type, VkExtent3D size, VkFormat format, uint32_t levels = 1, uint32_t layers = 1, VkSampleCountFlagBits samples = VK_SAMPLE_COUNT_1_BIT, VkImageCreateFlags flags = 0)
+    : device(device), handle(existing_handle), type(type), size(size), format(format), levels(levels), layers(layers), samples(samples), flags(flags), subresources(levels * layers) {}
+
+    AccessState& subresource(uint32_t level, uint32_t layer) { return subresources[level * layers + layer]; }
+    /// The state shared by every subresource, throws if they are not all in the same one
+    AccessState& whole_image_state();
 };
 
 static inline void appendPNext(VkBaseOutStructure* base, VkBaseOutStructure* ext) {
@@ -25,6 +387,44 @@ static inline void appendPNext(VkBaseOutStructure* base, VkBaseOutStructure* ext
 
 Image make_image_from(Device& device, VkImage existing_handle, VkImageType dim, VkExtent3D size, VkFormat format);
 
+/// Resources without memory, the caller binds them to memory it manages itself (e.g. aliased transient memory)
+std::unique_ptr<Image> create_unbound_image(Device& device, VkImageType dim, VkExtent3D size, VkFormat format, VkImageUsageFlags usage, uint32_t mip_levels, uint32_t array_layers, VkSampleCountFlagBits samples);
+std::unique_ptr<Buffer> create_unbound_buffer(Device& device, size_t size, VkBufferUsageFlags usage);
+
+/// Memory blocks backing the transient resources of render graphs.
+/// A block is handed back once the frame that used it is done, and reused by later frames.
+struct TransientHeaps {
+    TransientHeaps(Device&);
+    TransientHeaps(TransientHeaps&) = delete;
+    ~TransientHeaps();
+
+    struct Heap {
+        VmaAllocation allocation;
+        VkDeviceSize size;
+        uint32_t memory_type;
+    };
+
+    /// Picks the smallest free block that fits and has a suitable memory type, or allocates a new one.
+    /// lazy asks for lazily allocated memory, for transient attachments.
+    Heap acquire(VkDeviceSize size, uint32_t memory_type_bits, bool lazy);
+    void release(Heap);
+    /// Called once per recycled frame, frees the blocks nobody picked up for MAX_UNUSED_FRAMES frames (e.g. after a resize made them all too small)
+    void trim();
+
+    static constexpr uint64_t MAX_UNUSED_FRAMES = 8;
+
+private:
+    Device& device;
+    std::mutex mutex;
+    struct Free {
+        Heap heap;
+        /// Value of frame_clock when it was released
+        uint64_t released_at;
+    };
+    std::vector<Free> free;
+    uint64_t frame_clock = 0;
+};
+
 }
 
 #endif
@@ -0,0 +1,67 @@
+#include "imr_private.h"
+#include "thread_pool.h"
+
+#include <condition_variable>
+
+namespace imr {
+
+// Pipelines are created concurrently: the device's VkPipelineCache is internally synchronized and the reflection cache has its own lock.
+// Shady makes no thread-safety promises for parsing, so ReflectedLayout serializes that part (see shader.cpp).
+struct PipelineBuilder::Impl {
+    Device& device;
+    /// Only when a thread count was asked for, the device's compile workers are used otherwise
+    std::unique_ptr<ThreadPool> own_pool;
+    ThreadPool& pool;
+
+    /// The futures belong to the caller, so we count the jobs to be able to wait on them
+    std::mutex mutex;
+    std::condition_variable cv;
+    size_t outstanding = 0;
+
+    Impl(Device& device, unsigned threads) : device(device), own_pool(threads > 0 ? std::make_unique<ThreadPool>(threads) : nullptr), pool(own_pool ? *own_pool : device._impl->compile_pool()) {}
+
+    template<typename F>
+    auto submit(F&& fn) {
+        {
+            std::lock_guard guard(mutex);
+            outstanding++;
+        }
+        return pool.submit([this, fn = std::forward<F>(fn)]() mutable {
+            // Also counts down when fn throws, the exception goes to the future
+            struct Done {
+                Impl* impl;
+                ~Done() {
+                    std::lock_guard guard(impl->mutex);
+                    impl->outstanding--;
+                    impl->cv.notify_all();
+                }
+            } done { this };
+            return fn();
+        });
+    }
+
+    ~Impl() {
+        std::unique_lock lock(mutex);
+        cv.wait(lock, [&]() { return outstanding == 0; });
+    }
+};
+
+PipelineBuilder::PipelineBuilder(Device& device, unsigned threads) {
+    _impl = std::make_unique<Impl>(device, threads);
+}
+
+PipelineBuilder::~PipelineBuilder() {}
+
+std::future<std::unique_ptr<ComputePipeline>> PipelineBuilder::compute(std::string spirv_filename, std::string entrypoint_name, bool push_descriptors) {
+    return _impl->submit([&device = _impl->device, spirv_filename = std::move(spirv_filename), entrypoint_name = std::move(entrypoint_name), push_descriptors]() mutable {
+        return std::make_unique<ComputePipeline>(device, std::move(spirv_filename), std::move(entrypoint_name), push_descriptors);
+    });
+}
+
+std::future<std::unique_ptr<GraphicsPipeline>> PipelineBuilder::graphics(std::vector<ShaderEntryPoint*> stages, GraphicsPipeline::RenderTargetsState render_targets, GraphicsPipeline::StateBuilder state, bool push_descriptors) {
+    return _impl->submit([&device = _impl->device, stages = std::move(stages), render_targets = std::move(render_targets), state, push_descriptors]() mutable {
+        return std::make_unique<GraphicsPipeline>(device, std::move(stages), std::move(render_targets), state, push_descriptors);
+    });
+}
+
+}
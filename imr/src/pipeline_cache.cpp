@@ -0,0 +1,89 @@
+#include "imr_private.h"
+
+#include "imr/util.h"
+
+#include <filesystem>
+
+namespace imr {
+
+/// The driver UUID and device ID are part of the name, so different GPUs and driver versions don't keep evicting each other's cache
+static std::string pipeline_cache_filename(Device& device) {
+    auto& properties = device.physical_device.properties;
+    char name[128];
+    int written = snprintf(name, sizeof(name), "imr_pipeline_cache_%08x_%08x_", properties.vendorID, properties.deviceID);
+    std::string filename(name, written);
+    for (auto byte : properties.pipelineCacheUUID) {
+        snprintf(name, sizeof(name), "%02x", byte);
+        filename += name;
+    }
+    filename += ".bin";
+
+    const char* loc = imr_get_executable_location();
+    auto path = (std::filesystem::path(loc).parent_path() / filename).string();
+    free((char*) loc);
+    return path;
+}
+
+/// Drivers are supposed to reject incompatible data themselves, but some of them crash on it instead
+static bool validate_pipeline_cache_header(Device& device, const unsigned char* data, size_t size) {
+    VkPipelineCacheHeaderVersionOne header;
+    if (size < sizeof(header))
+        return false;
+    memcpy(&header, data, sizeof(header));
+
+    auto& properties = device.physical_device.properties;
+    return header.headerSize >= sizeof(header)
+        && header.headerSize <= size
+        && header.headerVersion == VK_PIPELINE_CACHE_HEADER_VERSION_ONE
+        && header.vendorID == properties.vendorID
+        && header.deviceID == properties.deviceID
+        && memcmp(header.pipelineCacheUUID, properties.pipelineCacheUUID, VK_UUID_SIZE) == 0;
+}
+
+void Device::Impl::load_pipeline_cache(Device& device) {
+    pipeline_cache_path = pipeline_cache_filename(device);
+
+    size_t size = 0;
+    unsigned char* data = nullptr;
+    if (imr_read_file(pipeline_cache_path.c_str(), &size, &data)) {
+        if (!validate_pipeline_cache_header(device, data, size)) {
+            fprintf(stderr, "Ignoring incompatible pipeline cache %s\n", pipeline_cache_path.c_str());
+            size = 0;
+        }
+    }
+
+    VkResult result = vkCreatePipelineCache(device.device, tmpPtr<VkPipelineCacheCreateInfo>({
+        .sType = VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO,
+        .initialDataSize = size,
+        .pInitialData = size > 0 ? data : nullptr,
+    }), nullptr, &pipeline_cache);
+    // Should the driver still not like the data, start over with an empty cache
+    if (result != VK_SUCCESS && size > 0) {
+        CHECK_VK_THROW(vkCreatePipelineCache(device.device, tmpPtr<VkPipelineCacheCreateInfo>({
+            .sType = VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO,
+        }), nullptr, &pipeline_cache));
+    } else if (result != VK_SUCCESS) {
+        throw std::runtime_error("failed to create pipeline cache");
+    }
+    free(data);
+}
+
+void Device::Impl::save_pipeline_cache(Device& device) {
+    size_t size;
+    CHECK_VK(vkGetPipelineCacheData(device.device, pipeline_cache, &size, nullptr), return);
+    std::vector<char> data(size);
+    CHECK_VK(vkGetPipelineCacheData(device.device, pipeline_cache, &size, data.data()), return);
+
+    // Write to a temporary file first, so a crash or a concurrent instance can't leave a truncated cache behind
+    auto tmp_path = pipeline_cache_path + ".tmp";
+    if (!imr_write_file(tmp_path.c_str(), size, data.data())) {
+        fprintf(stderr, "Failed to write pipeline cache %s\n", tmp_path.c_str());
+        return;
+    }
+    std::error_code error;
+    std::filesystem::rename(tmp_path, pipeline_cache_path, error);
+    if (error)
+        fprintf(stderr, "Failed to write pipeline cache %s: %s\n", pipeline_cache_path.c_str(), error.message().c_str());
+}
+
+}
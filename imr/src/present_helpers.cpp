@@ -2,6 +2,55 @@
 
 namespace imr {
 
+/// Also signals the device timeline, which the frame waits on before recycling anything
+static void submitPresentCommands(Swapchain::Frame& frame, VkCommandBuffer cmdbuf, std::vector<VkSemaphore>& semaphores, VkFence signal_when_reusable) {
+    auto& device = frame._impl->device;
+
+    std::vector<VkSemaphoreSubmitInfo> waits;
+    for (auto semaphore : semaphores) {
+        // offscreen swapchains have no acquire semaphore
+        if (semaphore == VK_NULL_HANDLE)
+            continue;
+        waits.push_back({
+            .sType = VK_STRUCTURE_TYPE_SEMAPHORE_SUBMIT_INFO,
+            .semaphore = semaphore,
+            .stageMask = VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT,
+        });
+    }
+
+    std::lock_guard guard(device._impl->submission_mutex);
+    uint64_t timeline_value = device._impl->reserve_submission(device);
+    frame._impl->set_timeline_value(timeline_value);
+    std::vector<VkSemaphoreSubmitInfo> signals;
+    if (frame.signal_when_ready != VK_NULL_HANDLE) {
+        signals.push_back({
+            .sType = VK_STRUCTURE_TYPE_SEMAPHORE_SUBMIT_INFO,
+            .semaphore = frame.signal_when_ready,
+            .stageMask = VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT,
+        });
+    }
+    signals.push_back({
+        .sType = VK_STRUCTURE_TYPE_SEMAPHORE_SUBMIT_INFO,
+        .semaphore = device._impl->queue(Device::Queue::Main).timeline,
+        .value = timeline_value,
+        .stageMask = VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT,
+    });
+
+    std::lock_guard handle_guard(device._impl->queue(Device::Queue::Main).handle_mutex);
+    CHECK_VK_THROW(device.dispatch.queueSubmit2KHR(device.main_queue, 1, tmpPtr<VkSubmitInfo2>({
+        .sType = VK_STRUCTURE_TYPE_SUBMIT_INFO_2,
+        .waitSemaphoreInfoCount = static_cast<uint32_t>(waits.size()),
+        .pWaitSemaphoreInfos = waits.data(),
+        .commandBufferInfoCount = 1,
+        .pCommandBufferInfos = tmpPtr<VkCommandBufferSubmitInfo>({
+            .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_SUBMIT_INFO,
+            .commandBuffer = cmdbuf,
+        }),
+        .signalSemaphoreInfoCount = static_cast<uint32_t>(signals.size()),
+        .pSignalSemaphoreInfos = signals.data(),
+    }), signal_when_reusable));
+}
+
 void Swapchain::Frame::presentFromBuffer(VkBuffer buffer, VkFence signal_when_reusable, std::optional<VkSemaphore> sem) {
     auto& slot = _impl->slot;
     auto& swapchain = slot.swapchain;
@@ -15,13 +64,7 @@ void Swapchain::Frame::presentFromBuffer(VkBuffer buffer, VkFence signal_when_re
     if (sem)
         semaphores.push_back(*sem);
 
-    VkCommandBuffer cmdbuf;
-    CHECK_VK_THROW(vkAllocateCommandBuffers(device.device, tmpPtr<VkCommandBufferAllocateInfo>({
-        .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
-        .commandPool = device.pool,
-        .level = VK_COMMAND_BUFFER_LEVEL_PRIMARY,
-        .commandBufferCount = 1,
-    }), &cmdbuf));
+    VkCommandBuffer cmdbuf = allocateCommandBuffer();
 
     CHECK_VK_THROW(vkBeginCommandBuffer(cmdbuf, tmpPtr<VkCommandBufferBeginInfo>({
         .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
@@ -71,7 +114,7 @@ void Swapchain::Frame::presentFromBuffer(VkBuffer buffer, VkFence signal_when_re
             .dstStageMask = VK_PIPELINE_STAGE_2_TRANSFER_BIT,
             .dstAccessMask = VK_ACCESS_2_TRANSFER_READ_BIT,
             .oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
-            .newLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR,
+            .newLayout = swapchain._impl->present_layout(),
             .image = slot.image,
             .subresourceRange = {
                 .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
@@ -81,25 +124,10 @@ void Swapchain::Frame::presentFromBuffer(VkBuffer buffer, VkFence signal_when_re
         }),
     }));
 
-    std::vector<VkPipelineStageFlags> stage_flags;
-    for (auto& sem : semaphores)
-        stage_flags.emplace_back(VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT);
-
     vkEndCommandBuffer(cmdbuf);
-    vkQueueSubmit(device.main_queue, 1, tmpPtr<VkSubmitInfo>({
-        .sType = VK_STRUCTURE_TYPE_SUBMIT_INFO,
-        .waitSemaphoreCount = static_cast<uint32_t>(semaphores.size()),
-        .pWaitSemaphores = semaphores.data(),
-        .pWaitDstStageMask = stage_flags.data(),
-        .commandBufferCount = 1,
-        .pCommandBuffers = &cmdbuf,
-        .signalSemaphoreCount = 1,
-        .pSignalSemaphores = &slot.present_semaphore,
-    }), signal_when_reusable);
-
-    addCleanupAction([=, &device]() {
-        vkFreeCommandBuffers(device.device, device.pool, 1, &cmdbuf);
-    });
+    submitPresentCommands(*this, cmdbuf, semaphores, signal_when_reusable);
+    // Done behind the tracker's back, let it know for the readback of offscreen swapchains
+    image().assumeState(swapchain._impl->present_layout(), VK_PIPELINE_STAGE_2_TRANSFER_BIT, VK_ACCESS_2_TRANSFER_WRITE_BIT);
 
     queuePresent();
 }
@@ -118,13 +146,7 @@ void Swapchain::Frame::presentFromImage(VkImage image, VkFence signal_when_reusa
     assert(image != slot.image);
     assert(signal_when_reusable != VK_NULL_HANDLE);
 
-    VkCommandBuffer cmdbuf;
-    vkAllocateCommandBuffers(device.device, tmpPtr<VkCommandBufferAllocateInfo>({
-        .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
-        .commandPool = device.pool,
-        .level = VK_COMMAND_BUFFER_LEVEL_PRIMARY,
-        .commandBufferCount = 1,
-    }), &cmdbuf);
+    VkCommandBuffer cmdbuf = allocateCommandBuffer();
 
     vkBeginCommandBuffer(cmdbuf, tmpPtr<VkCommandBufferBeginInfo>({
         .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
@@ -193,7 +215,7 @@ void Swapchain::Frame::presentFromImage(VkImage image, VkFence signal_when_reusa
             .dstStageMask = VK_PIPELINE_STAGE_2_TRANSFER_BIT,
             .dstAccessMask = VK_ACCESS_2_TRANSFER_READ_BIT,
             .oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
-            .newLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR,
+            .newLayout = swapchain._impl->present_layout(),
             .image = slot.image,
             .subresourceRange = {
                 .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
@@ -203,25 +225,10 @@ void Swapchain::Frame::presentFromImage(VkImage image, VkFence signal_when_reusa
         }),
     }));
 
-    std::vector<VkPipelineStageFlags> stage_flags;
-    for (auto& sem : semaphores)
-        stage_flags.emplace_back(VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT);
-
     vkEndCommandBuffer(cmdbuf);
-    vkQueueSubmit(device.main_queue, 1, tmpPtr<VkSubmitInfo>({
-        .sType = VK_STRUCTURE_TYPE_SUBMIT_INFO,
-        .waitSemaphoreCount = static_cast<uint32_t>(semaphores.size()),
-        .pWaitSemaphores = semaphores.data(),
-        .pWaitDstStageMask = stage_flags.data(),
-        .commandBufferCount = 1,
-        .pCommandBuffers = &cmdbuf,
-        .signalSemaphoreCount = 1,
-        .pSignalSemaphores = &slot.present_semaphore,
-    }), signal_when_reusable);
-
-    addCleanupAction([=, &device]() {
-        vkFreeCommandBuffers(device.device, device.pool, 1, &cmdbuf);
-    });
+    submitPresentCommands(*this, cmdbuf, semaphores, signal_when_reusable);
+    // Done behind the tracker's back, let it know for the readback of offscreen swapchains
+    this->image().assumeState(swapchain._impl->present_layout(), VK_PIPELINE_STAGE_2_TRANSFER_BIT, VK_ACCESS_2_TRANSFER_WRITE_BIT);
 
     queuePresent();
 }
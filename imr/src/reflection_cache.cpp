@@ -0,0 +1,286 @@
+#include "shader_private.h"
+
+#include "imr/util.h"
+
+#include <algorithm>
+#include <filesystem>
+#include <map>
+#include <mutex>
+
+namespace imr {
+
+/// Reflection only depends on the module contents, so this is what we key on.
+/// Two independent 64-bit hashes plus the size: a false hit would need both to collide on modules of the same size, so we don't keep the modules around to compare.
+struct ReflectionKey {
+    uint64_t hash[2];
+    uint64_t size;
+
+    auto operator<=>(const ReflectionKey&) const = default;
+};
+
+struct ReflectionEntry {
+    ReflectedLayout layout;
+    /// Value of use_clock when it was last looked up or added, the oldest entries go first
+    uint64_t last_used = 0;
+};
+
+static uint64_t mix64(uint64_t x) {
+    // Murmur3's finalizer
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    x *= 0xc4ceb9fe1a85ec53ULL;
+    x ^= x >> 33;
+    return x;
+}
+
+static ReflectionKey hash_spirv(const SPIRVModule& spirv_module) {
+    // FNV-1a over the bytes, and a multiply-rotate hash over the words. Both are much cheaper than parsing the module.
+    uint64_t fnv = 0xcbf29ce484222325ULL;
+    uint64_t mr = 0x9e3779b97f4a7c15ULL;
+    for (uint32_t word : spirv_module) {
+        for (int i = 0; i < 4; i++) {
+            fnv ^= (word >> (i * 8)) & 0xFF;
+            fnv *= 0x100000001b3ULL;
+        }
+        mr = (mr ^ word) * 0x87c37b91114253d5ULL;
+        mr = (mr << 31) | (mr >> 33);
+    }
+    return { { mix64(fnv), mix64(mr ^ spirv_module.size()) }, spirv_module.size() };
+}
+
+/// Shared by every device in the process, reflection results don't depend on the GPU
+static struct {
+    std::mutex mutex;
+    std::map<ReflectionKey, ReflectionEntry> entries;
+    uint64_t use_clock = 0;
+    std::optional<std::string> file;
+    /// Records in the file, including the ones superseded or evicted since it was last rewritten
+    size_t file_records = 0;
+} reflection_cache;
+
+static constexpr uint32_t REFLECTION_CACHE_MAGIC = 0x52524d49; // "IMRR"
+static constexpr uint32_t REFLECTION_CACHE_VERSION = 3;
+/// Plenty for any one application, hot reloading adds an entry per edit so the old ones have to go eventually
+static constexpr size_t MAX_REFLECTION_CACHE_ENTRIES = 1024;
+
+struct Writer {
+    std::vector<char> data;
+
+    template<typename T>
+    void write(T value) {
+        auto bytes = reinterpret_cast<const char*>(&value);
+        data.insert(data.end(), bytes, bytes + sizeof(T));
+    }
+};
+
+struct Reader {
+    const unsigned char* data;
+    size_t size;
+    size_t offset = 0;
+
+    template<typename T>
+    T read() {
+        if (offset + sizeof(T) > size)
+            throw std::runtime_error("truncated reflection cache");
+        T value;
+        memcpy(&value, data + offset, sizeof(T));
+        offset += sizeof(T);
+        return value;
+    }
+};
+
+/// The file is a header followed by records, new entries are appended as they come.
+/// Each record starts with its size, so one cut short by a crash is easy to spot and drop.
+static void write_header(Writer& w) {
+    w.write(REFLECTION_CACHE_MAGIC);
+    w.write(REFLECTION_CACHE_VERSION);
+}
+
+static void write_record(Writer& w, const ReflectionKey& key, const ReflectionEntry& entry) {
+    size_t start = w.data.size();
+    w.write<uint32_t>(0);
+    w.write(key.hash[0]);
+    w.write(key.hash[1]);
+    w.write(key.size);
+    auto& layout = entry.layout;
+    w.write<uint32_t>(layout.stages);
+    w.write<uint32_t>(layout.set_bindings.size());
+    for (auto& [set, bindings] : layout.set_bindings) {
+        w.write<int32_t>(set);
+        w.write<uint32_t>(bindings.size());
+        for (auto& binding : bindings) {
+            w.write<uint32_t>(binding.binding);
+            w.write<uint32_t>(binding.descriptorType);
+            w.write<uint32_t>(binding.descriptorCount);
+            w.write<uint32_t>(binding.stageFlags);
+        }
+    }
+    w.write<uint32_t>(layout.push_constants.size());
+    for (auto& range : layout.push_constants) {
+        w.write<uint32_t>(range.stageFlags);
+        w.write<uint32_t>(range.offset);
+        w.write<uint32_t>(range.size);
+    }
+    uint32_t record_size = w.data.size() - start;
+    memcpy(w.data.data() + start, &record_size, sizeof(record_size));
+}
+
+/// Rewrites the whole file without duplicates, evicted entries or broken records, through a temporary file so nobody ever sees a partial one
+static void save_reflection_cache() {
+    // Oldest first, so the order of the records keeps telling which ones were used last
+    std::vector<std::map<ReflectionKey, ReflectionEntry>::iterator> sorted;
+    for (auto i = reflection_cache.entries.begin(); i != reflection_cache.entries.end(); i++)
+        sorted.push_back(i);
+    std::sort(sorted.begin(), sorted.end(), [](auto a, auto b) { return a->second.last_used < b->second.last_used; });
+
+    Writer w;
+    write_header(w);
+    for (auto entry : sorted)
+        write_record(w, entry->first, entry->second);
+    reflection_cache.file_records = sorted.size();
+
+    auto tmp_path = *reflection_cache.file + ".tmp";
+    if (!imr_write_file(tmp_path.c_str(), w.data.size(), w.data.data())) {
+        fprintf(stderr, "Failed to write reflection cache %s\n", tmp_path.c_str());
+        return;
+    }
+    std::error_code error;
+    std::filesystem::rename(tmp_path, *reflection_cache.file, error);
+    if (error)
+        fprintf(stderr, "Failed to write reflection cache %s: %s\n", reflection_cache.file->c_str(), error.message().c_str());
+}
+
+static void append_reflection_cache(const ReflectionKey& key, const ReflectionEntry& entry) {
+    Writer w;
+    write_record(w, key, entry);
+    // A single write, so concurrent instances appending to the same file don't interleave their records
+    FILE* f = fopen(reflection_cache.file->c_str(), "ab");
+    if (!f || fwrite(w.data.data(), 1, w.data.size(), f) != w.data.size())
+        fprintf(stderr, "Failed to append to reflection cache %s\n", reflection_cache.file->c_str());
+    if (f)
+        fclose(f);
+    reflection_cache.file_records++;
+}
+
+/// Drops the least recently used entries past MAX_REFLECTION_CACHE_ENTRIES, returns whether there were any
+static bool evict_reflection_cache() {
+    auto& entries = reflection_cache.entries;
+    if (entries.size() <= MAX_REFLECTION_CACHE_ENTRIES)
+        return false;
+    std::vector<uint64_t> ages;
+    for (auto& [key, entry] : entries)
+        ages.push_back(entry.last_used);
+    auto cutoff = ages.begin() + (entries.size() - MAX_REFLECTION_CACHE_ENTRIES);
+    std::nth_element(ages.begin(), cutoff, ages.end());
+    std::erase_if(entries, [&](auto& entry) { return entry.second.last_used < *cutoff; });
+    return true;
+}
+
+static ReflectionEntry read_record(Reader& r, ReflectionKey& key) {
+    key.hash[0] = r.read<uint64_t>();
+    key.hash[1] = r.read<uint64_t>();
+    key.size = r.read<uint64_t>();
+
+    ReflectionEntry entry;
+    auto& layout = entry.layout;
+    layout.stages = r.read<uint32_t>();
+    uint32_t sets = r.read<uint32_t>();
+    for (uint32_t j = 0; j < sets; j++) {
+        auto& bindings = layout.set_bindings[r.read<int32_t>()];
+        uint32_t binding_count = r.read<uint32_t>();
+        for (uint32_t k = 0; k < binding_count; k++) {
+            VkDescriptorSetLayoutBinding binding = {};
+            binding.binding = r.read<uint32_t>();
+            binding.descriptorType = static_cast<VkDescriptorType>(r.read<uint32_t>());
+            binding.descriptorCount = r.read<uint32_t>();
+            binding.stageFlags = r.read<uint32_t>();
+            bindings.push_back(binding);
+        }
+    }
+    uint32_t push_constants = r.read<uint32_t>();
+    for (uint32_t j = 0; j < push_constants; j++) {
+        VkPushConstantRange range;
+        range.stageFlags = r.read<uint32_t>();
+        range.offset = r.read<uint32_t>();
+        range.size = r.read<uint32_t>();
+        layout.push_constants.push_back(range);
+    }
+    return entry;
+}
+
+/// Returns whether the file is fine as it is, if not it gets rewritten from what could be salvaged.
+/// That includes files with duplicates (e.g. from several instances appending) or more records than we keep: rewriting compacts them.
+static bool load_reflection_cache() {
+    size_t size;
+    unsigned char* data;
+    if (!imr_read_file(reflection_cache.file->c_str(), &size, &data))
+        return false;
+
+    bool clean = true;
+    try {
+        Reader r { data, size };
+        if (r.read<uint32_t>() != REFLECTION_CACHE_MAGIC || r.read<uint32_t>() != REFLECTION_CACHE_VERSION)
+            throw std::runtime_error("not a reflection cache");
+        while (r.offset < size) {
+            size_t start = r.offset;
+            uint32_t record_size = r.read<uint32_t>();
+            if (record_size < sizeof(uint32_t) || start + record_size > size)
+                throw std::runtime_error("truncated record");
+            // Records are read one at a time, so whatever precedes a broken one is kept
+            Reader record { data + start, record_size, sizeof(uint32_t) };
+            ReflectionKey key;
+            auto entry = read_record(record, key);
+            if (record.offset != record_size)
+                throw std::runtime_error("corrupt record");
+            // Later records were used more recently. Another instance might have appended the same shader.
+            entry.last_used = ++reflection_cache.use_clock;
+            clean &= reflection_cache.entries.insert_or_assign(key, std::move(entry)).second;
+            r.offset = start + record_size;
+        }
+        reflection_cache.file_records = reflection_cache.entries.size();
+    } catch (std::runtime_error& e) {
+        fprintf(stderr, "Ignoring (the rest of) reflection cache %s: %s\n", reflection_cache.file->c_str(), e.what());
+        clean = false;
+    }
+    free(data);
+    clean &= !evict_reflection_cache();
+    return clean;
+}
+
+void ShaderModule::set_reflection_cache_file(std::optional<std::string> filename) {
+    std::lock_guard guard(reflection_cache.mutex);
+    reflection_cache.file = std::move(filename);
+    if (reflection_cache.file && !load_reflection_cache())
+        save_reflection_cache();
+}
+
+ReflectedLayout reflect_spirv_module(SPIRVModule& spirv_module) {
+    ReflectionKey key = hash_spirv(spirv_module);
+    {
+        std::lock_guard guard(reflection_cache.mutex);
+        if (auto found = reflection_cache.entries.find(key); found != reflection_cache.entries.end()) {
+            found->second.last_used = ++reflection_cache.use_clock;
+            return found->second.layout;
+        }
+    }
+
+    // Parsing is the slow part, don't hold the lock for it
+    ReflectedLayout layout(spirv_module, 0);
+
+    std::lock_guard guard(reflection_cache.mutex);
+    auto [entry, inserted] = reflection_cache.entries.emplace(key, ReflectionEntry { layout, ++reflection_cache.use_clock });
+    if (!inserted)
+        return layout;
+    bool evicted = evict_reflection_cache();
+    if (reflection_cache.file) {
+        // Appending is cheap, but the file shouldn't keep growing with entries we dropped long ago
+        if (evicted && reflection_cache.file_records >= 2 * MAX_REFLECTION_CACHE_ENTRIES)
+            save_reflection_cache();
+        else
+            append_reflection_cache(key, entry->second);
+    }
+    return layout;
+}
+
+}
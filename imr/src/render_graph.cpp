@@ -0,0 +1,530 @@
+#include "imr_private.h"
+#include "swapchain_private.h"
+
+#include <map>
+#include <unordered_map>
+
+namespace imr {
+
+struct ResourceAccess {
+    /// nullptr for buffers
+    Image* image;
+    /// nullptr for images
+    Buffer* buffer;
+    /// VkImage or VkBuffer
+    uint64_t handle;
+    VkPipelineStageFlags2 stage;
+    VkAccessFlags2 access;
+    VkImageLayout layout;
+    bool write;
+};
+
+struct RenderGraph::Pass::Impl {
+    std::string name;
+    std::function<void(VkCommandBuffer)> record;
+    std::vector<ResourceAccess> accesses;
+    bool side_effects = false;
+
+    /// Filled in by execute()
+    std::vector<size_t> dependencies;
+    /// The dependencies whose results this pass reads or builds upon, as opposed to readers it only has to run after (write-after-read)
+    std::vector<size_t> consumes;
+    bool used = false;
+    size_t level = 0;
+
+    void add(ResourceAccess access) {
+        for (auto& other : accesses) {
+            if (other.handle == access.handle && other.layout != access.layout)
+                throw std::runtime_error("pass '" + name + "' uses the same image in two different layouts");
+        }
+        accesses.push_back(access);
+    }
+};
+
+RenderGraph::Pass::Pass(std::unique_ptr<Impl>&& impl) : _impl(std::move(impl)) {}
+RenderGraph::Pass::~Pass() = default;
+
+RenderGraph::Pass& RenderGraph::Pass::read(Image& image, VkPipelineStageFlags2 stage, VkAccessFlags2 access, VkImageLayout layout) {
+    _impl->add({ &image, nullptr, reinterpret_cast<uint64_t>(image.handle()), stage, access, layout, false });
+    return *this;
+}
+
+RenderGraph::Pass& RenderGraph::Pass::write(Image& image, VkPipelineStageFlags2 stage, VkAccessFlags2 access, VkImageLayout layout) {
+    _impl->add({ &image, nullptr, reinterpret_cast<uint64_t>(image.handle()), stage, access, layout, true });
+    return *this;
+}
+
+RenderGraph::Pass& RenderGraph::Pass::read(Buffer& buffer, VkPipelineStageFlags2 stage, VkAccessFlags2 access) {
+    _impl->add({ nullptr, &buffer, reinterpret_cast<uint64_t>(buffer.handle), stage, access, VK_IMAGE_LAYOUT_UNDEFINED, false });
+    return *this;
+}
+
+RenderGraph::Pass& RenderGraph::Pass::write(Buffer& buffer, VkPipelineStageFlags2 stage, VkAccessFlags2 access) {
+    _impl->add({ nullptr, &buffer, reinterpret_cast<uint64_t>(buffer.handle), stage, access, VK_IMAGE_LAYOUT_UNDEFINED, true });
+    return *this;
+}
+
+RenderGraph::Pass& RenderGraph::Pass::sideEffects() {
+    _impl->side_effects = true;
+    return *this;
+}
+
+struct RenderGraph::Impl {
+    Device& device;
+    /// nullptr if the graph can't have transient resources
+    Swapchain::Frame* frame = nullptr;
+    GpuProfiler* profiler = nullptr;
+    std::vector<std::unique_ptr<Pass>> passes;
+
+    struct Transient {
+        std::unique_ptr<Image> image;
+        std::unique_ptr<Buffer> buffer;
+        uint64_t handle;
+        VkMemoryRequirements requirements;
+        bool lazy;
+
+        /// Filled in by allocate_transients()
+        bool used = false;
+        size_t first_level = 0;
+        size_t last_level = 0;
+        VkDeviceSize offset = 0;
+        /// Transients that were in the same memory before this one, their accesses must be done before the first access to this one
+        std::vector<uint64_t> aliases;
+    };
+    std::vector<Transient> transients;
+    std::vector<TransientHeaps::Heap> heaps;
+
+    struct Resource {
+        /// nullptr for buffers
+        Image* image = nullptr;
+        AccessState state;
+        bool imported = false;
+        bool exported = false;
+        VkImageLayout final_layout = VK_IMAGE_LAYOUT_UNDEFINED;
+        VkPipelineStageFlags2 final_stage = VK_PIPELINE_STAGE_2_NONE;
+        VkAccessFlags2 final_access = VK_ACCESS_2_NONE;
+    };
+    std::unordered_map<uint64_t, Resource> resources;
+
+    void import_resource(Image* image, uint64_t handle, VkImageLayout layout, VkPipelineStageFlags2 stage, VkAccessFlags2 access) {
+        auto& resource = resources[handle];
+        resource.image = image;
+        resource.imported = true;
+        resource.state = AccessState::assume(layout, stage, access);
+    }
+
+    void export_resource(Image* image, uint64_t handle, VkImageLayout layout, VkPipelineStageFlags2 stage, VkAccessFlags2 access) {
+        auto& resource = resources[handle];
+        resource.image = image;
+        resource.exported = true;
+        resource.final_layout = layout;
+        resource.final_stage = stage;
+        resource.final_access = access;
+    }
+
+    void gather_resources();
+    void build_dependencies();
+    void cull();
+    size_t assign_levels();
+    void allocate_transients(const std::vector<std::vector<Pass::Impl*>>& scheduled);
+    void retire_transients();
+};
+
+RenderGraph::RenderGraph(Device& device) {
+    _impl = std::make_unique<Impl>(device);
+}
+
+RenderGraph::RenderGraph(Swapchain::Frame& frame) {
+    _impl = std::make_unique<Impl>(frame._impl->device);
+    _impl->frame = &frame;
+}
+
+RenderGraph::~RenderGraph() {
+    // Never executed, so the GPU never saw them
+    for (auto& heap : _impl->heaps)
+        _impl->device._impl->transient_heaps(_impl->device).release(heap);
+}
+
+RenderGraph::Pass& RenderGraph::addPass(std::string name, std::function<void(VkCommandBuffer)> record) {
+    auto impl = std::make_unique<Pass::Impl>();
+    impl->name = std::move(name);
+    impl->record = std::move(record);
+    return *_impl->passes.emplace_back(std::make_unique<Pass>(std::move(impl)));
+}
+
+void RenderGraph::importImage(Image& image, VkImageLayout layout, VkPipelineStageFlags2 stage, VkAccessFlags2 access) {
+    _impl->import_resource(&image, reinterpret_cast<uint64_t>(image.handle()), layout, stage, access);
+}
+
+void RenderGraph::importBuffer(Buffer& buffer, VkPipelineStageFlags2 stage, VkAccessFlags2 access) {
+    _impl->import_resource(nullptr, reinterpret_cast<uint64_t>(buffer.handle), VK_IMAGE_LAYOUT_UNDEFINED, stage, access);
+}
+
+void RenderGraph::exportImage(Image& image, VkImageLayout layout, VkPipelineStageFlags2 stage, VkAccessFlags2 access) {
+    _impl->export_resource(&image, reinterpret_cast<uint64_t>(image.handle()), layout, stage, access);
+}
+
+void RenderGraph::exportBuffer(Buffer& buffer, VkPipelineStageFlags2 stage, VkAccessFlags2 access) {
+    _impl->export_resource(nullptr, reinterpret_cast<uint64_t>(buffer.handle), VK_IMAGE_LAYOUT_UNDEFINED, stage, access);
+}
+
+Image& RenderGraph::createTransientImage(VkImageType dim, VkExtent3D size, VkFormat format, VkImageUsageFlags usage, uint32_t mip_levels, uint32_t array_layers, VkSampleCountFlagBits samples) {
+    if (!_impl->frame)
+        throw std::runtime_error("transient resources need a render graph created for a frame");
+    auto image = create_unbound_image(_impl->device, dim, size, format, usage, mip_levels, array_layers, samples);
+    auto& transient = _impl->transients.emplace_back();
+    transient.handle = reinterpret_cast<uint64_t>(image->handle());
+    vkGetImageMemoryRequirements(_impl->device.device, image->handle(), &transient.requirements);
+    transient.lazy = usage & VK_IMAGE_USAGE_TRANSIENT_ATTACHMENT_BIT;
+    transient.image = std::move(image);
+    return *transient.image;
+}
+
+Buffer& RenderGraph::createTransientBuffer(size_t size, VkBufferUsageFlags usage) {
+    if (!_impl->frame)
+        throw std::runtime_error("transient resources need a render graph created for a frame");
+    auto buffer = create_unbound_buffer(_impl->device, size, usage);
+    auto& transient = _impl->transients.emplace_back();
+    transient.handle = reinterpret_cast<uint64_t>(buffer->handle);
+    vkGetBufferMemoryRequirements(_impl->device.device, buffer->handle, &transient.requirements);
+    transient.lazy = false;
+    transient.buffer = std::move(buffer);
+    return *transient.buffer;
+}
+
+/// Images that weren't imported start out in the state their Image tracked for them
+void RenderGraph::Impl::gather_resources() {
+    for (auto& pass : passes) {
+        for (auto& access : pass->_impl->accesses) {
+            if (access.image)
+                resources[access.handle].image = access.image;
+        }
+    }
+    for (auto& [handle, resource] : resources) {
+        if (resource.image && !resource.imported)
+            resource.state = resource.image->_impl->whole_image_state();
+    }
+}
+
+/// Walks the passes in the order they were added, a pass depends on the earlier ones it has a hazard with
+void RenderGraph::Impl::build_dependencies() {
+    struct Tracking {
+        std::optional<size_t> last_writer;
+        std::vector<size_t> readers;
+        VkImageLayout layout;
+    };
+    std::unordered_map<uint64_t, Tracking> tracking;
+
+    for (size_t i = 0; i < passes.size(); i++) {
+        auto& pass = *passes[i]->_impl;
+        pass.dependencies.clear();
+        pass.consumes.clear();
+        for (auto& access : pass.accesses) {
+            auto [found, inserted] = tracking.try_emplace(access.handle);
+            auto& t = found->second;
+            if (inserted)
+                t.layout = resources[access.handle].state.layout;
+
+            auto depend_on = [&](size_t other, bool consumed) {
+                if (other == i)
+                    return;
+                pass.dependencies.push_back(other);
+                if (consumed)
+                    pass.consumes.push_back(other);
+            };
+
+            // A layout transition is a write as far as ordering is concerned
+            bool writes = access.write || (access.image && access.layout != t.layout);
+            if (t.last_writer)
+                depend_on(*t.last_writer, true);
+            if (writes) {
+                for (auto reader : t.readers)
+                    depend_on(reader, false);
+                t.readers.clear();
+                t.last_writer = i;
+                t.layout = access.layout;
+            } else {
+                t.readers.push_back(i);
+            }
+        }
+    }
+}
+
+/// Keeps what contributes to an export or has side effects, dependencies always come earlier so one reverse walk is enough.
+/// Only the passes whose results get consumed are kept: running after a reader doesn't make that reader useful.
+void RenderGraph::Impl::cull() {
+    for (auto& pass : passes) {
+        auto& impl = *pass->_impl;
+        impl.used = impl.side_effects;
+        for (auto& access : impl.accesses) {
+            if (access.write && resources[access.handle].exported)
+                impl.used = true;
+        }
+    }
+    for (size_t i = passes.size(); i-- > 0;) {
+        auto& pass = *passes[i]->_impl;
+        if (!pass.used)
+            continue;
+        for (auto dependency : pass.consumes)
+            passes[dependency]->_impl->used = true;
+    }
+}
+
+/// Passes in the same level don't depend on each other, returns the number of levels
+size_t RenderGraph::Impl::assign_levels() {
+    size_t levels = 0;
+    for (auto& pass : passes) {
+        auto& impl = *pass->_impl;
+        if (!impl.used)
+            continue;
+        impl.level = 0;
+        for (auto dependency : impl.dependencies) {
+            // Culled readers we would have had to wait for
+            if (passes[dependency]->_impl->used)
+                impl.level = std::max(impl.level, passes[dependency]->_impl->level + 1);
+        }
+        levels = std::max(levels, impl.level + 1);
+    }
+    return levels;
+}
+
+static VkDeviceSize align_up(VkDeviceSize offset, VkDeviceSize alignment) {
+    return (offset + alignment - 1) / alignment * alignment;
+}
+
+/// Transients are placed in one heap per compatible set of memory types, biggest first, at the lowest offset
+/// that doesn't collide with an already placed transient whose lifetime (in levels) overlaps with theirs.
+void RenderGraph::Impl::allocate_transients(const std::vector<std::vector<Pass::Impl*>>& scheduled) {
+    std::unordered_map<uint64_t, Transient*> by_handle;
+    for (auto& transient : transients)
+        by_handle[transient.handle] = &transient;
+    for (size_t level = 0; level < scheduled.size(); level++) {
+        for (auto pass : scheduled[level]) {
+            for (auto& access : pass->accesses) {
+                auto found = by_handle.find(access.handle);
+                if (found == by_handle.end())
+                    continue;
+                auto& transient = *found->second;
+                if (!transient.used)
+                    transient.first_level = level;
+                transient.used = true;
+                transient.last_level = level;
+            }
+        }
+    }
+
+    std::map<std::tuple<uint32_t, bool>, std::vector<Transient*>> groups;
+    for (auto& transient : transients) {
+        if (transient.used)
+            groups[{ transient.requirements.memoryTypeBits, transient.lazy }].push_back(&transient);
+    }
+
+    auto& transient_heaps = device._impl->transient_heaps(device);
+    for (auto& [key, members] : groups) {
+        std::stable_sort(members.begin(), members.end(), [](Transient* a, Transient* b) { return a->requirements.size > b->requirements.size; });
+
+        auto overlap_in_time = [](Transient* a, Transient* b) { return a->first_level <= b->last_level && b->first_level <= a->last_level; };
+        auto overlap_in_memory = [](Transient* a, Transient* b) { return a->offset < b->offset + b->requirements.size && b->offset < a->offset + a->requirements.size; };
+
+        std::vector<Transient*> placed;
+        VkDeviceSize heap_size = 0;
+        for (auto transient : members) {
+            std::vector<std::tuple<VkDeviceSize, VkDeviceSize>> taken;
+            for (auto other : placed) {
+                if (overlap_in_time(transient, other))
+                    taken.emplace_back(other->offset, other->offset + other->requirements.size);
+            }
+            std::sort(taken.begin(), taken.end());
+
+            VkDeviceSize offset = 0;
+            for (auto [begin, end] : taken) {
+                offset = align_up(offset, transient->requirements.alignment);
+                if (offset + transient->requirements.size <= begin)
+                    break;
+                offset = std::max(offset, end);
+            }
+            transient->offset = align_up(offset, transient->requirements.alignment);
+            heap_size = std::max(heap_size, transient->offset + transient->requirements.size);
+            placed.push_back(transient);
+        }
+
+        auto heap = heaps.emplace_back(transient_heaps.acquire(heap_size, std::get<0>(key), std::get<1>(key)));
+        VmaAllocationInfo heap_info;
+        vmaGetAllocationInfo(device._impl->allocator, heap.allocation, &heap_info);
+        for (auto transient : members) {
+            if (transient->image) {
+                CHECK_VK_THROW(vmaBindImageMemory2(device._impl->allocator, heap.allocation, transient->offset, transient->image->handle(), nullptr));
+            } else {
+                CHECK_VK_THROW(vmaBindBufferMemory2(device._impl->allocator, heap.allocation, transient->offset, transient->buffer->handle, nullptr));
+                transient->buffer->memory = heap_info.deviceMemory;
+                transient->buffer->memory_offset = heap_info.offset + transient->offset;
+            }
+            for (auto other : members) {
+                if (other != transient && other->last_level < transient->first_level && overlap_in_memory(transient, other))
+                    transient->aliases.push_back(other->handle);
+            }
+        }
+    }
+}
+
+/// The frame owns the transients from now on, their memory goes back to the heaps once the GPU is done with the frame
+void RenderGraph::Impl::retire_transients() {
+    struct Retired {
+        std::vector<Transient> transients;
+        std::vector<TransientHeaps::Heap> heaps;
+    };
+    auto retired = std::make_shared<Retired>(std::move(transients), std::move(heaps));
+    transients.clear();
+    heaps.clear();
+    if (retired->heaps.empty())
+        return;
+
+    Device& device = this->device;
+    frame->addCleanupAction([&device, retired]() {
+        retired->transients.clear();
+        for (auto& heap : retired->heaps)
+            device._impl->transient_heaps(device).release(heap);
+    });
+}
+
+/// Barriers for one level, merged so there's a single vkCmdPipelineBarrier2 for all of them
+struct BarrierBatch {
+    std::vector<VkImageMemoryBarrier2> image_barriers;
+    std::unordered_map<uint64_t, size_t> image_barrier_index;
+    /// Buffers get a global memory barrier, per-buffer barriers don't buy anything on current drivers
+    std::optional<VkMemoryBarrier2> memory_barrier;
+
+    void add(Image* image, Hazard hazard) {
+        if (!image) {
+            if (!memory_barrier)
+                memory_barrier = { .sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER_2 };
+            memory_barrier->srcStageMask |= hazard.src_stage;
+            memory_barrier->srcAccessMask |= hazard.src_access;
+            memory_barrier->dstStageMask |= hazard.dst_stage;
+            memory_barrier->dstAccessMask |= hazard.dst_access;
+            return;
+        }
+
+        auto handle = reinterpret_cast<uint64_t>(image->handle());
+        if (auto found = image_barrier_index.find(handle); found != image_barrier_index.end()) {
+            // Only reads in the same layout can share a level, so the layouts always agree here
+            auto& barrier = image_barriers[found->second];
+            barrier.srcStageMask |= hazard.src_stage;
+            barrier.srcAccessMask |= hazard.src_access;
+            barrier.dstStageMask |= hazard.dst_stage;
+            barrier.dstAccessMask |= hazard.dst_access;
+            return;
+        }
+        image_barrier_index[handle] = image_barriers.size();
+        image_barriers.push_back({
+            .sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER_2,
+            .srcStageMask = hazard.src_stage,
+            .srcAccessMask = hazard.src_access,
+            .dstStageMask = hazard.dst_stage,
+            .dstAccessMask = hazard.dst_access,
+            .oldLayout = hazard.old_layout,
+            .newLayout = hazard.new_layout,
+            .image = image->handle(),
+            .subresourceRange = image->whole_image_subresource_range(),
+        });
+    }
+
+    void record(Device& device, VkCommandBuffer cmdbuf) {
+        if (image_barriers.empty() && !memory_barrier)
+            return;
+        device.dispatch.cmdPipelineBarrier2KHR(cmdbuf, tmpPtr<VkDependencyInfo>({
+            .sType = VK_STRUCTURE_TYPE_DEPENDENCY_INFO,
+            .memoryBarrierCount = memory_barrier ? 1u : 0u,
+            .pMemoryBarriers = memory_barrier ? &*memory_barrier : nullptr,
+            .imageMemoryBarrierCount = static_cast<uint32_t>(image_barriers.size()),
+            .pImageMemoryBarriers = image_barriers.data(),
+        }));
+    }
+};
+
+void RenderGraph::profile(GpuProfiler& profiler) {
+    _impl->profiler = &profiler;
+}
+
+void RenderGraph::execute(VkCommandBuffer cmdbuf) {
+    _impl->gather_resources();
+    _impl->build_dependencies();
+    _impl->cull();
+    size_t levels = _impl->assign_levels();
+
+    std::vector<std::vector<Pass::Impl*>> scheduled(levels);
+    for (auto& pass : _impl->passes) {
+        if (pass->_impl->used)
+            scheduled[pass->_impl->level].push_back(&*pass->_impl);
+    }
+    _impl->allocate_transients(scheduled);
+
+    std::unordered_map<uint64_t, Impl::Transient*> transients;
+    for (auto& transient : _impl->transients)
+        transients[transient.handle] = &transient;
+
+    for (auto& level : scheduled) {
+        BarrierBatch batch;
+        for (auto pass : level) {
+            for (auto& access : pass->accesses) {
+                // Lets later uploads and downloads wait for this frame only
+                if (access.buffer && _impl->frame)
+                    _impl->frame->markUsed(*access.buffer);
+
+                // The memory of a transient is only free once whatever was there before is done with it
+                Hazard alias_hazard = { VK_PIPELINE_STAGE_2_NONE, VK_ACCESS_2_NONE, access.stage, access.access };
+                if (auto found = transients.find(access.handle); found != transients.end()) {
+                    for (auto alias : found->second->aliases) {
+                        auto& previous = _impl->resources[alias].state;
+                        alias_hazard.src_stage |= previous.write_stages | previous.read_stages;
+                        alias_hazard.src_access |= previous.write_access;
+                    }
+                    found->second->aliases.clear();
+                }
+
+                auto& state = _impl->resources[access.handle].state;
+                auto hazard = state.access(access.image != nullptr, access.stage, access.access, access.layout, access.write);
+                // Barriers in one batch aren't ordered, so an image's layout transition has to wait on the aliases itself
+                if (hazard && access.image) {
+                    hazard->src_stage |= alias_hazard.src_stage;
+                    hazard->src_access |= alias_hazard.src_access;
+                } else if (alias_hazard.src_stage != VK_PIPELINE_STAGE_2_NONE) {
+                    batch.add(nullptr, alias_hazard);
+                }
+                if (hazard)
+                    batch.add(access.image, *hazard);
+            }
+        }
+        batch.record(_impl->device, cmdbuf);
+
+        for (auto pass : level) {
+            if (_impl->profiler && _impl->frame) {
+                uint32_t scope = _impl->profiler->begin(*_impl->frame, cmdbuf, pass->name);
+                pass->record(cmdbuf);
+                _impl->profiler->end(*_impl->frame, cmdbuf, scope);
+            } else {
+                pass->record(cmdbuf);
+            }
+        }
+    }
+
+    // Leave the exported resources the way they were asked for
+    BarrierBatch batch;
+    for (auto& [handle, resource] : _impl->resources) {
+        if (!resource.exported)
+            continue;
+        if (auto hazard = resource.state.access(resource.image != nullptr, resource.final_stage, resource.final_access, resource.final_layout, false))
+            batch.add(resource.image, *hazard);
+    }
+    batch.record(_impl->device, cmdbuf);
+
+    // So whatever gets recorded after the graph knows where the images were left
+    for (auto& [handle, resource] : _impl->resources) {
+        if (resource.image)
+            resource.image->_impl->subresources.assign(resource.image->_impl->subresources.size(), resource.state);
+    }
+
+    _impl->retire_transients();
+}
+
+}
@@ -1,4 +1,4 @@
-#include "imr/imr.h"
+#include "swapchain_private.h"
 
 namespace imr {
 
@@ -31,90 +31,87 @@ void Swapchain::renderFrameSimplified(std::function<void(SimplifiedRenderContext
         auto& image = frame.image();
 
         // Allocate and begin recording a command buffer
-        VkCommandBuffer cmdbuf;
-        vkAllocateCommandBuffers(device.device, tmpPtr<VkCommandBufferAllocateInfo>({
-            .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
-            .commandPool = device.pool,
-            .level = VK_COMMAND_BUFFER_LEVEL_PRIMARY,
-            .commandBufferCount = 1,
-        }), &cmdbuf);
+        VkCommandBuffer cmdbuf = frame.allocateCommandBuffer();
         vkBeginCommandBuffer(cmdbuf, tmpPtr<VkCommandBufferBeginInfo>({
             .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
             .flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT,
         }));
+        // Brackets everything this frame does on the GPU, for the frame pacer
+        frame._impl->context.write_timestamp(cmdbuf, VK_PIPELINE_STAGE_2_TOP_OF_PIPE_BIT, 0);
 
-        // This barrier transitions the image from an unknown state into the "general" layout so we can render to it.
-        // before the barrier: nothing relevant happens
-        // after the barrier: all writes from any pipeline stage
-        vk.cmdPipelineBarrier2KHR(cmdbuf, tmpPtr<VkDependencyInfo>({
-            .sType = VK_STRUCTURE_TYPE_DEPENDENCY_INFO,
-            .dependencyFlags = 0,
-            .imageMemoryBarrierCount = 1,
-            .pImageMemoryBarriers = tmpPtr<VkImageMemoryBarrier2>({
-                .sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER_2,
-                .srcStageMask = VK_PIPELINE_STAGE_2_BOTTOM_OF_PIPE_BIT,
-                .srcAccessMask = VK_ACCESS_2_NONE,
-                .dstStageMask = VK_PIPELINE_STAGE_ALL_COMMANDS_BIT,
-                .dstAccessMask = VK_ACCESS_2_MEMORY_WRITE_BIT,
-                .oldLayout = VK_IMAGE_LAYOUT_UNDEFINED,
-                .newLayout = VK_IMAGE_LAYOUT_GENERAL,
-                .image = image.handle(),
-                .subresourceRange = image.whole_image_subresource_range(),
-            }),
-        }));
+        // The previous contents are gone once the image gets acquired again.
+        // Transition it into the "general" layout so we can render to it, as if any stage wrote to it: whatever the user code records without going through the tracker is covered at the end
+        image.assumeState(VK_IMAGE_LAYOUT_UNDEFINED);
+        image.transition(cmdbuf, VK_IMAGE_LAYOUT_GENERAL, VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT, VK_ACCESS_2_MEMORY_READ_BIT | VK_ACCESS_2_MEMORY_WRITE_BIT);
 
         // Run user code
         SimplifiedRenderContextImpl context(frame, cmdbuf);
         fn(context);
 
-        // This barrier transitions the image from the "general" layout into the "present src" layout so it can be shown
-        // before the barrier: all writes from any pipeline stage
-        // after the barrier: all reads from the present stage
-        vk.cmdPipelineBarrier2KHR(cmdbuf, tmpPtr<VkDependencyInfo>({
-            .sType = VK_STRUCTURE_TYPE_DEPENDENCY_INFO,
-            .dependencyFlags = 0,
-            .imageMemoryBarrierCount = 1,
-            .pImageMemoryBarriers = tmpPtr<VkImageMemoryBarrier2>({
-                .sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER_2,
-                .srcStageMask = VK_PIPELINE_STAGE_ALL_COMMANDS_BIT,
-                .srcAccessMask = VK_ACCESS_MEMORY_WRITE_BIT,
-                .dstStageMask = VK_PIPELINE_STAGE_ALL_COMMANDS_BIT,
-                .dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT,
-                .oldLayout = VK_IMAGE_LAYOUT_GENERAL,
-                .newLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR,
-                .image = image.handle(),
-                .subresourceRange = image.whole_image_subresource_range()
-            }),
-        }));
+        // Transition the image into the "present src" layout so it can be shown, waiting on whatever the tracker saw last.
+        // Offscreen images stay where they are, the readback transitions them from there.
+        if (!_impl->offscreen())
+            image.transition(cmdbuf, VK_IMAGE_LAYOUT_PRESENT_SRC_KHR, VK_PIPELINE_STAGE_2_NONE, VK_ACCESS_2_NONE);
+
+        frame._impl->context.write_timestamp(cmdbuf, VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT, 1);
 
-        // Create a fence so we can track the execution of the cmdbuf
-        VkFence fence;
-        vkCreateFence(device.device, tmpPtr<VkFenceCreateInfo>({
-            .sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO,
-            .flags = 0,
-        }), nullptr, &fence);
+        // Async work recorded so far (e.g. uploads) goes to the GPU before this frame
+        std::unique_lock lock(device._impl->submission_mutex);
+        uint64_t timeline_value = device._impl->reserve_submission(device);
+        frame._impl->set_timeline_value(timeline_value);
 
-        // Finish the cmdbuf and submit it to the GPU, and pass the fence so we're notified when it's done
-        // before: wait on the swapchain image to be available
-        // after: notify the swapchain that the image can be shown
+        // Finish the cmdbuf and submit it to the GPU
+        // before: wait on the swapchain image to be available, and on all the async work submitted so far
+        // after: notify the swapchain that the image can be shown, and advance the device timeline so we know when the frame is done
         vkEndCommandBuffer(cmdbuf);
-        vkQueueSubmit(device.main_queue, 1, tmpPtr<VkSubmitInfo>({
-            .sType = VK_STRUCTURE_TYPE_SUBMIT_INFO,
-            .waitSemaphoreCount = 1,
-            .pWaitSemaphores = &frame.swapchain_image_available,
-            .pWaitDstStageMask = tmpPtr((VkPipelineStageFlags) VK_PIPELINE_STAGE_2_TOP_OF_PIPE_BIT),
-            .commandBufferCount = 1,
-            .pCommandBuffers = &cmdbuf,
-            .signalSemaphoreCount = 1,
-            .pSignalSemaphores = &frame.signal_when_ready,
-        }), fence);
-
-        // cleanup those objects once the cmdbuf has executed
-        frame.addCleanupFence(fence);
-        frame.addCleanupAction([=, &device]() {
-            vkDestroyFence(device.device, fence, nullptr);
-            vkFreeCommandBuffers(device.device, device.pool, 1, &cmdbuf);
+        std::vector<VkSemaphoreSubmitInfo> waits;
+        if (frame.swapchain_image_available != VK_NULL_HANDLE) {
+            waits.push_back({
+                .sType = VK_STRUCTURE_TYPE_SEMAPHORE_SUBMIT_INFO,
+                .semaphore = frame.swapchain_image_available,
+                .stageMask = VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT,
+            });
+        }
+        // Earlier frames don't need an explicit wait, they are ordered by the queue like before
+        for (auto& state : device._impl->queue_states) {
+            if (state->last_batch_submitted == 0)
+                continue;
+            waits.push_back({
+                .sType = VK_STRUCTURE_TYPE_SEMAPHORE_SUBMIT_INFO,
+                .semaphore = state->timeline,
+                .value = state->last_batch_submitted,
+                .stageMask = VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT,
+            });
+        }
+        std::vector<VkSemaphoreSubmitInfo> signals;
+        if (frame.signal_when_ready != VK_NULL_HANDLE) {
+            signals.push_back({
+                .sType = VK_STRUCTURE_TYPE_SEMAPHORE_SUBMIT_INFO,
+                .semaphore = frame.signal_when_ready,
+                .stageMask = VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT,
+            });
+        }
+        signals.push_back({
+            .sType = VK_STRUCTURE_TYPE_SEMAPHORE_SUBMIT_INFO,
+            .semaphore = device._impl->queue(Device::Queue::Main).timeline,
+            .value = timeline_value,
+            .stageMask = VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT,
         });
+        std::unique_lock handle_lock(device._impl->queue(Device::Queue::Main).handle_mutex);
+        CHECK_VK_THROW(vk.queueSubmit2KHR(device.main_queue, 1, tmpPtr<VkSubmitInfo2>({
+            .sType = VK_STRUCTURE_TYPE_SUBMIT_INFO_2,
+            .waitSemaphoreInfoCount = static_cast<uint32_t>(waits.size()),
+            .pWaitSemaphoreInfos = waits.data(),
+            .commandBufferInfoCount = 1,
+            .pCommandBufferInfos = tmpPtr<VkCommandBufferSubmitInfo>({
+                .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_SUBMIT_INFO,
+                .commandBuffer = cmdbuf,
+            }),
+            .signalSemaphoreInfoCount = static_cast<uint32_t>(signals.size()),
+            .pSignalSemaphoreInfos = signals.data(),
+        }), VK_NULL_HANDLE));
+        handle_lock.unlock();
+        lock.unlock();
 
         frame.queuePresent();
     });
@@ -3,8 +3,6 @@
 namespace imr {
 
 void Swapchain::Frame::withRenderTargets(VkCommandBuffer cmdbuf, std::vector<Image*> color_images, Image* depth, std::function<void()> f) {
-    auto& device = _impl->slot.swapchain._impl->device;
-
     std::vector<VkImageView> color_views;
     color_views.resize(color_images.size());
     size_t i = 0;
@@ -19,38 +17,21 @@ void Swapchain::Frame::withRenderTargets(VkCommandBuffer cmdbuf, std::vector<Ima
         }
     };
 
-    for (auto color_image : color_images) {
-        vkCreateImageView(device.device, tmpPtr<VkImageViewCreateInfo>({
-            .sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO,
-            .image = color_image->handle(),
-            .viewType = VK_IMAGE_VIEW_TYPE_2D,
-            .format = color_image->format(),
-            .subresourceRange = color_image->whole_image_subresource_range(),
-        }), nullptr, &color_views.data()[i]);
+    for (auto color_image : color_images)
+        color_image->transition(cmdbuf, VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL, VK_PIPELINE_STAGE_2_COLOR_ATTACHMENT_OUTPUT_BIT, VK_ACCESS_2_COLOR_ATTACHMENT_READ_BIT | VK_ACCESS_2_COLOR_ATTACHMENT_WRITE_BIT);
+    if (depth)
+        depth->transition(cmdbuf, VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL, VK_PIPELINE_STAGE_2_EARLY_FRAGMENT_TESTS_BIT | VK_PIPELINE_STAGE_2_LATE_FRAGMENT_TESTS_BIT, VK_ACCESS_2_DEPTH_STENCIL_ATTACHMENT_READ_BIT | VK_ACCESS_2_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT);
 
+    // The views are cached by the images, so they don't need to be cleaned up
+    for (auto color_image : color_images) {
+        color_views[i++] = color_image->mip_view(0);
         set_size(color_image->size());
-
-        addCleanupAction([=,&device]() {
-            vkDestroyImageView(device.device, color_views.data()[i], nullptr);
-        });
-        i++;
     }
 
     VkImageView depth_view = VK_NULL_HANDLE;
     if (depth) {
-        vkCreateImageView(device.device, tmpPtr<VkImageViewCreateInfo>({
-            .sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO,
-            .image = depth->handle(),
-            .viewType = VK_IMAGE_VIEW_TYPE_2D,
-            .format = depth->format(),
-            .subresourceRange = depth->whole_image_subresource_range(),
-        }), nullptr, &depth_view);
-
+        depth_view = depth->mip_view(0);
         set_size(depth->size());
-
-        addCleanupAction([=, &device]() {
-            vkDestroyImageView(device.device, depth_view, nullptr);
-        });
     }
 
     assert(size);
@@ -62,7 +43,7 @@ void Swapchain::Frame::withRenderTargets(VkCommandBuffer cmdbuf, std::vector<Ima
         color_attachments.push_back({
             .sType = VK_STRUCTURE_TYPE_RENDERING_ATTACHMENT_INFO,
             .imageView = color_view,
-            .imageLayout = VK_IMAGE_LAYOUT_GENERAL,
+            .imageLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL,
             .loadOp = VK_ATTACHMENT_LOAD_OP_LOAD,
             .storeOp = VK_ATTACHMENT_STORE_OP_STORE,
         });
@@ -71,7 +52,7 @@ void Swapchain::Frame::withRenderTargets(VkCommandBuffer cmdbuf, std::vector<Ima
     VkRenderingAttachmentInfo depth_attachment = {
         .sType = VK_STRUCTURE_TYPE_RENDERING_ATTACHMENT_INFO,
         .imageView = depth_view,
-        .imageLayout = VK_IMAGE_LAYOUT_GENERAL,
+        .imageLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL,
         .loadOp = VK_ATTACHMENT_LOAD_OP_LOAD,
         .storeOp = VK_ATTACHMENT_STORE_OP_STORE,
     };
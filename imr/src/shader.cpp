@@ -13,30 +13,18 @@ extern "C" {
 
 }
 
-#include <filesystem>
-
 namespace imr {
 
-SPIRVModule load_spirv_module(const std::string& filename) {
-    size_t size;
-    uint32_t* data;
-    const char* loc = imr_get_executable_location();
-    if (!imr_read_file((std::filesystem::path(loc).parent_path().string() + "/" + filename).c_str(), &size, (unsigned char**) &data))
-        throw std::runtime_error("Failed to read " + filename);
-    SPIRVModule module;
-    module.resize(size / 4);
-    memcpy(module.data(), data, size);
-    free(data);
-    free((char*) loc);
-    return module;
-}
+/// Shady doesn't document its parser or arenas as thread-safe, and pipelines get created from several threads (see PipelineBuilder)
+static std::mutex shady_mutex;
 
 ReflectedLayout::ReflectedLayout(imr::SPIRVModule& spirv_module, VkShaderStageFlags stage) : stages(stage) {
+    std::lock_guard guard(shady_mutex);
     auto config = shd_default_compiler_config();
     auto target = shd_default_target_config();
 
     Module* module = nullptr;
-    auto parse_result = shd_parse_spirv(&config, &target, spirv_module.size() * 4, reinterpret_cast<char*>(spirv_module.data()), "imr_module_name_doesnt_matter", &module);
+    auto parse_result = shd_parse_spirv(&config, &target, spirv_module.size() * 4, reinterpret_cast<const char*>(spirv_module.data()), "imr_module_name_doesnt_matter", &module);
     assert(parse_result == S2S_Success);
 
     auto globals = shd_module_collect_reachable_globals(module);
@@ -125,6 +113,18 @@ ReflectedLayout::ReflectedLayout(imr::SPIRVModule& spirv_module, VkShaderStageFl
     shd_destroy_ir_arena(a);
 }
 
+ReflectedLayout ReflectedLayout::for_stage(VkShaderStageFlags stage) const {
+    ReflectedLayout layout = *this;
+    layout.stages = stage;
+    for (auto& [set, bindings] : layout.set_bindings) {
+        for (auto& binding : bindings)
+            binding.stageFlags = stage;
+    }
+    for (auto& range : layout.push_constants)
+        range.stageFlags = stage;
+    return layout;
+}
+
 ReflectedLayout::ReflectedLayout(imr::ReflectedLayout& a, imr::ReflectedLayout& b) : push_constants(a.push_constants), set_bindings(a.set_bindings), stages(a.stages | b.stages) {
     if ((a.stages & b.stages) != 0)
         throw std::runtime_error("Overlap in stages");
@@ -156,7 +156,10 @@ ReflectedLayout::ReflectedLayout(imr::ReflectedLayout& a, imr::ReflectedLayout&
     }
 }
 
-PipelineLayout::PipelineLayout(imr::Device& device, imr::ReflectedLayout& reflected_layout) : device(device) {
+PipelineLayout::PipelineLayout(imr::Device& device, imr::ReflectedLayout& reflected_layout, std::optional<unsigned> push_set) : device(device), push_set(push_set) {
+    if (push_set && !device._impl->push_descriptors_supported)
+        throw std::runtime_error("Error: push descriptors requested but VK_KHR_push_descriptor is not available");
+
     int max_set = 0;
     for (auto& [set, value] : reflected_layout.set_bindings) {
         if (set > max_set)
@@ -168,9 +171,13 @@ PipelineLayout::PipelineLayout(imr::Device& device, imr::ReflectedLayout& reflec
         auto& bindings = reflected_layout.set_bindings[set];
         std::vector<VkDescriptorBindingFlags> flags;
         flags.resize(bindings.size());
+        bool push = push_set == set;
         for (auto binding : bindings) {
-            if (binding.descriptorCount == 0)
+            if (binding.descriptorCount == 0) {
+                if (push)
+                    throw std::runtime_error("Error: push descriptor sets cannot contain variable-sized bindings");
                 flags[binding.binding] |= VK_DESCRIPTOR_BINDING_VARIABLE_DESCRIPTOR_COUNT_BIT_EXT;
+            }
         }
 
         VkDescriptorSetLayoutBindingFlagsCreateInfo flags_for_bindings_info = {
@@ -182,6 +189,7 @@ PipelineLayout::PipelineLayout(imr::Device& device, imr::ReflectedLayout& reflec
         CHECK_VK_THROW(vkCreateDescriptorSetLayout(device.device, tmpPtr<VkDescriptorSetLayoutCreateInfo>({
             .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO,
             .pNext = &flags_for_bindings_info,
+            .flags = push ? (VkDescriptorSetLayoutCreateFlags) VK_DESCRIPTOR_SET_LAYOUT_CREATE_PUSH_DESCRIPTOR_BIT_KHR : 0,
             .bindingCount = static_cast<uint32_t>(bindings.size()),
             .pBindings = bindings.data(),
         }), nullptr, &set_layouts[set]));
@@ -198,23 +206,33 @@ PipelineLayout::PipelineLayout(imr::Device& device, imr::ReflectedLayout& reflec
 
 PipelineLayout::~PipelineLayout() {
     vkDestroyPipelineLayout(device.device, pipeline_layout, nullptr);
-    for (auto set_layout : set_layouts)
+    for (auto set_layout : set_layouts) {
+        device._impl->descriptors->evict_layout(set_layout);
         vkDestroyDescriptorSetLayout(device.device, set_layout, nullptr);
+    }
 }
 
 ShaderModule::ShaderModule(imr::Device& device, std::string&& spirv_filename) noexcept(false) {
-    auto spirv_module = load_spirv_module(spirv_filename);
-    _impl = std::make_unique<Impl>(device, std::move(spirv_module));
+    // Unmapped as soon as the module is created and reflected
+    _impl = std::make_unique<Impl>(device, load_spirv_module(spirv_filename));
 }
 
-ShaderModule::Impl::Impl(imr::Device& device, imr::SPIRVModule&& spirv_module) noexcept(false) : device(device), spirv_module(std::move(spirv_module)) {
-    assert(this->spirv_module.size() > 0);
+ShaderModule::ShaderModule(std::unique_ptr<Impl>&& impl) : _impl(std::move(impl)) {}
+
+ShaderModule::Impl::Impl(imr::Device& device, imr::SPIRVModule&& spirv_module) noexcept(false) : device(device) {
+    assert(spirv_module.size() > 0);
     CHECK_VK(vkCreateShaderModule(device.device, tmpPtr<VkShaderModuleCreateInfo>({
             .sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO,
             .flags = 0,
-            .codeSize = this->spirv_module.size() * 4,
-            .pCode = this->spirv_module.data(),
+            .codeSize = spirv_module.size() * 4,
+            .pCode = spirv_module.data(),
     }), nullptr, &vk_shader_module), throw std::runtime_error("Failed to build shader module"));
+    try {
+        reflected = reflect_spirv_module(spirv_module);
+    } catch (...) {
+        vkDestroyShaderModule(device.device, vk_shader_module, nullptr);
+        throw;
+    }
 }
 
 VkShaderModule ShaderModule::vk_shader_module() const { return _impl->vk_shader_module; }
@@ -230,7 +248,7 @@ ShaderEntryPoint::ShaderEntryPoint(imr::ShaderModule& module, VkShaderStageFlagB
 }
 
 ShaderEntryPoint::Impl::Impl(imr::ShaderModule& module, VkShaderStageFlagBits stage, const std::string& name) : module(module), stage(stage), name(name) {
-    reflected = std::make_unique<ReflectedLayout>(module._impl->spirv_module, stage);
+    reflected = std::make_unique<ReflectedLayout>(module._impl->reflected.for_stage(stage));
 }
 
 const std::string& ShaderEntryPoint::name() const { return _impl->name; }
@@ -243,11 +261,11 @@ ShaderEntryPoint::Impl::~Impl() = default;
 
 ShaderEntryPoint::~ShaderEntryPoint() = default;
 
-ComputePipeline::Impl::Impl(imr::Device& device, imr::ShaderEntryPoint& entry_point) : device(device) {
-    layout = std::make_unique<PipelineLayout>(device, *entry_point._impl->reflected);
+ComputePipeline::Impl::Impl(imr::Device& device, imr::ShaderEntryPoint& entry_point, bool push_descriptors) : device(device) {
+    layout = std::make_unique<PipelineLayout>(device, *entry_point._impl->reflected, push_descriptors ? std::optional<unsigned>(0) : std::nullopt);
 
     pipeline = VK_NULL_HANDLE;
-    CHECK_VK_THROW(vkCreateComputePipelines(device.device, VK_NULL_HANDLE, 1, tmpPtr<VkComputePipelineCreateInfo>({
+    CHECK_VK_THROW(vkCreateComputePipelines(device.device, device._impl->pipeline_cache, 1, tmpPtr<VkComputePipelineCreateInfo>({
             .sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO,
             .flags = 0,
             .stage = {
@@ -261,16 +279,24 @@ ComputePipeline::Impl::Impl(imr::Device& device, imr::ShaderEntryPoint& entry_po
     }), nullptr, &pipeline));
 }
 
-ComputePipeline::Impl::Impl(imr::Device& device, std::unique_ptr<ShaderModule>&& module, std::unique_ptr<ShaderEntryPoint>&& ep) : Impl(device, *ep) {
+ComputePipeline::Impl::Impl(imr::Device& device, std::unique_ptr<ShaderModule>&& module, std::unique_ptr<ShaderEntryPoint>&& ep, bool push_descriptors) : Impl(device, *ep, push_descriptors) {
     this->module = std::move(module);
     this->entry_point = std::move(ep);
     assert(this->module && this->entry_point);
 }
 
-ComputePipeline::ComputePipeline(imr::Device& device, std::string&& spirv_filename, std::string&& entrypoint_name) {
+ComputePipeline::ComputePipeline(imr::Device& device, std::string&& spirv_filename, std::string&& entrypoint_name, bool push_descriptors) {
     auto shader_module = std::make_unique<ShaderModule>(device, std::move(spirv_filename));
     auto entry_point = std::make_unique<ShaderEntryPoint>(*shader_module, VK_SHADER_STAGE_COMPUTE_BIT, entrypoint_name);
-    _impl = std::make_unique<ComputePipeline::Impl>(device, std::move(shader_module), std::move(entry_point));
+    _impl = std::make_unique<ComputePipeline::Impl>(device, std::move(shader_module), std::move(entry_point), push_descriptors);
+}
+
+ComputePipeline::ComputePipeline(std::unique_ptr<Impl>&& impl) : _impl(std::move(impl)) {}
+
+std::unique_ptr<ComputePipeline> make_compute_pipeline(imr::Device& device, SPIRVModule&& spirv_module, const std::string& entrypoint_name) {
+    auto shader_module = std::make_unique<ShaderModule>(std::make_unique<ShaderModule::Impl>(device, std::move(spirv_module)));
+    auto entry_point = std::make_unique<ShaderEntryPoint>(*shader_module, VK_SHADER_STAGE_COMPUTE_BIT, entrypoint_name);
+    return std::make_unique<ComputePipeline>(std::make_unique<ComputePipeline::Impl>(device, std::move(shader_module), std::move(entry_point), false));
 }
 
 ComputePipeline::Impl::~Impl() {
@@ -5,9 +5,42 @@
 
 namespace imr {
 
-using SPIRVModule = std::vector<uint32_t>;
+/// SPIR-V words, either mapped straight from a file, owned, or borrowed from static storage (e.g. shaders built into the library)
+struct SPIRVModule {
+    SPIRVModule() = default;
+    explicit SPIRVModule(std::vector<uint32_t>&& words);
+    /// Doesn't copy, the words must outlive the module
+    static SPIRVModule borrow(const uint32_t* words, size_t count);
+    /// Maps the file rather than reading it, throws if it can't be opened or isn't SPIR-V.
+    /// Rewriting the file changes what the mapping reads, and truncating it faults: only keep the module around while it's being consumed.
+    static SPIRVModule map_file(const std::string& path);
+
+    SPIRVModule(const SPIRVModule&) = delete;
+    SPIRVModule(SPIRVModule&&) noexcept;
+    SPIRVModule& operator=(SPIRVModule&&) noexcept;
+    ~SPIRVModule();
+
+    const uint32_t* data() const { return words; }
+    /// In words
+    size_t size() const { return count; }
+    const uint32_t* begin() const { return words; }
+    const uint32_t* end() const { return words + count; }
+
+private:
+    const uint32_t* words = nullptr;
+    size_t count = 0;
+    std::vector<uint32_t> owned;
+    /// Set when words points into a mapping of mapping_size bytes
+    void* mapping = nullptr;
+    size_t mapping_size = 0;
+};
+
+/// Looks the file up in the shader search paths (next to the executable by default), see ShaderModule::add_search_path
 SPIRVModule load_spirv_module(const std::string& filename);
 
+/// For shaders built into the library rather than loaded from next to the executable
+std::unique_ptr<ComputePipeline> make_compute_pipeline(Device&, SPIRVModule&&, const std::string& entrypoint_name = "main");
+
 /// Generates set layouts and pipeline layouts from the SPIR-V module by parsing it as a shady module and using the IR inspection API to find bindings and such
 struct ReflectedLayout {
     VkShaderStageFlags stages;
@@ -17,23 +50,32 @@ struct ReflectedLayout {
     ReflectedLayout() = default;
     ReflectedLayout(SPIRVModule& spirv_module, VkShaderStageFlags stage);
     ReflectedLayout(ReflectedLayout& a, ReflectedLayout& b);
+
+    /// Same bindings and push constants, used by stage instead
+    ReflectedLayout for_stage(VkShaderStageFlags stage) const;
 };
 
+/// Memoized version of ReflectedLayout(spirv_module, 0), keyed by a hash of the module contents. Use for_stage() on the result.
+ReflectedLayout reflect_spirv_module(SPIRVModule& spirv_module);
+
 /// Turns the ReflectedLayout into the VkDescriptorSetLayout s and VkPipelineLayout
 struct PipelineLayout {
     imr::Device& device;
 
     std::vector<VkDescriptorSetLayout> set_layouts;
     VkPipelineLayout pipeline_layout;
+    /// At most one set can be a push descriptor set, it has no VkDescriptorSet and is written straight into command buffers
+    std::optional<unsigned> push_set;
 
-    PipelineLayout(imr::Device& device, ReflectedLayout& reflected_layout);
+    PipelineLayout(imr::Device& device, ReflectedLayout& reflected_layout, std::optional<unsigned> push_set = std::nullopt);
     ~PipelineLayout();
 };
 
 struct ShaderModule::Impl {
     imr::Device& device;
-    SPIRVModule spirv_module;
     VkShaderModule vk_shader_module;
+    /// Done right away for no stage in particular, so the words (possibly a mapping of a file that might get rewritten) don't have to be kept around
+    ReflectedLayout reflected;
 
     Impl(imr::Device& device, SPIRVModule&& spirv_module) noexcept(false);
 
@@ -61,13 +103,13 @@ struct ComputePipeline::Impl {
     std::unique_ptr<ShaderModule> module;
     std::unique_ptr<ShaderEntryPoint> entry_point;
 
-    Impl(imr::Device& device, std::unique_ptr<ShaderModule>&& module, std::unique_ptr<ShaderEntryPoint>&& ep);
-    Impl(imr::Device& device, ShaderEntryPoint& entry_point);
+    Impl(imr::Device& device, std::unique_ptr<ShaderModule>&& module, std::unique_ptr<ShaderEntryPoint>&& ep, bool push_descriptors);
+    Impl(imr::Device& device, ShaderEntryPoint& entry_point, bool push_descriptors);
     ~Impl();
 };
 
 struct GraphicsPipeline::Impl {
-    Impl(Device& device, std::vector<ShaderEntryPoint*>&& stages, RenderTargetsState, StateBuilder);
+    Impl(Device& device, std::vector<ShaderEntryPoint*>&& stages, RenderTargetsState, StateBuilder, bool push_descriptors);
 
     ~Impl();
 
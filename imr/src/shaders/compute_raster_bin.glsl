@@ -0,0 +1,110 @@
+#version 450
+#extension GL_EXT_scalar_block_layout : require
+#extension GL_EXT_buffer_reference : require
+
+// Runs twice: once counting how many triangles overlap each tile, and once more (after the scan) writing their ids into the bins
+
+layout(local_size_x = 256, local_size_y = 1, local_size_z = 1) in;
+
+const uint TILE_SIZE = 16;
+
+struct Triangle {
+    vec4 v0;
+    vec4 v1;
+    vec4 v2;
+    vec2 ss_v0;
+    vec2 ss_v1;
+    vec2 ss_v2;
+    vec3 color;
+};
+
+struct Tile {
+    uint count;
+    uint offset;
+};
+
+layout(scalar, buffer_reference) buffer TrianglesBuffer {
+    Triangle triangles[];
+};
+
+layout(scalar, buffer_reference) buffer TilesBuffer {
+    Tile tiles[];
+};
+
+layout(scalar, buffer_reference) buffer BinsBuffer {
+    uint entries[];
+};
+
+layout(scalar, buffer_reference) buffer StatsBuffer {
+    uint bin_entries_needed;
+};
+
+layout(scalar, push_constant) uniform T {
+    TrianglesBuffer triangles_buffer;
+    TilesBuffer tiles_buffer;
+    BinsBuffer bins_buffer;
+    StatsBuffer stats_buffer;
+    uint triangles_count;
+    uint bins_capacity;
+    uvec2 image_size;
+    uvec2 tiles_count;
+    uint write_bins;
+} push_constants;
+
+float cross_2(vec2 a, vec2 b) {
+    return a.x * b.y - a.y * b.x;
+}
+
+// Tiles overlapped by the bounding box of the triangle, as [lo, hi). Empty if it can't cover any pixel.
+void tile_range(Triangle tri, out uvec2 lo, out uvec2 hi) {
+    lo = uvec2(0);
+    hi = uvec2(0);
+
+    // Entirely behind the camera
+    if (tri.v0.w <= 0 && tri.v1.w <= 0 && tri.v2.w <= 0)
+        return;
+
+    vec2 bb_min, bb_max;
+    if (tri.v0.w <= 0 || tri.v1.w <= 0 || tri.v2.w <= 0) {
+        // Crosses the camera plane, the projected vertices don't bound it anymore
+        bb_min = vec2(-1);
+        bb_max = vec2(1);
+    } else {
+        if (cross_2(tri.ss_v1 - tri.ss_v0, tri.ss_v2 - tri.ss_v0) == 0)
+            return;
+        bb_min = min(tri.ss_v0, min(tri.ss_v1, tri.ss_v2));
+        bb_max = max(tri.ss_v0, max(tri.ss_v1, tri.ss_v2));
+    }
+
+    // Pixel p samples the point p / image_size * 2 - 1, see the raster pass
+    vec2 size = vec2(push_constants.image_size);
+    vec2 px_lo = clamp(ceil((bb_min * 0.5 + 0.5) * size), vec2(0), size);
+    vec2 px_hi = clamp(floor((bb_max * 0.5 + 0.5) * size) + 1, vec2(0), size);
+    if (any(greaterThanEqual(px_lo, px_hi)))
+        return;
+
+    lo = uvec2(px_lo) / TILE_SIZE;
+    hi = (uvec2(px_hi) - 1) / TILE_SIZE + 1;
+}
+
+void main() {
+    uint id = gl_GlobalInvocationID.x;
+    if (id >= push_constants.triangles_count)
+        return;
+
+    uvec2 lo, hi;
+    tile_range(push_constants.triangles_buffer.triangles[id], lo, hi);
+
+    for (uint y = lo.y; y < hi.y; y++) {
+        for (uint x = lo.x; x < hi.x; x++) {
+            uint tile = y * push_constants.tiles_count.x + x;
+            uint slot = atomicAdd(push_constants.tiles_buffer.tiles[tile].count, 1);
+            if (push_constants.write_bins != 0) {
+                uint entry = push_constants.tiles_buffer.tiles[tile].offset + slot;
+                // Whatever doesn't fit is dropped, the raster pass clamps the counts accordingly and the scan reported the overflow
+                if (entry < push_constants.bins_capacity)
+                    push_constants.bins_buffer.entries[entry] = id;
+            }
+        }
+    }
+}
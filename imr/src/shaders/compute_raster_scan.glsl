@@ -0,0 +1,76 @@
+#version 450
+#extension GL_EXT_scalar_block_layout : require
+#extension GL_EXT_buffer_reference : require
+
+// Turns the per-tile triangle counts into offsets in the bins, and resets the counts so the second binning pass can use them as cursors.
+// There are only a few thousand tiles, a single workgroup does it.
+
+layout(local_size_x = 256, local_size_y = 1, local_size_z = 1) in;
+
+struct Tile {
+    uint count;
+    uint offset;
+};
+
+layout(scalar, buffer_reference) buffer TrianglesBuffer {
+    uint unused;
+};
+
+layout(scalar, buffer_reference) buffer TilesBuffer {
+    Tile tiles[];
+};
+
+layout(scalar, buffer_reference) buffer BinsBuffer {
+    uint entries[];
+};
+
+layout(scalar, buffer_reference) buffer StatsBuffer {
+    uint bin_entries_needed;
+};
+
+layout(scalar, push_constant) uniform T {
+    TrianglesBuffer triangles_buffer;
+    TilesBuffer tiles_buffer;
+    BinsBuffer bins_buffer;
+    StatsBuffer stats_buffer;
+    uint triangles_count;
+    uint bins_capacity;
+    uvec2 image_size;
+    uvec2 tiles_count;
+    uint write_bins;
+} push_constants;
+
+shared uint partial_sums[gl_WorkGroupSize.x];
+
+void main() {
+    uint tiles = push_constants.tiles_count.x * push_constants.tiles_count.y;
+    uint per_invocation = (tiles + gl_WorkGroupSize.x - 1) / gl_WorkGroupSize.x;
+    uint begin = min(gl_LocalInvocationIndex * per_invocation, tiles);
+    uint end = min(begin + per_invocation, tiles);
+
+    uint sum = 0;
+    for (uint i = begin; i < end; i++)
+        sum += push_constants.tiles_buffer.tiles[i].count;
+    partial_sums[gl_LocalInvocationIndex] = sum;
+    barrier();
+
+    // Inclusive scan of the partial sums
+    for (uint stride = 1; stride < gl_WorkGroupSize.x; stride *= 2) {
+        uint value = gl_LocalInvocationIndex >= stride ? partial_sums[gl_LocalInvocationIndex - stride] : 0;
+        barrier();
+        partial_sums[gl_LocalInvocationIndex] += value;
+        barrier();
+    }
+
+    // The offsets go past the end of the bins when they overflow, let the host know how much room it would have taken
+    if (gl_LocalInvocationIndex == gl_WorkGroupSize.x - 1)
+        atomicMax(push_constants.stats_buffer.bin_entries_needed, partial_sums[gl_LocalInvocationIndex]);
+
+    uint offset = partial_sums[gl_LocalInvocationIndex] - sum;
+    for (uint i = begin; i < end; i++) {
+        uint count = push_constants.tiles_buffer.tiles[i].count;
+        push_constants.tiles_buffer.tiles[i].offset = offset;
+        push_constants.tiles_buffer.tiles[i].count = 0;
+        offset += count;
+    }
+}
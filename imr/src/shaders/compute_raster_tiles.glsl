@@ -0,0 +1,164 @@
+#version 450
+#extension GL_EXT_shader_image_load_formatted : require
+#extension GL_EXT_scalar_block_layout : require
+#extension GL_EXT_buffer_reference : require
+
+// One workgroup per tile, one invocation per pixel. The tile's triangles are loaded into shared memory in batches,
+// and each pixel keeps the closest one in registers: the images are only read and written once.
+
+layout(local_size_x = 16, local_size_y = 16, local_size_z = 1) in;
+
+const uint BATCH_SIZE = 128;
+
+layout(set = 0, binding = 0)
+uniform image2D renderTarget;
+
+layout(set = 0, binding = 1)
+uniform image2D depthBuffer;
+
+struct Triangle {
+    vec4 v0;
+    vec4 v1;
+    vec4 v2;
+    vec2 ss_v0;
+    vec2 ss_v1;
+    vec2 ss_v2;
+    vec3 color;
+};
+
+struct Tile {
+    uint count;
+    uint offset;
+};
+
+layout(scalar, buffer_reference) buffer TrianglesBuffer {
+    Triangle triangles[];
+};
+
+layout(scalar, buffer_reference) buffer TilesBuffer {
+    Tile tiles[];
+};
+
+layout(scalar, buffer_reference) buffer BinsBuffer {
+    uint entries[];
+};
+
+layout(scalar, buffer_reference) buffer StatsBuffer {
+    uint bin_entries_needed;
+};
+
+layout(scalar, push_constant) uniform T {
+    TrianglesBuffer triangles_buffer;
+    TilesBuffer tiles_buffer;
+    BinsBuffer bins_buffer;
+    StatsBuffer stats_buffer;
+    uint triangles_count;
+    uint bins_capacity;
+    uvec2 image_size;
+    uvec2 tiles_count;
+    uint write_bins;
+} push_constants;
+
+shared Triangle batch[BATCH_SIZE];
+shared uint batch_ids[BATCH_SIZE];
+
+float cross_2(vec2 a, vec2 b) {
+    return cross(vec3(a, 0), vec3(b, 0)).z;
+}
+
+float barCoord(vec2 a, vec2 b, vec2 point){
+    vec2 PA = point - a;
+    vec2 BA = b - a;
+    return cross_2(PA, BA);
+}
+
+vec3 barycentricTri2(vec2 v0, vec2 v1, vec2 v2, vec2 point) {
+    float triangleArea = barCoord(v0.xy, v1.xy, v2.xy);
+
+    float u = barCoord(v0.xy, v1.xy, point) / triangleArea;
+    float v = barCoord(v1.xy, v2.xy, point) / triangleArea;
+
+    return vec3(u, v, triangleArea);
+}
+
+bool is_inside_edge(vec2 e0, vec2 e1, vec2 p) {
+    if (e1.x == e0.x)
+        return (e1.x > p.x) ^^ (e0.y > e1.y);
+    float a = (e1.y - e0.y) / (e1.x - e0.x);
+    float b = e0.y + (0 - e0.x) * a;
+    float ey = a * p.x + b;
+    return (ey < p.y) ^^ (e0.x > e1.x);
+}
+
+// Same coverage and depth rules as the compute cube examples
+bool covers(Triangle tri, vec2 point, out float depth) {
+    vec4 v0 = tri.v0;
+    vec4 v1 = tri.v1;
+    vec4 v2 = tri.v2;
+    vec2 ss_v0 = tri.ss_v0;
+    vec2 ss_v1 = tri.ss_v1;
+    vec2 ss_v2 = tri.ss_v2;
+
+    bool backface = (is_inside_edge(ss_v1, ss_v0, point) ^^ (v0.w < 0) ^^ (v1.w < 0)) && (is_inside_edge(ss_v2, ss_v1, point) ^^ (v1.w < 0) ^^ (v2.w < 0)) && (is_inside_edge(ss_v0, ss_v2, point) ^^ (v2.w < 0) ^^ (v0.w < 0));
+    bool frontface = (is_inside_edge(ss_v0, ss_v1, point) ^^ (v0.w < 0) ^^ (v1.w < 0)) && (is_inside_edge(ss_v1, ss_v2, point) ^^ (v1.w < 0) ^^ (v2.w < 0)) && (is_inside_edge(ss_v2, ss_v0, point) ^^ (v2.w < 0) ^^ (v0.w < 0));
+    if (!frontface && !backface)
+        return false;
+
+    vec3 baryResults = barycentricTri2(ss_v0, ss_v1, ss_v2, point);
+    float u = baryResults.x;
+    float v = baryResults.y;
+    float w = 1 - u - v;
+
+    vec3 ss_v_coefs = vec3(v, w, u);
+    depth = dot(ss_v_coefs, vec3(v0.z / v0.w, v1.z / v1.w, v2.z / v2.w));
+    return depth >= 0;
+}
+
+void main() {
+    uint tile = gl_WorkGroupID.y * push_constants.tiles_count.x + gl_WorkGroupID.x;
+    uint offset = push_constants.tiles_buffer.tiles[tile].offset;
+    uint count = push_constants.tiles_buffer.tiles[tile].count;
+    // Entries that didn't fit in the bins were dropped
+    count = offset < push_constants.bins_capacity ? min(count, push_constants.bins_capacity - offset) : 0;
+
+    ivec2 pixel = ivec2(gl_GlobalInvocationID.xy);
+    bool inside = all(lessThan(gl_GlobalInvocationID.xy, push_constants.image_size));
+    vec2 point = vec2(pixel) / vec2(push_constants.image_size);
+    point = point * 2.0 - vec2(1.0);
+
+    const uint NONE = 0xFFFFFFFFu;
+    float closest_depth = inside ? imageLoad(depthBuffer, pixel).x : 0;
+    uint closest = NONE;
+    vec3 color = vec3(0);
+
+    // The bins are filled in no particular order, ties go to the lowest triangle id so the result doesn't flicker
+    for (uint base = 0; base < count; base += BATCH_SIZE) {
+        barrier();
+        uint i = gl_LocalInvocationIndex;
+        if (i < BATCH_SIZE && base + i < count) {
+            uint id = push_constants.bins_buffer.entries[offset + base + i];
+            batch_ids[i] = id;
+            batch[i] = push_constants.triangles_buffer.triangles[id];
+        }
+        barrier();
+
+        if (!inside)
+            continue;
+        uint batch_count = min(BATCH_SIZE, count - base);
+        for (uint j = 0; j < batch_count; j++) {
+            float depth;
+            if (!covers(batch[j], point, depth))
+                continue;
+            if (depth < closest_depth || (depth == closest_depth && closest != NONE && batch_ids[j] < closest)) {
+                closest_depth = depth;
+                closest = batch_ids[j];
+                color = batch[j].color;
+            }
+        }
+    }
+
+    if (inside && closest != NONE) {
+        imageStore(depthBuffer, pixel, vec4(closest_depth));
+        imageStore(renderTarget, pixel, vec4(color, 1));
+    }
+}
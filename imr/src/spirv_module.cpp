@@ -0,0 +1,159 @@
+#include "shader_private.h"
+
+#include "imr/util.h"
+
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <mutex>
+#include <optional>
+
+#ifndef WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace imr {
+
+static constexpr uint32_t SPIRV_MAGIC = 0x07230203;
+static constexpr uint32_t SPIRV_MAGIC_SWAPPED = 0x03022307;
+/// Magic, version, generator, bound and schema
+static constexpr size_t SPIRV_HEADER_WORDS = 5;
+
+/// Catches the usual suspects (wrong file, truncated file, text assembly) before they reach the driver, which tends to crash on them rather than fail
+static void validate_spirv(const std::string& path, const void* data, size_t size) {
+    if (size % 4 != 0 || size < SPIRV_HEADER_WORDS * 4)
+        throw std::runtime_error(path + " is not a SPIR-V module (bad size)");
+    uint32_t header[SPIRV_HEADER_WORDS];
+    memcpy(header, data, sizeof(header));
+    if (header[0] == SPIRV_MAGIC_SWAPPED)
+        throw std::runtime_error(path + " is a SPIR-V module of the wrong endianness");
+    if (header[0] != SPIRV_MAGIC)
+        throw std::runtime_error(path + " is not a SPIR-V module (bad magic)");
+    // 0 | major | minor | 0
+    uint32_t major = (header[1] >> 16) & 0xFF;
+    if (major != 1 || (header[1] & 0xFF0000FF) != 0)
+        throw std::runtime_error(path + " has an unsupported SPIR-V version");
+    if (header[3] == 0)
+        throw std::runtime_error(path + " is not a SPIR-V module (bad id bound)");
+}
+
+SPIRVModule::SPIRVModule(std::vector<uint32_t>&& words) : owned(std::move(words)) {
+    this->words = owned.data();
+    count = owned.size();
+}
+
+SPIRVModule SPIRVModule::borrow(const uint32_t* words, size_t count) {
+    SPIRVModule module;
+    module.words = words;
+    module.count = count;
+    return module;
+}
+
+SPIRVModule::SPIRVModule(SPIRVModule&& other) noexcept {
+    *this = std::move(other);
+}
+
+SPIRVModule& SPIRVModule::operator=(SPIRVModule&& other) noexcept {
+    std::swap(words, other.words);
+    std::swap(count, other.count);
+    // Moving a vector keeps its storage, so words stays valid
+    std::swap(owned, other.owned);
+    std::swap(mapping, other.mapping);
+    std::swap(mapping_size, other.mapping_size);
+    return *this;
+}
+
+SPIRVModule::~SPIRVModule() {
+#ifndef WIN32
+    if (mapping)
+        munmap(mapping, mapping_size);
+#endif
+}
+
+SPIRVModule SPIRVModule::map_file(const std::string& path) {
+    SPIRVModule module;
+#ifdef WIN32
+    // No mapping here, but at least read straight into the words instead of going through a temporary buffer
+    std::ifstream file(path, std::ios::binary | std::ios::ate);
+    if (!file)
+        throw std::runtime_error("Failed to read " + path);
+    auto end = file.tellg();
+    if (end <= 0)
+        throw std::runtime_error("Failed to read " + path);
+    size_t size = end;
+    std::vector<uint32_t> words((size + 3) / 4);
+    file.seekg(0);
+    if (!file.read(reinterpret_cast<char*>(words.data()), size))
+        throw std::runtime_error("Failed to read " + path);
+    validate_spirv(path, words.data(), size);
+    module = SPIRVModule(std::move(words));
+#else
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        throw std::runtime_error("Failed to read " + path);
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        close(fd);
+        throw std::runtime_error("Failed to read " + path);
+    }
+    size_t size = st.st_size;
+    // Private and writable so nothing downstream can scribble on the file, pages only get copied if that actually happens
+    void* mapping = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    // The mapping stays valid without the descriptor
+    close(fd);
+    if (mapping == MAP_FAILED)
+        throw std::runtime_error("Failed to map " + path);
+    module.mapping = mapping;
+    module.mapping_size = size;
+    // Unmapped by the destructor if this throws
+    validate_spirv(path, mapping, size);
+    module.words = static_cast<const uint32_t*>(mapping);
+    module.count = size / 4;
+#endif
+    return module;
+}
+
+/// The executable can't move while we're running, so it's only resolved once.
+/// Relative filenames are looked up again every time, a few stats are nothing next to parsing the module, and files can come and go (e.g. when reloading shaders).
+static struct {
+    std::mutex mutex;
+    std::optional<std::filesystem::path> executable_dir;
+    std::vector<std::filesystem::path> search_paths;
+} shader_paths;
+
+void ShaderModule::add_search_path(std::string directory) {
+    std::lock_guard guard(shader_paths.mutex);
+    shader_paths.search_paths.emplace_back(std::move(directory));
+}
+
+static std::filesystem::path resolve_spirv_path(const std::string& filename) {
+    std::filesystem::path path(filename);
+    if (path.is_absolute())
+        return path;
+
+    std::lock_guard guard(shader_paths.mutex);
+    if (!shader_paths.executable_dir) {
+        const char* loc = imr_get_executable_location();
+        shader_paths.executable_dir = std::filesystem::path(loc).parent_path();
+        free((char*) loc);
+    }
+
+    std::error_code error;
+    auto candidate = *shader_paths.executable_dir / path;
+    for (size_t i = 0; !std::filesystem::is_regular_file(candidate, error) && i < shader_paths.search_paths.size(); i++)
+        candidate = shader_paths.search_paths[i] / path;
+    // Not found anywhere: still try next to the executable so the error names a sensible path
+    if (!std::filesystem::is_regular_file(candidate, error))
+        return *shader_paths.executable_dir / path;
+    return candidate;
+}
+
+SPIRVModule load_spirv_module(const std::string& filename) {
+    return SPIRVModule::map_file(resolve_spirv_path(filename).string());
+}
+
+}
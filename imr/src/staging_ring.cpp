@@ -0,0 +1,160 @@
+#include "imr_private.h"
+
+namespace imr {
+
+/// Big enough for typical per-frame uploads, larger requests fall back to a dedicated staging buffer
+static constexpr size_t DEFAULT_STAGING_RING_SIZE = 32 * 1024 * 1024;
+
+StagingRing& Device::Impl::staging_ring(Device& device) {
+    if (!staging)
+        staging = std::make_unique<StagingRing>(device, DEFAULT_STAGING_RING_SIZE, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
+    return *staging;
+}
+
+StagingRing& Device::Impl::readback_ring(Device& device) {
+    // The host reads from it, uncached memory would make that painfully slow
+    if (!readback)
+        readback = std::make_unique<StagingRing>(device, DEFAULT_STAGING_RING_SIZE, VK_BUFFER_USAGE_TRANSFER_DST_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_CACHED_BIT);
+    return *readback;
+}
+
+StagingRing::StagingRing(Device& device, size_t capacity, VkBufferUsageFlags usage, VkMemoryPropertyFlags memory_property) : device(device), capacity(capacity), usage(usage), memory_property(memory_property) {
+    buffer = std::make_unique<Buffer>(device, capacity, usage, memory_property, true);
+    mapped = buffer->host_ptr<uint8_t>();
+}
+
+std::optional<size_t> StagingRing::try_allocate(size_t size, size_t alignment) {
+    auto align = [&](size_t offset) { return (offset + alignment - 1) / alignment * alignment; };
+
+    if (in_use.empty()) {
+        head = 0;
+        return 0;
+    }
+
+    size_t tail = in_use.front().begin;
+    if (head > tail) {
+        // [tail, head) is in use, try to fit after head, otherwise wrap around
+        size_t begin = align(head);
+        if (begin + size <= capacity)
+            return begin;
+        if (size <= tail)
+            return 0;
+    } else {
+        // we already wrapped around: only [head, tail) is available
+        size_t begin = align(head);
+        if (begin + size <= tail)
+            return begin;
+    }
+    return std::nullopt;
+}
+
+void StagingRing::reclaim() {
+    bool reclaimed = false;
+    while (!in_use.empty()) {
+        auto& front = in_use.front();
+        if (front.host_owned ? !front.released : (front.token.value == 0 || !front.token.done()))
+            break;
+        in_use.pop_front();
+        reclaimed = true;
+    }
+    if (reclaimed)
+        changed.notify_all();
+}
+
+std::optional<StagingRing::Allocation> StagingRing::allocate(size_t size, size_t alignment, bool host_owned) {
+    size = std::max(size, (size_t) 1);
+    if (size > capacity)
+        return std::nullopt;
+
+    std::unique_lock lock(mutex);
+    reclaim();
+    while (true) {
+        if (auto offset = try_allocate(size, alignment)) {
+            in_use.push_back({ *offset, *offset + size, {}, host_owned, false, std::this_thread::get_id() });
+            head = *offset + size;
+            return Allocation { *offset, mapped + *offset };
+        }
+
+        auto& oldest = in_use.front();
+        if (oldest.token.value == 0) {
+            // Nobody else is going to submit our own allocations while we wait, the caller gets a dedicated buffer instead
+            if (oldest.owner == std::this_thread::get_id())
+                return std::nullopt;
+            // Another thread is between allocate() and retire_at()
+            changed.wait(lock);
+        } else {
+            // We're full, wait on the oldest range to be reclaimable.
+            // For host_owned ranges, this runs the continuation that reads them back and releases them.
+            auto token = oldest.token;
+            size_t begin = oldest.begin;
+            // Other threads might be the ones releasing the space, don't keep them out while we wait
+            lock.unlock();
+            token.wait();
+            lock.lock();
+            reclaim();
+            // Done on the GPU but still host_owned: another thread is running the continuation that releases it
+            if (!in_use.empty() && in_use.front().begin == begin && in_use.front().token.value == token.value)
+                changed.wait(lock);
+        }
+        reclaim();
+    }
+}
+
+void StagingRing::retire_at(size_t offset, Device::Token token) {
+    std::lock_guard guard(mutex);
+    // Other threads might have allocated since, so only this exact range gets the token
+    for (auto& range : in_use) {
+        if (range.begin == offset && range.token.value == 0)
+            range.token = token;
+    }
+    changed.notify_all();
+}
+
+void StagingRing::release(size_t offset) {
+    std::lock_guard guard(mutex);
+    for (auto& range : in_use) {
+        if (range.host_owned && range.begin == offset)
+            range.released = true;
+    }
+    reclaim();
+    changed.notify_all();
+}
+
+StagingRing::Staging StagingRing::stage(size_t size, size_t alignment, bool host_owned) {
+    if (auto allocation = allocate(size, alignment, host_owned))
+        return { buffer.get(), allocation->offset, allocation->host_ptr, false, host_owned };
+    auto dedicated = new Buffer(device, size, usage, memory_property, true);
+    return { dedicated, 0, dedicated->host_ptr<uint8_t>(), true, host_owned };
+}
+
+void StagingRing::retire(const Staging& staging, Device::Token token) {
+    if (!staging.dedicated) {
+        retire_at(staging.offset, token);
+    } else if (!staging.host_owned) {
+        Buffer* dedicated = staging.buffer;
+        token.then([=]() { delete dedicated; });
+    }
+}
+
+void StagingRing::release(const Staging& staging) {
+    if (staging.dedicated)
+        delete staging.buffer;
+    else
+        release(staging.offset);
+}
+
+void make_transfers_host_visible(Device& device, VkCommandBuffer cmdbuf) {
+    device.dispatch.cmdPipelineBarrier2KHR(cmdbuf, tmpPtr<VkDependencyInfo>({
+        .sType = VK_STRUCTURE_TYPE_DEPENDENCY_INFO,
+        .memoryBarrierCount = 1,
+        .pMemoryBarriers = tmpPtr<VkMemoryBarrier2>({
+            .sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER_2,
+            .srcStageMask = VK_PIPELINE_STAGE_2_TRANSFER_BIT,
+            .srcAccessMask = VK_ACCESS_2_TRANSFER_WRITE_BIT,
+            .dstStageMask = VK_PIPELINE_STAGE_2_HOST_BIT,
+            .dstAccessMask = VK_ACCESS_2_HOST_READ_BIT,
+        }),
+    }));
+}
+
+}
@@ -11,7 +11,7 @@
 
 namespace imr {
 
-SwapchainSlot::SwapchainSlot(Swapchain& s) : swapchain(s) {
+SwapchainSlot::SwapchainSlot(Swapchain& s, std::unique_ptr<Image>&& wrapped, uint32_t image_index) : swapchain(s), image(wrapped->handle()), image_index(image_index), wrapped_image(std::move(wrapped)) {
     auto& device = s._impl->device;
     auto& vk = device.dispatch;
 
@@ -40,29 +40,53 @@ SwapchainSlot::SwapchainSlot(Swapchain& s) : swapchain(s) {
 
 SwapchainSlot::~SwapchainSlot() {
     auto& device = swapchain._impl->device;
-    if (wait_for_previous_present) {
-        CHECK_VK_THROW(vkWaitForFences(device.device, 1, &wait_for_previous_present, true, UINT64_MAX));
-        vkDestroyFence(device.device, wait_for_previous_present, nullptr);
-        wait_for_previous_present = nullptr;
-    }
     vkDestroySemaphore(device.device, copy_done, nullptr);
     vkDestroySemaphore(device.device, present_semaphore, nullptr);
-    if (wait_for_previous_present)
-        vkDestroyFence(device.device, wait_for_previous_present, nullptr);
 }
 
+FrameContext::FrameContext(Device& device) : device(device) {
+    command_pools = std::make_unique<CommandPoolRegistry>(device, device.main_queue_idx, VK_COMMAND_POOL_CREATE_TRANSIENT_BIT);
+    timestamps = create_timestamp_pool(device, 2);
+}
+
+FrameContext::~FrameContext() {
+    frame.reset();
+    command_pools.reset();
+    if (timestamps)
+        vkDestroyQueryPool(device.device, timestamps, nullptr);
+}
+
+/// Two lets the CPU record a frame while the GPU renders the previous one, more only adds latency
+static constexpr uint32_t DEFAULT_FRAMES_IN_FLIGHT = 2;
+
 Swapchain::Swapchain(Device& device, GLFWwindow* window) {
     auto& vk = device.dispatch;
 
     _impl = std::make_unique<Swapchain::Impl>(*this, device, window);
     _impl->build_swapchain();
+    setFramesInFlight(DEFAULT_FRAMES_IN_FLIGHT);
+}
+
+Swapchain::Swapchain(Device& device, VkExtent2D size, VkFormat format, uint32_t image_count) {
+    _impl = std::make_unique<Swapchain::Impl>(*this, device, nullptr);
+    _impl->swapchain.extent = size;
+    _impl->swapchain.image_format = format;
+    _impl->swapchain.image_count = image_count;
+    _impl->build_offscreen_images();
+    setFramesInFlight(DEFAULT_FRAMES_IN_FLIGHT);
 }
 
 Swapchain::Impl::Impl(Swapchain& parent, Device& device, GLFWwindow* window) : parent(parent), device(device), window(window) {
-    CHECK_VK_THROW(glfwCreateWindowSurface(device.context.instance, window, nullptr, &surface));
+    if (window)
+        CHECK_VK_THROW(glfwCreateWindowSurface(device.context.instance, window, nullptr, &surface));
 }
 
 void Swapchain::Impl::build_swapchain() {
+    if (offscreen()) {
+        build_offscreen_images();
+        return;
+    }
+
     uint32_t surface_formats_count;
     CHECK_VK_THROW(vkGetPhysicalDeviceSurfaceFormatsKHR(device.physical_device, surface, &surface_formats_count, nullptr));
 
@@ -102,18 +126,33 @@ void Swapchain::Impl::build_swapchain() {
         throw std::runtime_error("failure to build a swapchain");
     }
 
+    // Present ids start over with the new swapchain
+    pacer.reset_presents();
+
+    auto images = swapchain.get_images().value();
+    VkExtent3D size = { swapchain.extent.width, swapchain.extent.height, 1 };
     for (int i = 0; i < swapchain.image_count; i++) {
-        slots.emplace_back(std::make_unique<SwapchainSlot>(parent));
+        slots.emplace_back(std::make_unique<SwapchainSlot>(parent, std::make_unique<Image>(make_image_from(device, images[i], VK_IMAGE_TYPE_2D, size, swapchain.image_format)), i));
     }
 }
 
+/// Same usages as the ones we ask of real swapchains, plus being able to read them back
+void Swapchain::Impl::build_offscreen_images() {
+    VkExtent3D size = { swapchain.extent.width, swapchain.extent.height, 1 };
+    auto usage = static_cast<VkImageUsageFlagBits>(VK_IMAGE_USAGE_TRANSFER_SRC_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | VK_IMAGE_USAGE_STORAGE_BIT);
+    for (uint32_t i = 0; i < swapchain.image_count; i++)
+        slots.emplace_back(std::make_unique<SwapchainSlot>(parent, std::make_unique<Image>(device, VK_IMAGE_TYPE_2D, size, swapchain.image_format, usage), i));
+}
+
 void Swapchain::Impl::destroy_swapchain() {
     slots.clear();
-    vkb::destroy_swapchain(swapchain);
+    if (!offscreen())
+        vkb::destroy_swapchain(swapchain);
 }
 
 Swapchain::Impl::~Impl() {
-    vkDestroySurfaceKHR(device.context.dispatch.instance, surface, nullptr);
+    if (surface)
+        vkDestroySurfaceKHR(device.context.dispatch.instance, surface, nullptr);
 }
 
 Device& Swapchain::device() const { return _impl->device; }
@@ -125,35 +164,28 @@ VkFormat Swapchain::format() const {
 /// Acquires the next image
 std::optional<std::tuple<SwapchainSlot&, VkSemaphore>> nextSwapchainSlot(Swapchain::Impl* _impl) {
     auto& device = _impl->device;
-    auto& vk = device.dispatch;
 
-    uint32_t image_index;
-
-    VkSemaphore image_acquired_semaphore;
-    CHECK_VK_THROW(vkCreateSemaphore(device.device, tmpPtr<VkSemaphoreCreateInfo>({
-        .sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO,
-    }), nullptr, &image_acquired_semaphore));
+    // Offscreen images are used round-robin, they are ready as soon as the last frame that used them is done (and read back)
+    if (_impl->offscreen()) {
+        SwapchainSlot& slot = *_impl->slots[_impl->frame_counter % _impl->slots.size()];
+        if (slot.last_use)
+            slot.last_use->wait();
+        slot.last_use.reset();
+        return std::tuple<SwapchainSlot&, VkSemaphore>(slot, VK_NULL_HANDLE);
+    }
 
-    vk.setDebugUtilsObjectNameEXT(tmpPtr<VkDebugUtilsObjectNameInfoEXT>({
-        .sType = VK_STRUCTURE_TYPE_DEBUG_UTILS_OBJECT_NAME_INFO_EXT,
-        .objectType = VK_OBJECT_TYPE_SEMAPHORE,
-        .objectHandle = reinterpret_cast<uint64_t>(image_acquired_semaphore),
-        .pObjectName = "SwapchainSlot::image_acquired"
-    }));
+    uint32_t image_index;
 
-    VkFence fence;
-    CHECK_VK_THROW(vkCreateFence(device.device, tmpPtr<VkFenceCreateInfo>({
-        .sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO,
-    }), nullptr, &fence));
+    VkSemaphore image_acquired_semaphore = device._impl->get_binary_semaphore(device);
 
-    VkResult acquire_result = device.dispatch.acquireNextImageKHR(_impl->swapchain, UINT64_MAX, image_acquired_semaphore, fence, &image_index);
+    VkResult acquire_result = device.dispatch.acquireNextImageKHR(_impl->swapchain, UINT64_MAX, image_acquired_semaphore, VK_NULL_HANDLE, &image_index);
     switch (acquire_result) {
         case VK_SUCCESS: break;
         case VK_SUBOPTIMAL_KHR: _impl->should_resize = true; break;
         case VK_ERROR_OUT_OF_DATE_KHR: {
             fprintf(stderr, "Acquire failed. We need to resize!\n");
-            vkDestroySemaphore(device.device, image_acquired_semaphore, nullptr);
-            vkDestroyFence(device.device, fence, nullptr);
+            // A failed acquire leaves the semaphore untouched
+            device._impl->recycle_binary_semaphore(image_acquired_semaphore);
             return std::nullopt;
         }
         default:
@@ -164,22 +196,7 @@ std::optional<std::tuple<SwapchainSlot&, VkSemaphore>> nextSwapchainSlot(Swapcha
     // We know the next image !
     SwapchainSlot& slot = *_impl->slots[image_index];
     //printf("Image acquired: %d\n", image_index);
-    slot.image = _impl->swapchain.get_images().value()[image_index];
-    slot.image_index = image_index;
-
-    VkFence prev_fence = slot.wait_for_previous_present;
-    slot.wait_for_previous_present = fence;
-
-    // let's recycle the resources that last slot used...
-    // First make sure the _previous_ present is finished.
-    // We could also set and wait on an acquire fence, but the validation layers are apparently not convinced this is sufficiently safe...
-    if (prev_fence) {
-        CHECK_VK_THROW(vkWaitForFences(device.device, 1, &prev_fence, true, UINT64_MAX));
-        vkDestroyFence(device.device, prev_fence, nullptr);
-    }
-    //printf("Waited for %llx\n", (uint64_t) slot.wait_for_previous_present);
-
-    slot.frame.reset();
+    assert(slot.image_index == image_index);
 
     return std::tie<SwapchainSlot&, VkSemaphore>(slot, image_acquired_semaphore);
 }
@@ -188,13 +205,54 @@ void Swapchain::resize() {
     _impl->should_resize = true;
 }
 
+void Swapchain::setReadback(ReadbackFn fn) {
+    _impl->readback = std::move(fn);
+}
+
+void Swapchain::Impl::read_back(Swapchain::Frame& frame) {
+    if (!readback)
+        return;
+    auto& slot = frame._impl->slot;
+    auto& image = *slot.wrapped_image;
+    slot.pixels.resize(image.host_size());
+
+    std::vector<Device::Token> wait_for;
+    if (frame._impl->timeline_value > 0)
+        wait_for.push_back({ &device, frame._impl->timeline_value });
+    auto token = image.downloadDataAsync(slot.pixels.data(), {}, std::move(wait_for));
+    token.then([callback = readback, id = frame.id, &image, &pixels = slot.pixels]() {
+        callback(id, image, pixels.data(), pixels.size());
+    });
+    // The next frame in this slot starts over from an undefined image without waiting on the copy, and reuses the pixels
+    slot.last_use = token;
+}
+
+void Swapchain::setFramesInFlight(uint32_t count) {
+    if (count == 0)
+        throw std::runtime_error("need at least one frame in flight");
+    drain();
+    _impl->frame_contexts.clear();
+    for (uint32_t i = 0; i < count; i++)
+        _impl->frame_contexts.emplace_back(std::make_unique<FrameContext>(_impl->device));
+}
+
+uint32_t Swapchain::framesInFlight() const {
+    return _impl->frame_contexts.size();
+}
+
 void Swapchain::drain() {
     auto& device = _impl->device;
     vkDeviceWaitIdle(device.device);
 
+    for (auto& context : _impl->frame_contexts) {
+        if (context->frame && context->frame->_impl->submitted)
+            context->frame.reset();
+    }
+    // Runs the pending readback callbacks, they use the slots
     for (auto& slot : _impl->slots) {
-        if (slot->frame && slot->frame->_impl->submitted)
-            slot->frame.reset();
+        if (slot->last_use)
+            slot->last_use->wait();
+        slot->last_use.reset();
     }
     //_impl->prev_frames.clear();
 }
@@ -6,57 +6,127 @@
 namespace imr {
 
 struct SwapchainSlot;
+struct FrameContext;
+
+/// Decides when the next frame starts, see Swapchain::Pacing.
+/// Times are in nanoseconds, as given by imr_get_time_nano(), and averages stay at 0 until something was measured.
+struct FramePacer {
+    uint64_t cpu_time = 0;
+    uint64_t gpu_time = 0;
+    uint64_t present_interval = 0;
+
+    /// When the frame being recorded started, for measuring cpu_time
+    uint64_t frame_start = 0;
+    /// Earliest start of the next frame allowed by maxFps
+    uint64_t next_start = 0;
+    /// Present ids are only meaningful for the swapchain they were queued on, this restarts them
+    uint64_t present_id = 0;
+    uint64_t last_present_done = 0;
+    /// Device timeline value of the last frame that got submitted
+    uint64_t last_timeline_value = 0;
+
+    /// Blocks until the next frame should start recording. Called by beginFrame() once a frame in flight is free.
+    void wait_for_next_frame(Swapchain::Impl&);
+    /// Called when the frame gets presented, returns the present id to use (0 if we can't use them)
+    uint64_t frame_recorded(Swapchain::Impl&, Swapchain::Frame&);
+    /// Reads back the GPU time of the last frame that used this context, it has to be done already
+    void frame_done(Device&, FrameContext&);
+    void reset_presents();
+};
 
 struct Swapchain::Impl {
     Swapchain& parent;
     Device& device;
+    /// nullptr for offscreen swapchains, which have no surface either
     GLFWwindow* window = nullptr;
     Impl(Swapchain& parent, Device&, GLFWwindow*);
     ~Impl();
 
-    VkSurfaceKHR surface;
+    VkSurfaceKHR surface = VK_NULL_HANDLE;
     size_t frame_counter = 0;
 
-    uint64_t last_present = 0;
+    FramePacer pacer;
     bool should_resize = false;
 
+    /// Offscreen swapchains only fill in the extent, format and image count
     vkb::Swapchain swapchain;
     std::vector<std::unique_ptr<SwapchainSlot>> slots;
+    /// One per frame in flight, used round-robin
+    std::vector<std::unique_ptr<FrameContext>> frame_contexts;
+
+    bool offscreen() const { return window == nullptr; }
+    Swapchain::ReadbackFn readback;
+    /// Layout presentFromBuffer() and presentFromImage() leave the swapchain images in
+    VkImageLayout present_layout() const { return offscreen() ? VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL : VK_IMAGE_LAYOUT_PRESENT_SRC_KHR; }
+    /// What presenting means for offscreen swapchains
+    void read_back(Swapchain::Frame&);
 
     void build_swapchain();
+    void build_offscreen_images();
     void destroy_swapchain();
 };
 
 struct SwapchainSlot {
     Swapchain& swapchain;
-    SwapchainSlot(Swapchain& s);
+    SwapchainSlot(Swapchain& s, std::unique_ptr<Image>&& image, uint32_t image_index);
     SwapchainSlot(SwapchainSlot&) = delete;
 
     VkImage image;
     uint32_t image_index;
+    /// Lives as long as the swapchain, so its view is stable across frames (and descriptor sets using it get reused).
+    /// Owns the image for offscreen swapchains.
+    std::unique_ptr<Image> wrapped_image;
+    /// Where offscreen frames are read back to
+    std::vector<uint8_t> pixels;
+    /// Offscreen only, there's no acquire to tell us: the image can be rendered to again once this is done (the last frame using it, or its readback)
+    std::optional<Device::Token> last_use;
 
     VkSemaphore copy_done;
+    /// Only reused once this image is acquired again, at which point the previous present waiting on it is done
     VkSemaphore present_semaphore;
-    VkFence wait_for_previous_present = VK_NULL_HANDLE;
+
+    ~SwapchainSlot();
+};
+
+/// Resources of one of the frames in flight, recycled once the last frame that used them is done on the GPU.
+/// They are not tied to the swapchain images: how far ahead the CPU can get is up to us, not up to the image count the driver picked.
+struct FrameContext {
+    Device& device;
+    FrameContext(Device&);
+    FrameContext(FrameContext&) = delete;
+    ~FrameContext();
+
+    /// Command buffers for the frame using this context come from here (one pool per recording thread), they are all reset when the frame is recycled
+    std::unique_ptr<CommandPoolRegistry> command_pools;
 
     std::unique_ptr<Swapchain::Frame> frame = nullptr;
 
-    ~SwapchainSlot();
+    /// Start and end of renderFrameSimplified() command buffers, for measuring GPU frame times (VK_NULL_HANDLE if the queue can't do timestamps)
+    VkQueryPool timestamps = VK_NULL_HANDLE;
+    bool timestamps_written = false;
+    void write_timestamp(VkCommandBuffer, VkPipelineStageFlags2, uint32_t query);
 };
 
 struct Swapchain::Frame::Impl {
     Device& device;
     SwapchainSlot& slot;
-    std::unique_ptr<Image> image;
+    FrameContext& context;
     bool submitted = false;
+    /// Device timeline value signaled by the submission that renders this frame, everything is recycled once it is reached
+    uint64_t timeline_value = 0;
 
     Impl(Impl&) = delete;
     Impl(Impl&&) = default;
     Impl& operator=(Impl&&) = default;
-    Impl(Device&, SwapchainSlot&);
+    Impl(Device&, SwapchainSlot&, FrameContext&);
 
     std::vector<VkFence> cleanup_fences;
     std::vector<std::function<void(void)>> cleanup_queue;
+    /// See Frame::markUsed, they get the timeline value once we know it
+    std::vector<Buffer*> used_buffers;
+
+    /// Called with the submission lock held, right before the frame is submitted
+    void set_timeline_value(uint64_t);
 };
 
 std::optional<std::tuple<SwapchainSlot&, VkSemaphore>> nextSwapchainSlot(Swapchain::Impl* _impl);
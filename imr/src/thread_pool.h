@@ -0,0 +1,75 @@
+#ifndef IMR_THREAD_POOL_H
+#define IMR_THREAD_POOL_H
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace imr {
+
+/// Fixed set of worker threads consuming a FIFO of jobs. The destructor finishes the queued jobs before joining.
+struct ThreadPool {
+    explicit ThreadPool(unsigned threads) {
+        if (threads == 0)
+            threads = std::max(1u, std::thread::hardware_concurrency());
+        for (unsigned i = 0; i < threads; i++)
+            workers.emplace_back([this]() { work(); });
+    }
+    ThreadPool(ThreadPool&) = delete;
+
+    ~ThreadPool() {
+        {
+            std::lock_guard guard(mutex);
+            stopping = true;
+        }
+        cv.notify_all();
+        for (auto& worker : workers)
+            worker.join();
+    }
+
+    /// Exceptions thrown by fn end up in the returned future
+    template<typename F>
+    auto submit(F&& fn) -> std::future<decltype(fn())> {
+        auto task = std::make_shared<std::packaged_task<decltype(fn())()>>(std::forward<F>(fn));
+        auto future = task->get_future();
+        {
+            std::lock_guard guard(mutex);
+            jobs.emplace_back([task]() { (*task)(); });
+        }
+        cv.notify_one();
+        return future;
+    }
+
+    size_t size() const { return workers.size(); }
+
+private:
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::deque<std::function<void()>> jobs;
+    std::vector<std::thread> workers;
+    bool stopping = false;
+
+    void work() {
+        while (true) {
+            std::function<void()> job;
+            {
+                std::unique_lock lock(mutex);
+                cv.wait(lock, [&]() { return stopping || !jobs.empty(); });
+                if (jobs.empty())
+                    return;
+                job = std::move(jobs.front());
+                jobs.pop_front();
+            }
+            job();
+        }
+    }
+};
+
+}
+
+#endif
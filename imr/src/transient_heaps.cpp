@@ -0,0 +1,69 @@
+#include "imr_private.h"
+
+namespace imr {
+
+TransientHeaps& Device::Impl::transient_heaps(Device& device) {
+    if (!transient)
+        transient = std::make_unique<TransientHeaps>(device);
+    return *transient;
+}
+
+TransientHeaps::TransientHeaps(Device& device) : device(device) {}
+
+TransientHeaps::~TransientHeaps() {
+    for (auto& entry : free)
+        vmaFreeMemory(device._impl->allocator, entry.heap.allocation);
+}
+
+TransientHeaps::Heap TransientHeaps::acquire(VkDeviceSize size, uint32_t memory_type_bits, bool lazy) {
+    {
+        std::lock_guard guard(mutex);
+        std::optional<size_t> best;
+        for (size_t i = 0; i < free.size(); i++) {
+            auto& candidate = free[i].heap;
+            if (candidate.size < size || !(memory_type_bits & (1u << candidate.memory_type)))
+                continue;
+            if (!best || candidate.size < free[*best].heap.size)
+                best = i;
+        }
+        if (best) {
+            Heap heap = free[*best].heap;
+            free.erase(free.begin() + *best);
+            return heap;
+        }
+    }
+
+    // Dedicated, so the resources can be bound at offsets relative to the start of the memory without extra alignment concerns
+    VmaAllocationCreateInfo alloc_info = {
+        .flags = VMA_ALLOCATION_CREATE_DEDICATED_MEMORY_BIT,
+        .requiredFlags = VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+        .preferredFlags = lazy ? (VkMemoryPropertyFlags) VK_MEMORY_PROPERTY_LAZILY_ALLOCATED_BIT : 0,
+    };
+    Heap heap = { .size = size };
+    VmaAllocationInfo allocation_info;
+    CHECK_VK_THROW(vmaAllocateMemory(device._impl->allocator, tmpPtr<VkMemoryRequirements>({
+        .size = size,
+        .alignment = 1,
+        .memoryTypeBits = memory_type_bits,
+    }), &alloc_info, &heap.allocation, &allocation_info));
+    heap.memory_type = allocation_info.memoryType;
+    return heap;
+}
+
+void TransientHeaps::release(Heap heap) {
+    std::lock_guard guard(mutex);
+    free.push_back({ heap, frame_clock });
+}
+
+void TransientHeaps::trim() {
+    std::lock_guard guard(mutex);
+    frame_clock++;
+    std::erase_if(free, [&](Free& entry) {
+        if (frame_clock - entry.released_at <= MAX_UNUSED_FRAMES)
+            return false;
+        vmaFreeMemory(device._impl->allocator, entry.heap.allocation);
+        return true;
+    });
+}
+
+}